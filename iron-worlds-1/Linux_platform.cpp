@@ -1,8 +1,15 @@
 #include "platform.h"
 #include "Linux_platform.h"
 
+#include <cerrno>
 #include <chrono>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/inotify.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 #include <thread>
+#include <unistd.h>
 #include <unordered_map>
 
 namespace platform
@@ -23,4 +30,316 @@ namespace platform
         {XK_Down, InputCode::DownArrow},
         {XK_space, InputCode::Space},
     };
+
+    class Linux_FileChangeMonitor : public FileChangeMonitor
+    {
+        // watches the containing directories rather than the files, since
+        // editors often save by writing a new file and renaming it over the
+        // old one, which would end a watch on the file itself
+        int inotifyDescriptor;
+        std::unordered_map<int, std::string> directoryByWatch;
+        // from the path as seen in events to the path as given to watch
+        std::unordered_map<std::string, std::string> watchedPaths;
+
+    public:
+        Linux_FileChangeMonitor() : inotifyDescriptor(inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) {}
+        ~Linux_FileChangeMonitor()
+        {
+            if (inotifyDescriptor >= 0)
+            {
+                close(inotifyDescriptor);
+            }
+        }
+
+        bool watch(const std::string& path)
+        {
+            if (inotifyDescriptor < 0)
+            {
+                return false;
+            }
+            size_t slash = path.rfind('/');
+            std::string directory = (slash == std::string::npos) ? "." : path.substr(0, slash);
+            std::string fullPath = (slash == std::string::npos) ? "./" + path : path;
+            int watchDescriptor = inotify_add_watch(inotifyDescriptor, directory.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO);
+            if (watchDescriptor < 0)
+            {
+                return false;
+            }
+            directoryByWatch[watchDescriptor] = directory;
+            watchedPaths[fullPath] = path;
+            return true;
+        }
+
+        void waitForChanges(int timeoutMilliseconds, std::vector<std::string>& changedPaths)
+        {
+            pollfd request = {inotifyDescriptor, POLLIN, 0};
+            if (inotifyDescriptor < 0 || poll(&request, 1, timeoutMilliseconds) <= 0)
+            {
+                return;
+            }
+
+            alignas(inotify_event) char buffer[4096];
+            ssize_t length;
+            while ((length = read(inotifyDescriptor, buffer, sizeof(buffer))) > 0)
+            {
+                for (char* event_Ptr = buffer; event_Ptr < buffer + length;)
+                {
+                    inotify_event* event = reinterpret_cast<inotify_event*>(event_Ptr);
+                    if (event->len > 0)
+                    {
+                        std::string path = directoryByWatch[event->wd] + "/" + event->name;
+                        auto found = watchedPaths.find(path);
+                        if (found != watchedPaths.end())
+                        {
+                            changedPaths.push_back(found->second);
+                        }
+                    }
+                    event_Ptr += sizeof(inotify_event) + event->len;
+                }
+            }
+        }
+    };
+
+    std::unique_ptr<FileChangeMonitor> makeFileChangeMonitor()
+    {
+        return std::unique_ptr<FileChangeMonitor>(new Linux_FileChangeMonitor());
+    }
+
+    class Linux_LocalServer : public LocalServer
+    {
+        // a Unix domain socket server, plus a pipe for wake to write to.
+        // Client sockets are non-blocking and keep what they could not take
+        // yet, so a client that stops reading holds up no other
+        struct Client
+        {
+            int id;
+            int descriptor;
+            std::string unsent;
+        };
+
+        // a client that lets this much output pile up is dropped
+        static const size_t maxUnsent = 1 << 20;
+
+        std::string path;
+        int listenDescriptor = -1;
+        int wakePipe[2] = {-1, -1};
+        std::vector<Client> clients;
+        int nextClientId = 0;
+        // clients dropped since waitForInput last reported them
+        std::vector<int> droppedIds;
+
+        void dropClient(size_t index)
+        {
+            droppedIds.push_back(clients[index].id);
+            close(clients[index].descriptor);
+            clients.erase(clients.begin() + index);
+        }
+
+        // whether the last socket call failed only for now. EWOULDBLOCK is
+        // EAGAIN on Linux, so comparing both unconditionally is redundant
+        static bool tryLater()
+        {
+#if EAGAIN != EWOULDBLOCK
+            if (errno == EWOULDBLOCK)
+            {
+                return true;
+            }
+#endif
+            return errno == EAGAIN || errno == EINTR;
+        }
+
+        // sends as much unsent output as the socket takes, false if the
+        // client has gone away
+        bool flush(Client& client)
+        {
+            size_t sent = 0;
+            while (sent < client.unsent.size())
+            {
+                ssize_t length = ::send(client.descriptor, client.unsent.data() + sent, client.unsent.size() - sent, MSG_NOSIGNAL);
+                if (length < 0 && tryLater())
+                {
+                    break;
+                }
+                if (length <= 0)
+                {
+                    return false;
+                }
+                sent += length;
+            }
+            client.unsent.erase(0, sent);
+            return true;
+        }
+
+    public:
+        explicit Linux_LocalServer(const std::string& address) : path(address) {}
+
+        ~Linux_LocalServer()
+        {
+            while (!clients.empty())
+            {
+                dropClient(clients.size() - 1);
+            }
+            if (listenDescriptor >= 0)
+            {
+                close(listenDescriptor);
+                unlink(path.c_str());
+            }
+            for (int descriptor : wakePipe)
+            {
+                if (descriptor >= 0)
+                {
+                    close(descriptor);
+                }
+            }
+        }
+
+        bool start()
+        {
+            sockaddr_un address = {};
+            address.sun_family = AF_UNIX;
+            if (path.size() >= sizeof(address.sun_path))
+            {
+                ELOG("socket path too long: " << path);
+                return false;
+            }
+            path.copy(address.sun_path, path.size());
+
+            if (pipe2(wakePipe, O_CLOEXEC | O_NONBLOCK) != 0)
+            {
+                return false;
+            }
+            listenDescriptor = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+            if (listenDescriptor < 0)
+            {
+                return false;
+            }
+            // a stale socket file from an earlier run would block bind
+            unlink(path.c_str());
+            if (bind(listenDescriptor, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0
+                || listen(listenDescriptor, 8) != 0)
+            {
+                close(listenDescriptor);
+                listenDescriptor = -1;
+                return false;
+            }
+            return true;
+        }
+
+        void waitForInput(int timeoutMilliseconds, std::vector<std::pair<int, std::string>>& received, std::vector<int>& closed)
+        {
+            closed.insert(closed.end(), droppedIds.begin(), droppedIds.end());
+            droppedIds.clear();
+
+            std::vector<pollfd> requests;
+            requests.push_back({listenDescriptor, POLLIN, 0});
+            requests.push_back({wakePipe[0], POLLIN, 0});
+            for (Client& client : clients)
+            {
+                short events = client.unsent.empty() ? POLLIN : POLLIN | POLLOUT;
+                requests.push_back({client.descriptor, events, 0});
+            }
+
+            if (poll(requests.data(), requests.size(), timeoutMilliseconds) <= 0)
+            {
+                return;
+            }
+
+            char buffer[4096];
+            if (requests[1].revents & POLLIN)
+            {
+                while (read(wakePipe[0], buffer, sizeof(buffer)) > 0) {}
+            }
+
+            // walk backwards so dropping a client keeps earlier indices valid
+            for (size_t i = clients.size(); i > 0; i--)
+            {
+                short revents = requests[i + 1].revents;
+                if (!revents)
+                {
+                    continue;
+                }
+                if ((revents & POLLOUT) && !flush(clients[i - 1]))
+                {
+                    dropClient(i - 1);
+                    continue;
+                }
+                if (!(revents & ~POLLOUT))
+                {
+                    continue;
+                }
+                ssize_t length = recv(clients[i - 1].descriptor, buffer, sizeof(buffer), 0);
+                if (length < 0 && tryLater())
+                {
+                    continue;
+                }
+                if (length <= 0)
+                {
+                    dropClient(i - 1);
+                }
+                else
+                {
+                    received.push_back(std::make_pair(clients[i - 1].id, std::string(buffer, length)));
+                }
+            }
+
+            if (requests[0].revents & POLLIN)
+            {
+                int descriptor = accept4(listenDescriptor, nullptr, nullptr, SOCK_CLOEXEC | SOCK_NONBLOCK);
+                if (descriptor >= 0)
+                {
+                    clients.push_back({nextClientId++, descriptor, std::string()});
+                }
+            }
+        }
+
+        void send(int client, const std::string& text)
+        {
+            for (size_t i = 0; i < clients.size(); i++)
+            {
+                if (clients[i].id != client)
+                {
+                    continue;
+                }
+                // whatever the socket does not take now goes out when poll
+                // reports it writable
+                clients[i].unsent += text;
+                if (!flush(clients[i]) || clients[i].unsent.size() > maxUnsent)
+                {
+                    dropClient(i);
+                }
+                return;
+            }
+        }
+
+        void disconnect(int client)
+        {
+            for (size_t i = 0; i < clients.size(); i++)
+            {
+                if (clients[i].id == client)
+                {
+                    dropClient(i);
+                    return;
+                }
+            }
+        }
+
+        void wake()
+        {
+            char signal = 0;
+            if (write(wakePipe[1], &signal, 1) < 0)
+            {
+                // the pipe is full, so a wake is already pending
+            }
+        }
+    };
+
+    std::unique_ptr<LocalServer> makeLocalServer(const std::string& address)
+    {
+        std::unique_ptr<Linux_LocalServer> server(new Linux_LocalServer(address));
+        if (!server->start())
+        {
+            return nullptr;
+        }
+        return std::unique_ptr<LocalServer>(server.release());
+    }
 }
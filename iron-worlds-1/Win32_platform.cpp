@@ -1,9 +1,24 @@
+// winsock2.h has to come before anything that includes windows.h
+#include <winsock2.h>
+
 #include "platform.h"
 #include "Win32_platform.h"
 
+#include <initializer_list>
 #include <windows.h>
 #include <unordered_map>
 
+#if __has_include(<afunix.h>)
+#include <afunix.h>
+#else
+// older MinGW headers lack afunix.h
+struct sockaddr_un
+{
+    ADDRESS_FAMILY sun_family;
+    char sun_path[108];
+};
+#endif
+
 namespace platform
 {
     std::unordered_map<unsigned int, InputCode> inputCodeMap =
@@ -22,4 +37,304 @@ namespace platform
         {VK_DOWN, InputCode::DownArrow},
         {VK_SPACE, InputCode::Space},
     };
+
+    class Win32_FileChangeMonitor : public FileChangeMonitor
+    {
+        // polls last-write times, which is cheap for the handful of script
+        // files we watch
+        std::vector<std::pair<std::string, FILETIME>> watchedFiles;
+
+        static FILETIME lastWriteTime(const std::string& path)
+        {
+            WIN32_FILE_ATTRIBUTE_DATA attributes;
+            FILETIME result = {0, 0};
+            if (GetFileAttributesExA(path.c_str(), GetFileExInfoStandard, &attributes))
+            {
+                result = attributes.ftLastWriteTime;
+            }
+            return result;
+        }
+
+    public:
+        bool watch(const std::string& path)
+        {
+            watchedFiles.push_back(std::make_pair(path, lastWriteTime(path)));
+            return true;
+        }
+
+        void waitForChanges(int timeoutMilliseconds, std::vector<std::string>& changedPaths)
+        {
+            Sleep(timeoutMilliseconds);
+            for (std::pair<std::string, FILETIME>& file : watchedFiles)
+            {
+                FILETIME newTime = lastWriteTime(file.first);
+                if (CompareFileTime(&newTime, &file.second) != 0)
+                {
+                    file.second = newTime;
+                    changedPaths.push_back(file.first);
+                }
+            }
+        }
+    };
+
+    std::unique_ptr<FileChangeMonitor> makeFileChangeMonitor()
+    {
+        return std::unique_ptr<FileChangeMonitor>(new Win32_FileChangeMonitor());
+    }
+
+    class Win32_LocalServer : public LocalServer
+    {
+        // an AF_UNIX socket server, which Windows has from Windows 10 1803.
+        // WSAEventSelect ties each socket to an event, which also makes it
+        // non-blocking, and wake sets one more event. As on Linux, output a
+        // client does not take yet is kept until the socket is writable
+        struct Client
+        {
+            int id;
+            SOCKET socket;
+            WSAEVENT event;
+            std::string unsent;
+        };
+
+        // a client that lets this much output pile up is dropped
+        static const size_t maxUnsent = 1 << 20;
+
+        std::string path;
+        bool winsockStarted = false;
+        SOCKET listenSocket = INVALID_SOCKET;
+        WSAEVENT listenEvent = WSA_INVALID_EVENT;
+        WSAEVENT wakeEvent = WSA_INVALID_EVENT;
+        std::vector<Client> clients;
+        int nextClientId = 0;
+        // clients dropped since waitForInput last reported them
+        std::vector<int> droppedIds;
+
+        void dropClient(size_t index)
+        {
+            droppedIds.push_back(clients[index].id);
+            closesocket(clients[index].socket);
+            WSACloseEvent(clients[index].event);
+            clients.erase(clients.begin() + index);
+        }
+
+        // sends as much unsent output as the socket takes, false if the
+        // client has gone away
+        bool flush(Client& client)
+        {
+            size_t sent = 0;
+            while (sent < client.unsent.size())
+            {
+                int length = ::send(client.socket, client.unsent.data() + sent, int(client.unsent.size() - sent), 0);
+                if (length == SOCKET_ERROR && WSAGetLastError() == WSAEWOULDBLOCK)
+                {
+                    break;
+                }
+                if (length <= 0)
+                {
+                    return false;
+                }
+                sent += length;
+            }
+            client.unsent.erase(0, sent);
+            return true;
+        }
+
+        void acceptClients()
+        {
+            SOCKET accepted;
+            while ((accepted = accept(listenSocket, nullptr, nullptr)) != INVALID_SOCKET)
+            {
+                // WSAWaitForMultipleEvents takes a limited number of events,
+                // two of which are the server's own
+                WSAEVENT event = WSACreateEvent();
+                if (clients.size() + 2 >= WSA_MAXIMUM_WAIT_EVENTS || event == WSA_INVALID_EVENT
+                    || WSAEventSelect(accepted, event, FD_READ | FD_WRITE | FD_CLOSE) != 0)
+                {
+                    closesocket(accepted);
+                    if (event != WSA_INVALID_EVENT)
+                    {
+                        WSACloseEvent(event);
+                    }
+                    continue;
+                }
+                clients.push_back({nextClientId++, accepted, event, std::string()});
+            }
+        }
+
+    public:
+        explicit Win32_LocalServer(const std::string& address) : path(address) {}
+
+        ~Win32_LocalServer()
+        {
+            while (!clients.empty())
+            {
+                dropClient(clients.size() - 1);
+            }
+            if (listenSocket != INVALID_SOCKET)
+            {
+                closesocket(listenSocket);
+                DeleteFileA(path.c_str());
+            }
+            for (WSAEVENT event : {listenEvent, wakeEvent})
+            {
+                if (event != WSA_INVALID_EVENT)
+                {
+                    WSACloseEvent(event);
+                }
+            }
+            if (winsockStarted)
+            {
+                WSACleanup();
+            }
+        }
+
+        bool start()
+        {
+            sockaddr_un address = {};
+            address.sun_family = AF_UNIX;
+            if (path.size() >= sizeof(address.sun_path))
+            {
+                ELOG("socket path too long: " << path);
+                return false;
+            }
+            path.copy(address.sun_path, path.size());
+
+            WSADATA data;
+            if (WSAStartup(MAKEWORD(2, 2), &data) != 0)
+            {
+                return false;
+            }
+            winsockStarted = true;
+            listenEvent = WSACreateEvent();
+            wakeEvent = WSACreateEvent();
+            if (listenEvent == WSA_INVALID_EVENT || wakeEvent == WSA_INVALID_EVENT)
+            {
+                return false;
+            }
+            // fails on Windows versions without AF_UNIX support
+            listenSocket = socket(AF_UNIX, SOCK_STREAM, 0);
+            if (listenSocket == INVALID_SOCKET)
+            {
+                return false;
+            }
+            // a stale socket file from an earlier run would block bind
+            DeleteFileA(path.c_str());
+            if (bind(listenSocket, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0
+                || listen(listenSocket, 8) != 0
+                || WSAEventSelect(listenSocket, listenEvent, FD_ACCEPT) != 0)
+            {
+                closesocket(listenSocket);
+                listenSocket = INVALID_SOCKET;
+                return false;
+            }
+            return true;
+        }
+
+        void waitForInput(int timeoutMilliseconds, std::vector<std::pair<int, std::string>>& received, std::vector<int>& closed)
+        {
+            closed.insert(closed.end(), droppedIds.begin(), droppedIds.end());
+            droppedIds.clear();
+
+            std::vector<WSAEVENT> events;
+            events.push_back(listenEvent);
+            events.push_back(wakeEvent);
+            for (Client& client : clients)
+            {
+                events.push_back(client.event);
+            }
+
+            DWORD result = WSAWaitForMultipleEvents(events.size(), events.data(), FALSE, timeoutMilliseconds, FALSE);
+            if (result == WSA_WAIT_TIMEOUT || result == WSA_WAIT_FAILED)
+            {
+                return;
+            }
+            WSAResetEvent(wakeEvent);
+
+            // walk backwards so dropping a client keeps earlier indices valid
+            char buffer[4096];
+            for (size_t i = clients.size(); i > 0; i--)
+            {
+                Client& client = clients[i - 1];
+                WSANETWORKEVENTS happened;
+                if (WSAEnumNetworkEvents(client.socket, client.event, &happened) != 0)
+                {
+                    dropClient(i - 1);
+                    continue;
+                }
+                if ((happened.lNetworkEvents & FD_WRITE) && !flush(client))
+                {
+                    dropClient(i - 1);
+                    continue;
+                }
+                if (!(happened.lNetworkEvents & (FD_READ | FD_CLOSE)))
+                {
+                    continue;
+                }
+                int length = recv(client.socket, buffer, sizeof(buffer), 0);
+                if (length == SOCKET_ERROR && WSAGetLastError() == WSAEWOULDBLOCK)
+                {
+                    continue;
+                }
+                if (length <= 0)
+                {
+                    dropClient(i - 1);
+                }
+                else
+                {
+                    received.push_back(std::make_pair(client.id, std::string(buffer, length)));
+                }
+            }
+
+            WSANETWORKEVENTS happened;
+            if (WSAEnumNetworkEvents(listenSocket, listenEvent, &happened) == 0 && (happened.lNetworkEvents & FD_ACCEPT))
+            {
+                acceptClients();
+            }
+        }
+
+        void send(int client, const std::string& text)
+        {
+            for (size_t i = 0; i < clients.size(); i++)
+            {
+                if (clients[i].id != client)
+                {
+                    continue;
+                }
+                // whatever the socket does not take now goes out on FD_WRITE
+                clients[i].unsent += text;
+                if (!flush(clients[i]) || clients[i].unsent.size() > maxUnsent)
+                {
+                    dropClient(i);
+                }
+                return;
+            }
+        }
+
+        void disconnect(int client)
+        {
+            for (size_t i = 0; i < clients.size(); i++)
+            {
+                if (clients[i].id == client)
+                {
+                    dropClient(i);
+                    return;
+                }
+            }
+        }
+
+        void wake()
+        {
+            WSASetEvent(wakeEvent);
+        }
+    };
+
+    std::unique_ptr<LocalServer> makeLocalServer(const std::string& address)
+    {
+        std::unique_ptr<Win32_LocalServer> server(new Win32_LocalServer(address));
+        if (!server->start())
+        {
+            return nullptr;
+        }
+        return std::unique_ptr<LocalServer>(server.release());
+    }
 }
@@ -1 +1,3 @@
-
+; a key is bound to the function named on- and the key's name, called with
+; t when it goes down and nil when it comes up, e.g.
+; (def on-space (lambda (down) ...))
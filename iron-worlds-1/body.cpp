@@ -15,12 +15,14 @@ namespace body
 
     matrix::Matrix<double, 4> Body::makeBasisMatrix()
     {
-        matrix::Matrix<double, 4> result;
-
-        result = angularDisplacementQuaternion.getMatrix();
-
-        result = matrix::makeTranslate(displacement.data[0], displacement.data[1], displacement.data[2]) * matrix::makeScale(radius, radius, radius) * result;
+        // the translate and scale combine first, then apply to the rotation
+        // in one pass
+        return matrix::translate(displacement.data[0], displacement.data[1], displacement.data[2])
+            * matrix::scale(radius, radius, radius) * angularDisplacementQuaternion.getMatrix();
+    }
 
-        return result;
+    matrix::Matrix<double, 4> Body::makeInverseBasisMatrix()
+    {
+        return matrix::affineInverse(makeBasisMatrix());
     }
 }
@@ -20,6 +20,8 @@ namespace body
         void integrateMotionStep(double deltaT);
 
         matrix::Matrix<double, 4> makeBasisMatrix();
+        // world to body space, for picking and culling
+        matrix::Matrix<double, 4> makeInverseBasisMatrix();
     };
 }
 
@@ -1,13 +1,13 @@
 #include "common_main.h"
 
 #include "audio.h"
+#include "hotreload.h"
 #include "input.h"
 #include "lisp.h"
 #include "logic.h"
+#include "repl.h"
 #include "scene.h"
 
-#include <thread>
-
 namespace common_main
 {
     void PlatformContext::updateButtonInput(unsigned int keyCode, bool newState)
@@ -22,31 +22,6 @@ namespace common_main
         screenMatrix = matrix::makeScale((float)newHeight / (float)newWidth, 1.0f, 1.0f);
     }
 
-    void lispThreadFunc()
-    {
-        try
-        {
-            lisp::VirtualMachine lispVM;
-            lisp::LispHandle result;
-            lispVM.readFile("programs.lsp");
-            while (true)
-            {
-                std::cout << ">>> ";
-                result = lispVM.evaluate(lispVM.read(std::cin));
-                std::cout << "--> ";
-                lispVM.printLn(result, std::cout);
-            }
-        }
-        catch (std::exception const &exc)
-        {
-            std::cerr << "Exception caught: " << exc.what() << "\n";
-        }
-        catch (...)
-        {
-            std::cerr << "Unknown exception caught\n";
-        }
-    }
-
     int main(PlatformContext& context)
     {
         scene::Scene testScene;
@@ -89,7 +64,15 @@ namespace common_main
             testScene.bodies.push_back(newBody);
         }
 
-        std::thread lispThread(lispThreadFunc);
+        lisp::VirtualMachine scriptVM;
+        std::vector<std::string> scriptPaths = {"programs.lsp", "bindings.lsp"};
+        for (const std::string& path : scriptPaths)
+        {
+            scriptVM.readFile(path);
+        }
+        hotreload::ScriptWatcher scriptWatcher(scriptPaths);
+        input::ScriptKeyBindings scriptKeys(scriptVM);
+        repl::ReplServer replServer("iron-worlds-repl.sock");
 
         audio::PCMBuffer testBuf(80000, 8000.0);
         testBuf.putNote(0, 0.1);
@@ -109,6 +92,11 @@ namespace common_main
         {
             context.checkEvents();
 
+            // frame boundary, no script code is running
+            scriptWatcher.applyPendingChanges(scriptVM);
+            replServer.serviceCommands(scriptVM);
+            scriptKeys.update(scriptVM, context.inputHandler);
+
             matrix::Matrix<double, 3, 1> cameraMover;
 
             if (context.inputHandler.queryState(platform::InputCode::A))
@@ -167,8 +155,6 @@ namespace common_main
             context.sleepForMilliseconds(10);
         }
 
-        lispThread.join();
-
         return 0;
     }
 }
@@ -0,0 +1,110 @@
+#include "concurrency.h"
+
+namespace concurrency
+{
+    WorkerPool::WorkerPool(unsigned int threadCount)
+    {
+        for (unsigned int i = 0; i < threadCount; i++)
+        {
+            threads.emplace_back(&WorkerPool::workerLoop, this);
+        }
+    }
+
+    WorkerPool::~WorkerPool()
+    {
+        {
+            std::lock_guard<std::mutex> lock(queueMutex);
+            stopping = true;
+        }
+        jobAvailable.notify_all();
+        for (std::thread& worker : threads)
+        {
+            worker.join();
+        }
+    }
+
+    void WorkerPool::workerLoop()
+    {
+        std::unique_lock<std::mutex> lock(queueMutex);
+        while (true)
+        {
+            jobAvailable.wait(lock, [this] {return stopping || !queue.empty();});
+            if (queue.empty())
+            {
+                // only reached when stopping
+                return;
+            }
+            std::function<void()> job = std::move(queue.front());
+            queue.pop_front();
+            lock.unlock();
+            job();
+            lock.lock();
+        }
+    }
+
+    void WorkerPool::runJob(std::function<void()>& job, Batch& batch)
+    {
+        // runs outside the lock, records the outcome inside it
+        std::exception_ptr error;
+        try
+        {
+            job();
+        }
+        catch (...)
+        {
+            error = std::current_exception();
+        }
+
+        std::lock_guard<std::mutex> lock(queueMutex);
+        if (error && !batch.error)
+        {
+            batch.error = error;
+        }
+        batch.remaining--;
+        jobFinished.notify_all();
+    }
+
+    void WorkerPool::runAll(std::vector<std::function<void()>>& jobs)
+    {
+        Batch batch;
+        {
+            std::lock_guard<std::mutex> lock(queueMutex);
+            batch.remaining = jobs.size();
+            for (std::function<void()>& job : jobs)
+            {
+                std::function<void()>* job_Ptr = &job;
+                queue.push_back([this, job_Ptr, &batch] {runJob(*job_Ptr, batch);});
+            }
+        }
+        jobAvailable.notify_all();
+
+        std::unique_lock<std::mutex> lock(queueMutex);
+        while (batch.remaining > 0)
+        {
+            if (!queue.empty())
+            {
+                // help out rather than block, possibly on another batch's job
+                std::function<void()> job = std::move(queue.front());
+                queue.pop_front();
+                lock.unlock();
+                job();
+                lock.lock();
+            }
+            else
+            {
+                jobFinished.wait(lock);
+            }
+        }
+
+        if (batch.error)
+        {
+            std::rethrow_exception(batch.error);
+        }
+    }
+
+    WorkerPool& WorkerPool::shared()
+    {
+        static WorkerPool pool(std::thread::hardware_concurrency() > 1 ? std::thread::hardware_concurrency() - 1 : 0);
+        return pool;
+    }
+}
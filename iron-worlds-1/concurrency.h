@@ -0,0 +1,95 @@
+#ifndef CONCURRENCY_H_INCLUDED
+#define CONCURRENCY_H_INCLUDED
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace concurrency
+{
+    template <typename T, size_t CAPACITY>
+    class SpscQueue
+    {
+        // lock-free bounded ring for exactly one producer thread and one
+        // consumer thread. One slot is kept empty to tell full from empty
+        T slots[CAPACITY];
+        std::atomic<size_t> head;
+        std::atomic<size_t> tail;
+
+    public:
+        SpscQueue() : head(0), tail(0) {}
+
+        // producer only, false if full
+        bool push(T value)
+        {
+            size_t oldTail = tail.load(std::memory_order_relaxed);
+            size_t newTail = (oldTail + 1) % CAPACITY;
+            if (newTail == head.load(std::memory_order_acquire))
+            {
+                return false;
+            }
+            slots[oldTail] = std::move(value);
+            tail.store(newTail, std::memory_order_release);
+            return true;
+        }
+
+        // consumer only, false if empty
+        bool pop(T& result)
+        {
+            size_t oldHead = head.load(std::memory_order_relaxed);
+            if (oldHead == tail.load(std::memory_order_acquire))
+            {
+                return false;
+            }
+            result = std::move(slots[oldHead]);
+            head.store((oldHead + 1) % CAPACITY, std::memory_order_release);
+            return true;
+        }
+    };
+
+    class WorkerPool
+    {
+        // a fixed set of threads that run batches of jobs
+
+        struct Batch
+        {
+            size_t remaining = 0;
+            std::exception_ptr error;
+        };
+
+        std::vector<std::thread> threads;
+        std::mutex queueMutex;
+        std::condition_variable jobAvailable;
+        std::condition_variable jobFinished;
+        std::deque<std::function<void()>> queue;
+        bool stopping = false;
+
+        void workerLoop();
+        void runJob(std::function<void()>& job, Batch& batch);
+
+    public:
+        explicit WorkerPool(unsigned int threadCount);
+        ~WorkerPool();
+
+        WorkerPool(const WorkerPool&) = delete;
+        WorkerPool& operator=(const WorkerPool&) = delete;
+
+        // the calling thread works too, so this is one more than the threads
+        unsigned int getConcurrency() const {return threads.size() + 1;}
+
+        // runs every job and returns once all have finished, rethrowing the
+        // first exception a job threw. The caller helps drain the queue, so
+        // jobs may themselves call runAll without deadlocking
+        void runAll(std::vector<std::function<void()>>& jobs);
+
+        // one pool for the whole program, sized to the machine
+        static WorkerPool& shared();
+    };
+}
+
+#endif // CONCURRENCY_H_INCLUDED
@@ -0,0 +1,227 @@
+#include "hotreload.h"
+
+#include <sstream>
+
+namespace hotreload
+{
+    std::vector<std::string> splitTopLevelForms(const std::string& source)
+    {
+        std::vector<std::string> forms;
+        std::string current;
+        int depth = 0;
+        bool pendingSpace = false;
+
+        for (size_t i = 0; i < source.size(); i++)
+        {
+            char c = source[i];
+            if (c == ';')
+            {
+                // comment runs to the end of the line
+                while (i < source.size() && source[i] != '\n')
+                {
+                    i++;
+                }
+                pendingSpace = true;
+                continue;
+            }
+            if (c == ' ' || c == '\t' || c == '\n' || c == '\r')
+            {
+                pendingSpace = true;
+                if (depth == 0 && !current.empty() && current.back() != '\'')
+                {
+                    // a bare atom at top level ends here
+                    forms.push_back(current);
+                    current.clear();
+                }
+                continue;
+            }
+
+            if (pendingSpace && !current.empty() && c != ')' && current.back() != '(' && current.back() != '\'')
+            {
+                current += ' ';
+            }
+            pendingSpace = false;
+            current += c;
+
+            if (c == '(')
+            {
+                depth++;
+            }
+            else if (c == ')')
+            {
+                depth--;
+                if (depth <= 0)
+                {
+                    depth = 0;
+                    forms.push_back(current);
+                    current.clear();
+                }
+            }
+        }
+        if (!current.empty())
+        {
+            forms.push_back(current);
+        }
+        return forms;
+    }
+
+    std::string defName(const std::string& form)
+    {
+        size_t start;
+        if (form.compare(0, 5, "(def ") == 0)
+        {
+            start = 5;
+        }
+        else if (form.compare(0, 10, "(defmacro ") == 0)
+        {
+            start = 10;
+        }
+        else
+        {
+            return "";
+        }
+        // a qualified label, (def (name qualifier ...) value), is named by its car
+        if (form.compare(start, 1, "(") == 0)
+        {
+            start++;
+        }
+        size_t end = form.find_first_of(" ()'", start);
+        return form.substr(start, end == std::string::npos ? std::string::npos : end - start);
+    }
+
+    std::string readWholeFile(const std::string& path)
+    {
+        std::ifstream fileStream(path);
+        std::stringstream contents;
+        contents << fileStream.rdbuf();
+        return contents.str();
+    }
+
+    ScriptWatcher::ScriptWatcher(const std::vector<std::string>& paths)
+        : monitor(platform::makeFileChangeMonitor()), stopping(false)
+    {
+        for (const std::string& path : paths)
+        {
+            if (!monitor->watch(path))
+            {
+                ELOG("cannot watch " << path);
+            }
+            DefTable& defs = loadedDefs[path];
+            for (const std::string& form : splitTopLevelForms(readWholeFile(path)))
+            {
+                std::string name = defName(form);
+                if (!name.empty())
+                {
+                    defs[name] = form;
+                }
+            }
+        }
+        watchThread = std::thread(&ScriptWatcher::watchLoop, this);
+    }
+
+    ScriptWatcher::~ScriptWatcher()
+    {
+        stopping = true;
+        watchThread.join();
+    }
+
+    void ScriptWatcher::watchLoop()
+    {
+        // the timeout bounds how long shutdown waits for this thread
+        std::vector<std::string> changedPaths;
+        while (!stopping)
+        {
+            changedPaths.clear();
+            monitor->waitForChanges(100, changedPaths);
+            for (const std::string& path : changedPaths)
+            {
+                reloadFile(path);
+            }
+        }
+    }
+
+    void ScriptWatcher::reloadFile(const std::string& path)
+    {
+        // changes are compared with what was last applied, so a form that
+        // failed is queued again on the next save even if it is unchanged
+        std::vector<std::string> forms = splitTopLevelForms(readWholeFile(path));
+        std::lock_guard<std::mutex> lock(defsMutex);
+        DefTable& appliedDefs = loadedDefs[path];
+        DefTable currentDefs;
+        unsigned int changed = 0;
+        for (const std::string& form : forms)
+        {
+            std::string name = defName(form);
+            if (name.empty())
+            {
+                continue;
+            }
+            currentDefs[name] = form;
+            auto applied = appliedDefs.find(name);
+            if (applied != appliedDefs.end() && applied->second == form)
+            {
+                continue;
+            }
+            // a newer version of a def still waiting replaces it
+            auto waiting = pendingDefs.begin();
+            while (waiting != pendingDefs.end() && !(waiting->path == path && waiting->name == name))
+            {
+                waiting++;
+            }
+            if (waiting == pendingDefs.end())
+            {
+                pendingDefs.push_back({path, name, form});
+            }
+            else
+            {
+                waiting->form = form;
+            }
+            changed++;
+        }
+        // a def gone from the file is forgotten, so putting it back reloads it
+        for (auto applied = appliedDefs.begin(); applied != appliedDefs.end();)
+        {
+            if (currentDefs.find(applied->first) == currentDefs.end())
+            {
+                applied = appliedDefs.erase(applied);
+            }
+            else
+            {
+                applied++;
+            }
+        }
+
+        if (changed > 0)
+        {
+            LOG("reloading " << changed << " definitions from " << path);
+        }
+    }
+
+    unsigned int ScriptWatcher::applyPendingChanges(lisp::VirtualMachine& vm)
+    {
+        std::vector<PendingDef> defs;
+        {
+            std::lock_guard<std::mutex> lock(defsMutex);
+            defs.swap(pendingDefs);
+        }
+
+        unsigned int applied = 0;
+        for (const PendingDef& def : defs)
+        {
+            try
+            {
+                std::istringstream formStream(def.form);
+                vm.evaluate(vm.read(formStream));
+                applied++;
+            }
+            catch (std::exception const &exc)
+            {
+                std::cerr << "Reloading failed: " << exc.what() << "\n";
+                continue;
+            }
+            std::lock_guard<std::mutex> lock(defsMutex);
+            loadedDefs[def.path][def.name] = def.form;
+        }
+        return applied;
+    }
+}
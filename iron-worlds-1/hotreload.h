@@ -0,0 +1,72 @@
+#ifndef HOTRELOAD_H_INCLUDED
+#define HOTRELOAD_H_INCLUDED
+
+#include "lisp.h"
+#include "platform.h"
+
+#include <atomic>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+namespace hotreload
+{
+    // splits Lisp source into the text of each top-level form, dropping
+    // comments and collapsing whitespace so formatting changes compare equal
+    std::vector<std::string> splitTopLevelForms(const std::string& source);
+
+    // the symbol a top-level (def name ...) or (defmacro name ...) form
+    // binds, or an empty string
+    std::string defName(const std::string& form);
+
+    class ScriptWatcher
+    {
+        /*
+        Watches Lisp resource files on a background thread. When one changes
+        it is re-read and its def and defmacro forms are compared, by name,
+        with the ones last applied. Only new or changed ones are queued, and
+        the owner of the VirtualMachine evaluates them at a safe point,
+        normally between frames, by calling applyPendingChanges. A form is
+        taken as applied only once it evaluates without throwing.
+
+        Other top-level forms are not re-run, since they are usually there
+        for their side effects.
+        */
+        typedef std::unordered_map<std::string, std::string> DefTable;
+
+        struct PendingDef
+        {
+            std::string path;
+            std::string name;
+            std::string form;
+        };
+
+        std::unique_ptr<platform::FileChangeMonitor> monitor;
+        // guards both tables below
+        std::mutex defsMutex;
+        // the forms applied from each file, by name
+        std::unordered_map<std::string, DefTable> loadedDefs;
+        std::vector<PendingDef> pendingDefs;
+
+        std::atomic<bool> stopping;
+        std::thread watchThread;
+
+        void watchLoop();
+        void reloadFile(const std::string& path);
+
+    public:
+        // the files' current contents are taken to be what the VM has loaded
+        explicit ScriptWatcher(const std::vector<std::string>& paths);
+        ~ScriptWatcher();
+
+        ScriptWatcher(const ScriptWatcher&) = delete;
+        ScriptWatcher& operator=(const ScriptWatcher&) = delete;
+
+        // evaluates queued forms on the calling thread, returns how many
+        unsigned int applyPendingChanges(lisp::VirtualMachine& vm);
+    };
+}
+
+#endif // HOTRELOAD_H_INCLUDED
@@ -2,5 +2,77 @@
 
 namespace input
 {
+    void LispButtonAction::trigger(bool newButtonState)
+    {
+        lisp::VirtualMachine* vm = function.machine();
+        if (!vm)
+        {
+            return;
+        }
+        lisp::LispHandle state = vm->truth(newButtonState);
+        try
+        {
+            function.call(&state, 1);
+        }
+        catch (std::exception const &exc)
+        {
+            ELOG("button action failed: " << exc.what());
+        }
+    }
 
+    ScriptKeyBindings::ScriptKeyBindings(lisp::VirtualMachine& vm)
+    {
+        // Escape is left out, it always quits
+        std::vector<std::pair<platform::InputCode, lisp::SymbolString>> names =
+        {
+            {platform::InputCode::A, "a"},
+            {platform::InputCode::D, "d"},
+            {platform::InputCode::E, "e"},
+            {platform::InputCode::F, "f"},
+            {platform::InputCode::Q, "q"},
+            {platform::InputCode::R, "r"},
+            {platform::InputCode::S, "s"},
+            {platform::InputCode::W, "w"},
+            {platform::InputCode::RightArrow, "right"},
+            {platform::InputCode::LeftArrow, "left"},
+            {platform::InputCode::UpArrow, "up"},
+            {platform::InputCode::DownArrow, "down"},
+            {platform::InputCode::Space, "space"},
+        };
+        for (const std::pair<platform::InputCode, lisp::SymbolString>& name : names)
+        {
+            keys.push_back({name.first, vm.stringToSymbol("on-" + name.second), lisp::LispHandle()});
+        }
+    }
+
+    void ScriptKeyBindings::update(lisp::VirtualMachine& vm, InputHandler& handler)
+    {
+        for (ScriptKey& key : keys)
+        {
+            lisp::LispHandle function;
+            if (key.handler->globalBindings > 0)
+            {
+                function = key.handler->bindingStack[key.handler->globalBindings - 1];
+            }
+            if (function.tag != lisp::LispHandle::LambdaT && function.tag != lisp::LispHandle::ClosureT
+                && function.tag != lisp::LispHandle::NativeFunctionT)
+            {
+                function = lisp::LispHandle();
+            }
+            if (function.tag == key.bound.tag && function.listNode == key.bound.listNode)
+            {
+                continue;
+            }
+            // replacing the action releases the old function's handle
+            key.bound = function;
+            if (function.tag == lisp::LispHandle::NullT)
+            {
+                handler.bindings[key.code].setAction(nullptr);
+            }
+            else
+            {
+                handler.bindings[key.code].setAction(new LispButtonAction(vm.hold(function)));
+            }
+        }
+    }
 }
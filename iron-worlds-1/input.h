@@ -1,6 +1,7 @@
 #ifndef INPUT_H_INCLUDED
 #define INPUT_H_INCLUDED
 
+#include "lisp_handles.h"
 #include "logic.h"
 #include "platform.h"
 
@@ -28,6 +29,18 @@ namespace input
         void trigger(bool newButtonState) {functor(newButtonState);};
     };
 
+    class LispButtonAction : public ButtonAction
+    {
+        // calls a script function with t or nil, does nothing once the
+        // function's VM is gone
+        lisp::ExternalHandle function;
+
+    public:
+        LispButtonAction(lisp::ExternalHandle func) : function(std::move(func)) {};
+
+        void trigger(bool newButtonState);
+    };
+
     class ButtonContainer
     {
         bool isDown;
@@ -54,6 +67,31 @@ namespace input
         }
         bool queryState(platform::InputCode code) {return bindings[code].queryState();}
     };
+
+    class ScriptKeyBindings
+    {
+        /*
+        Binds a key to the script function named on- and the key's name, as
+        in (def on-space (lambda (down) ...)), called with t when the key
+        goes down and nil when it comes up. update is meant for a point
+        between frames, where it rebinds a key whose function a script has
+        redefined and unbinds one whose function is gone.
+        */
+        struct ScriptKey
+        {
+            platform::InputCode code;
+            lisp::Symbol* handler;
+            // what the key is bound to, compared by identity only
+            lisp::LispHandle bound;
+        };
+
+        std::vector<ScriptKey> keys;
+
+    public:
+        explicit ScriptKeyBindings(lisp::VirtualMachine& vm);
+
+        void update(lisp::VirtualMachine& vm, InputHandler& handler);
+    };
 }
 
 #endif // INPUT_H_INCLUDED
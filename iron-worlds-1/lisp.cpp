@@ -1,5 +1,9 @@
 #include "lisp.h"
+#include "lisp_compiler.h"
+#include "lisp_handles.h"
 
+#include <algorithm>
+#include <initializer_list>
 #include <limits>
 
 namespace lisp
@@ -17,6 +21,7 @@ namespace lisp
         case ' ':
         case '\t':
         case '\n':
+        case '\r':
             return true;
             break;
         default:
@@ -64,67 +69,160 @@ namespace lisp
         }
     }
 
-    LispHandle quote_SF(VirtualMachine&, LispHandle args)
+    bool parseFixnum(const SymbolString& token, Fixnum& result)
     {
-        return listGet(args, 0);
+        // accepts an optional sign followed by at least one digit. Digits
+        // are added with the token's sign, so the most negative fixnum reads
+        size_t i = 0;
+        bool negative = false;
+        if (token[0] == '-' || token[0] == '+')
+        {
+            negative = (token[0] == '-');
+            i = 1;
+        }
+        if (i == token.size())
+        {
+            return false;
+        }
+        for (size_t j = i; j < token.size(); j++)
+        {
+            if (token[j] < '0' || token[j] > '9')
+            {
+                return false;
+            }
+        }
+        Fixnum value = 0;
+        for (; i < token.size(); i++)
+        {
+            Fixnum digit = token[i] - '0';
+            value = negative ? fixnumSubtract(fixnumMultiply(value, 10), digit)
+                             : fixnumAdd(fixnumMultiply(value, 10), digit);
+        }
+        result = value;
+        return true;
     }
 
-    LispHandle def_SF(VirtualMachine& vm, LispHandle args)
+    Fixnum fixnumArg(LispHandle arg)
     {
-        LispHandle key = listGet(args, 0);
-        if (key.tag == key.BasicSymbolT)
+        if (arg.tag == arg.FixnumT)
         {
-            vm.bind(key.basicSymbol, vm.evaluate(listGet(args, 1)));
-            return key.basicSymbol->bindingStack.back();
+            return arg.fixnum;
         }
         else
         {
-            throw std::domain_error("attempt to bind a non-symbol");
+            throw std::domain_error("expected a fixnum");
         }
     }
 
-    LispHandle let_SF(VirtualMachine& vm, LispHandle args)
+    LispHandle quote_SF(VirtualMachine&, LispHandle args)
     {
-
+        return listGet(args, 0);
     }
 
-    LispHandle lambda_SF(VirtualMachine& vm, LispHandle args)
+    LispHandle def_SF(VirtualMachine& vm, LispHandle args)
     {
-        Lambda* result = vm.memory.lambdas.construct();
-        LispHandle parameters = listGet(args, 0);
-        while (true)
+        // always a global definition, wherever it is evaluated. The name may
+        // be qualified, (def (name qualifier ...) value)
+        LispHandle key = listGet(args, 0);
+        Qualifiers qualifiers;
+        bool qualified = key.tag == key.ListT;
+        if (qualified)
         {
-            if (!vm.isAtom(parameters))
+            for (LispHandle rest = key.cdr(); rest.tag == rest.ListT; rest = rest.cdr())
             {
-                LispHandle param = parameters.car();
-                if(param.tag == param.BasicSymbolT)
+                if (rest.car().tag == LispHandle::BasicSymbolT)
                 {
-                    result->parameters.push_back(param.basicSymbol);
+                    qualifiers.add(rest.car().basicSymbol);
                 }
-                else
+            }
+            key = key.car();
+        }
+        if (key.tag == key.BasicSymbolT)
+        {
+            LispHandle value = vm.evaluate(listGet(args, 1));
+            // a function's label qualifiers are checked on its result. They
+            // go on a copy, as the value may be bound elsewhere too
+            if (value.tag == value.LambdaT)
+            {
+                if (qualified)
                 {
-                    throw std::domain_error("non-symbol in lambda parameter list");
+                    Lambda* copy = vm.memory.lambdas.construct();
+                    *copy = *value.lambda;
+                    copy->result = qualifiers;
+                    value = copy;
                 }
-                parameters = parameters.cdr();
             }
-            else
+            else if (value.tag == value.ClosureT)
             {
-                // parameter list ended
-                break;
+                if (qualified)
+                {
+                    Closure* copy = vm.memory.closures.construct();
+                    *copy = *value.closure;
+                    copy->result = qualifiers;
+                    value = copy;
+                }
             }
+            else if (!qualifiers.satisfiedBy(value))
+            {
+                throw std::domain_error("value does not satisfy its qualifiers");
+            }
+            vm.exStack.bindGlobal(key.basicSymbol, value);
+            return value;
         }
-
-        if (vm.isAtom(args.cdr().cdr()))
+        else
         {
-            // body is 1 list
-            result->body = listGet(args, 1);
+            throw std::domain_error("attempt to bind a non-symbol");
         }
-        else
+    }
+
+    LispHandle let_SF(VirtualMachine& vm, LispHandle args)
+    {
+        // (let ((name value) ...) body ...), every value is evaluated before
+        // any name is bound, as with lambda arguments
+        ExecutionStackScope scope(vm.exStack, "let");
         {
-            // body is multiple lists, insert implicit progn
-            result->body = vm.memory.lists.construct(vm.builtins.progn, args.cdr());
+            ArgumentScope values(vm);
+            LispHandle bindings = listGet(args, 0);
+            while (bindings.tag == bindings.ListT)
+            {
+                LispHandle binding = bindings.car();
+                if (listGet(binding, 0).tag != LispHandle::BasicSymbolT)
+                {
+                    throw std::domain_error("attempt to bind a non-symbol");
+                }
+                vm.pushArgument(vm.evaluate(listGet(binding, 1)));
+                bindings = bindings.cdr();
+            }
+
+            bindings = listGet(args, 0);
+            for (size_t i = values.getBase(); bindings.tag == bindings.ListT; i++)
+            {
+                vm.exStack.bind(bindings.car().car().basicSymbol, vm.argumentStack[i]);
+                bindings = bindings.cdr();
+            }
         }
 
+        return progn_SF(vm, args.cdr());
+    }
+
+    LispHandle lambda_SF(VirtualMachine& vm, LispHandle args)
+    {
+        // made inside another lambda's body or a let, it keeps the local
+        // bindings it refers to, as a closure does, since the frame holding
+        // them is gone by the time it is called
+        std::vector<std::pair<Symbol*, LispHandle>> captured;
+        vm.captureLocals(args, captured);
+        if (!captured.empty())
+        {
+            Closure* result = vm.memory.closures.construct();
+            vm.buildLambda(result, args);
+            result->captured = std::move(captured);
+            vm.compileBody(result, result, args.listNode);
+            return result;
+        }
+        Lambda* result = vm.memory.lambdas.construct();
+        vm.buildLambda(result, args);
+        vm.compileBody(result, nullptr, args.listNode);
         return result;
     }
 
@@ -143,7 +241,7 @@ namespace lisp
     {
         while (true)
         {
-            if (vm.isList(args))
+            if (!vm.isAtom(args))
             {
                 LispHandle clause = args.car();
                 if (!vm.isNil(vm.evaluate(listGet(clause, 0))))
@@ -163,7 +261,160 @@ namespace lisp
 
     LispHandle closure_SF(VirtualMachine& vm, LispHandle args)
     {
+        // (closure (parameters) body ...), a lambda that keeps the local
+        // bindings its body uses, so they outlive the frame that made them.
+        // Global bindings are still looked up when called
+        Closure* result = vm.memory.closures.construct();
+        vm.buildLambda(result, args);
+        vm.captureLocals(args, result->captured);
+        vm.compileBody(result, result, args.listNode);
+        return result;
+    }
+
+    LispHandle defmacro_SF(VirtualMachine& vm, LispHandle args)
+    {
+        // (defmacro name (parameters) body ...), a global like def. The body
+        // gets a call's arguments unevaluated and returns the form to run
+        LispHandle key = listGet(args, 0);
+        if (key.tag != key.BasicSymbolT)
+        {
+            throw std::domain_error("attempt to bind a non-symbol");
+        }
+        Macro* result = vm.memory.macros.construct();
+        result->expander = vm.memory.lambdas.construct();
+        vm.buildLambda(result->expander, args.cdr());
+        vm.compileBody(result->expander, nullptr, args.cdr().listNode);
+        vm.exStack.bindGlobal(key.basicSymbol, result);
+        return result;
+    }
+
+    LispHandle assume_SF(VirtualMachine& vm, LispHandle)
+    {
+        // declarations, read by buildLambda when they open a lambda body and
+        // otherwise ignored
+        return vm.truth(false);
+    }
+
+    LispHandle guarantee_SF(VirtualMachine& vm, LispHandle)
+    {
+        return vm.truth(false);
+    }
+
+    LispHandle add_NF(VirtualMachine&, LispHandle args)
+    {
+        Fixnum result = 0;
+        while (args.tag == args.ListT)
+        {
+            result = fixnumAdd(result, fixnumArg(args.car()));
+            args = args.cdr();
+        }
+        return LispHandle(result);
+    }
+
+    LispHandle subtract_NF(VirtualMachine&, LispHandle args)
+    {
+        Fixnum result = fixnumArg(listGet(args, 0));
+        args = args.cdr();
+        if (args.tag != args.ListT)
+        {
+            // (- a) negates
+            return LispHandle(fixnumSubtract(0, result));
+        }
+        while (args.tag == args.ListT)
+        {
+            result = fixnumSubtract(result, fixnumArg(args.car()));
+            args = args.cdr();
+        }
+        return LispHandle(result);
+    }
+
+    LispHandle multiply_NF(VirtualMachine&, LispHandle args)
+    {
+        Fixnum result = 1;
+        while (args.tag == args.ListT)
+        {
+            result = fixnumMultiply(result, fixnumArg(args.car()));
+            args = args.cdr();
+        }
+        return LispHandle(result);
+    }
+
+    LispHandle lessThan_NF(VirtualMachine& vm, LispHandle args)
+    {
+        return vm.truth(fixnumArg(listGet(args, 0)) < fixnumArg(listGet(args, 1)));
+    }
+
+    LispHandle numEqual_NF(VirtualMachine& vm, LispHandle args)
+    {
+        return vm.truth(fixnumArg(listGet(args, 0)) == fixnumArg(listGet(args, 1)));
+    }
+
+    LispHandle car_NF(VirtualMachine&, LispHandle args)
+    {
+        return listGet(args, 0).car();
+    }
+
+    LispHandle cdr_NF(VirtualMachine&, LispHandle args)
+    {
+        return listGet(args, 0).cdr();
+    }
+
+    LispHandle cons_NF(VirtualMachine& vm, LispHandle args)
+    {
+        return vm.cons(listGet(args, 0), listGet(args, 1));
+    }
+
+    LispHandle list_NF(VirtualMachine&, LispHandle args)
+    {
+        // the argument list escapes, so callNative will promote it
+        return args;
+    }
+
+    LispHandle eq_NF(VirtualMachine& vm, LispHandle args)
+    {
+        LispHandle a = listGet(args, 0);
+        LispHandle b = listGet(args, 1);
+        if (a.tag != b.tag)
+        {
+            return vm.truth(false);
+        }
+        if (a.tag == a.FixnumT)
+        {
+            return vm.truth(a.fixnum == b.fixnum);
+        }
+        return vm.truth(a.listNode == b.listNode);
+    }
 
+    LispHandle atom_NF(VirtualMachine& vm, LispHandle args)
+    {
+        return vm.truth(vm.isAtom(listGet(args, 0)));
+    }
+
+    void Qualifiers::add(Symbol* qualifier)
+    {
+        if (qualifier->name == "integer" || qualifier->name == "fixnum")
+        {
+            fixnum = true;
+        }
+        else if (qualifier->name == "natural")
+        {
+            fixnum = true;
+            natural = true;
+        }
+        else if (qualifier->name == "pure")
+        {
+            pure = true;
+        }
+    }
+
+    Symbol* labelName(LispHandle label)
+    {
+        // a label is a symbol or (symbol qualifier ...), null if neither
+        if (label.tag == label.ListT)
+        {
+            label = label.listNode->first;
+        }
+        return label.tag == label.BasicSymbolT ? label.basicSymbol : nullptr;
     }
 
     LispHandle LispHandle::car()
@@ -196,21 +447,6 @@ namespace lisp
         return &hashTable.emplace(name, Symbol(name)).first->second;
     }
 
-    ExecutionStackFrame::~ExecutionStackFrame()
-    {
-        // remove this frame's bindings from each symbol
-        for (Symbol* boundSym : boundSymbols)
-        {
-            boundSym->bindingStack.pop_back();
-        }
-    }
-
-    void ExecutionStackFrame::registerBinding(Symbol* key)
-    {
-        // register that this symbol has a binding through this stack frame
-        boundSymbols.push_back(key);
-    }
-
     ExecutionStack::ExecutionStack()
     {
         push_back("global");
@@ -219,7 +455,7 @@ namespace lisp
     ExecutionStack::~ExecutionStack()
     {
         // unwind the stack
-        while (topFrame_Ptr)
+        while (!frames.empty())
         {
             pop_back();
         }
@@ -227,24 +463,68 @@ namespace lisp
 
     void ExecutionStack::bind(Symbol* key, LispHandle value)
     {
-        // TODO: could a symbol be bound multiple times in a stack frame? if it
-        // can we need to deal with it
-        assert(topFrame_Ptr);
-        topFrame_Ptr->registerBinding(key);
+        // a symbol bound twice in a frame is simply popped twice
+        assert(!frames.empty());
+        boundSymbols.push_back(key);
         key->bindingStack.push_back(value);
+        if (frames.size() == 1)
+        {
+            key->globalBindings++;
+        }
+    }
+
+    void ExecutionStack::bindGlobal(Symbol* key, LispHandle value)
+    {
+        // the global frame's bindings are at the bottom of both the symbol's
+        // stack and boundSymbols, so later frames have to shift up by one
+        assert(!frames.empty());
+        if (frames.size() == 1)
+        {
+            bind(key, value);
+            return;
+        }
+        key->bindingStack.insert(key->bindingStack.begin() + key->globalBindings, value);
+        key->globalBindings++;
+        boundSymbols.insert(boundSymbols.begin() + frames[1].firstBinding, key);
+        for (size_t i = 1; i < frames.size(); i++)
+        {
+            frames[i].firstBinding++;
+        }
     }
 
     void ExecutionStack::pop_back()
     {
-        assert(topFrame_Ptr);
-        ExecutionStackFrame* temp = topFrame_Ptr->getNext();
-        delete topFrame_Ptr;
-        topFrame_Ptr = temp;
+        // remove this frame's bindings from each symbol
+        assert(!frames.empty());
+        size_t firstBinding = frames.back().firstBinding;
+        for (size_t i = boundSymbols.size(); i > firstBinding; i--)
+        {
+            Symbol* boundSym = boundSymbols[i - 1];
+            boundSym->bindingStack.pop_back();
+            if (frames.size() == 1)
+            {
+                boundSym->globalBindings--;
+            }
+        }
+        boundSymbols.resize(firstBinding);
+        frames.pop_back();
+    }
+
+    void ExecutionStack::push_back(const char* context)
+    {
+        frames.push_back({boundSymbols.size(), context});
     }
 
-    void ExecutionStack::push_back(std::string contextString)
+    bool ExecutionStack::boundSince(const Symbol* key, size_t frame) const
     {
-        topFrame_Ptr = new ExecutionStackFrame(topFrame_Ptr, contextString);
+        for (size_t i = boundSymbols.size(); i > frames[frame].firstBinding; i--)
+        {
+            if (boundSymbols[i - 1] == key)
+            {
+                return true;
+            }
+        }
+        return false;
     }
 
     Builtins::Builtins(VirtualMachine& parentVM)
@@ -254,9 +534,12 @@ namespace lisp
             bindPair.first = parentVM.stringToSymbol(bindPair.second);
         }
         nil->bindingStack.push_back(nil);
+        nil->globalBindings = 1;
+        t->bindingStack.push_back(t);
+        t->globalBindings = 1;
     }
 
-    VirtualMachine::VirtualMachine() : builtins(*this)
+    VirtualMachine::VirtualMachine(size_t blockSize) : memory(blockSize), builtins(*this), handles(std::make_shared<HandleTable>(*this))
     {
         exStack.bind(builtins.quote, LispHandle(quote_SF, 0));
         exStack.bind(builtins.def, LispHandle(def_SF, 0));
@@ -265,64 +548,30 @@ namespace lisp
         exStack.bind(builtins.progn, LispHandle(progn_SF, 0));
         exStack.bind(builtins.cond, LispHandle(cond_SF, 0));
         exStack.bind(builtins.closure, LispHandle(closure_SF, 0));
+        exStack.bind(builtins.defmacro, LispHandle(defmacro_SF, 0));
+        exStack.bind(builtins.assume, LispHandle(assume_SF, 0));
+        exStack.bind(builtins.guarantee, LispHandle(guarantee_SF, 0));
+
+        exStack.bind(builtins.add, LispHandle(add_NF));
+        exStack.bind(builtins.subtract, LispHandle(subtract_NF));
+        exStack.bind(builtins.multiply, LispHandle(multiply_NF));
+        exStack.bind(builtins.lessThan, LispHandle(lessThan_NF));
+        exStack.bind(builtins.numEqual, LispHandle(numEqual_NF));
+        exStack.bind(builtins.car, LispHandle(car_NF));
+        exStack.bind(builtins.cdr, LispHandle(cdr_NF));
+        exStack.bind(builtins.cons, LispHandle(cons_NF));
+        exStack.bind(builtins.list, LispHandle(list_NF));
+        exStack.bind(builtins.eq, LispHandle(eq_NF));
+        exStack.bind(builtins.atom, LispHandle(atom_NF));
+        exStack.bind(builtins.pmap, LispHandle(pmap_NF));
+        exStack.bind(builtins.preduce, LispHandle(preduce_NF));
+        exStack.bind(builtins.pforEach, LispHandle(pforEach_NF));
     }
 
     void VirtualMachine::print(LispHandle expr, std::ostream& printStream)
     {
-        switch (expr.tag)
-        {
-            case LispHandle::ListT:
-            {
-                printStream << '(';
-                LispHandle currentHandle = expr;
-                ListNode* currentListPtr = currentHandle.listNode;
-                LispHandle carHandle;
-                LispHandle cdrHandle;
-                carHandle = currentListPtr->first;
-                print(carHandle, printStream);
-                cdrHandle = currentListPtr->second;
-                currentHandle = cdrHandle;
-                while (currentHandle.tag == LispHandle::ListT)
-                {
-                    currentListPtr = currentHandle.listNode;
-                    carHandle = currentListPtr->first;
-                    printStream << ' ';
-                    print(carHandle, printStream);
-
-                    cdrHandle = currentListPtr->second;
-                    currentHandle = cdrHandle;
-                }
-
-                if (currentHandle.tag != currentHandle.BasicSymbolT || currentHandle.basicSymbol != builtins.nil)
-                {
-                    printStream << " . ";
-                    print(currentHandle, printStream);
-                }
-                printStream << ')';
-
-                break;
-            }
-
-            case LispHandle::BasicSymbolT:
-            {
-                if (expr.basicSymbol)
-                {
-                    printStream << *expr.basicSymbol;
-                }
-                else
-                {
-                    printStream << "<nullptr>";
-                }
-
-                break;
-            }
-
-            default:
-            {
-                //printStream << expr.basicSymbol;
-                assert(false);
-            }
-        }
+        const std::string& text = printer.print(expr, builtins.nil);
+        printStream.write(text.data(), text.size());
     }
 
     LispHandle VirtualMachine::read(std::istream& readStream)
@@ -332,8 +581,8 @@ namespace lisp
 
     LispHandle VirtualMachine::read(std::istream& readStream, SymbolString thisToken)
     {
-
-
+        // malformed text throws, as it may come from a REPL client or a file
+        // saved halfway through an edit
         if (isSpecialChar(thisToken[0]))
         {
             switch (thisToken[0])
@@ -343,20 +592,25 @@ namespace lisp
                 break;
             case ')':
                 ELOG("Unexpected ')'");
-                assert(false);
+                throw std::domain_error("unexpected ')'");
                 break;
             case '.':
-                assert(false);
+                throw std::domain_error("dotted pairs cannot be read");
                 break;
             case '\'':
                 return memory.lists.construct(builtins.quote, memory.lists.construct(read(readStream), builtins.nil));
                 break;
             default:
-                assert(false);
+                throw std::domain_error("unexpected character");
             }
         }
         else
         {
+            Fixnum value;
+            if (parseFixnum(thisToken, value))
+            {
+                return LispHandle(value);
+            }
             return memory.symbols.stringToSymbol(thisToken);
         }
 
@@ -377,7 +631,7 @@ namespace lisp
         {
         case (expr.NullT):
             ELOG("Null-type Lisp handle");
-            assert(false);
+            throw std::domain_error("null handle");
             break;
 
         case (expr.ListT):
@@ -388,17 +642,17 @@ namespace lisp
                 {
                 case (first.NullT):
                     ELOG("expected function, got null");
-                    assert(false);
+                    throw std::domain_error("expected function, got null");
                     break;
 
                 case (first.ListT):
                     ELOG("expected function, got list");
-                    assert(false);
+                    throw std::domain_error("expected function, got list");
                     break;
 
                 case (first.BasicSymbolT):
                     ELOG("expected function, got symbol");
-                    assert(false);
+                    throw std::domain_error("expected function, got symbol");
                     break;
 
                 case (first.SpecialFormT):
@@ -409,75 +663,553 @@ namespace lisp
 
                 case (first.NativeFunctionT):
                     {
+                        ArgumentScope arguments(*this);
                         LispHandle args = expr.listNode->second;
-                        LispHandle evaluatedArgs;
-                        LispHandle* evListTail_Ptr = &evaluatedArgs;
-
                         while (!isAtom(args))
                         {
-                            // read in list member, passing in first token
                             LispHandle thisItem = evaluate(args.car());
-                            // construct a cell
-                            ListNode* newCons = memory.lists.construct();
-                            // point the cell's cdr to the new member
-                            newCons->first = thisItem;
-                            // point the list tail's next handle to the new cell
-                            *evListTail_Ptr = LispHandle(newCons);
-                            // update the pointer to the tail
-                            evListTail_Ptr = &(newCons->second);
-
+                            argumentStack.push_back(thisItem);
                             args = args.cdr();
                         }
 
-                        // list ended, point last cdr to nil
-                        *evListTail_Ptr = LispHandle(builtins.nil);
-
-                        return first.nativeFunction(*this, evaluatedArgs);
+                        size_t argumentBase = arguments.getBase();
+                        return callNative(first.nativeFunction, argumentsFrom(argumentBase), argumentStack.size() - argumentBase);
                     }
                     break;
 
+                case (first.MacroT):
+                    return evaluate(expandMacro(first.macro, expr.listNode));
+
                 case (first.LambdaT):
+                case (first.ClosureT):
                     {
-                        LispHandle args = expr;
-                        for (Symbol* parameter : first.lambda->parameters)
+                        // evaluate every argument before binding any, so an
+                        // argument cannot see a parameter of this same call
+                        ArgumentScope arguments(*this);
+                        LispHandle args = expr.listNode->second;
+                        while (!isAtom(args))
                         {
+                            LispHandle thisItem = evaluate(args.car());
+                            argumentStack.push_back(thisItem);
                             args = args.cdr();
-                            bind(parameter, evaluate(args.car()));
                         }
 
-                        return evaluate(first.lambda->body);
+                        if (first.tag == first.ClosureT)
+                        {
+                            return invoke(first.closure, arguments.getBase());
+                        }
+                        return invoke(first.lambda, arguments.getBase());
                     }
                     break;
 
                 default:
                     ELOG("expected function, got unaccounted for handle type");
-                    assert(false);
+                    throw std::domain_error("expected function");
                     break;
                 }
             }
 
             break;
 
+        case (expr.FixnumT):
+            return expr;
+
         case (expr.BasicSymbolT):
-            if (expr.basicSymbol->bindingStack.empty())
             {
-                ELOG("Unbound symbol (" << expr.basicSymbol->name << ")");
-                assert(false);
-            }
-            else
-            {
-                return expr.basicSymbol->bindingStack.back();
+                // inside a lambda only its own locals are seen, not those of
+                // whoever called it, see evaluateWithLocals
+                Symbol* sym = expr.basicSymbol;
+                LispHandle value;
+                if (findLocal(sym, value))
+                {
+                    return value;
+                }
+                if (visibleLocals ? sym->globalBindings == 0 : sym->bindingStack.empty())
+                {
+                    ELOG("Unbound symbol (" << sym->name << ")");
+                    throw std::domain_error("unbound symbol");
+                }
+                return visibleLocals ? sym->bindingStack[sym->globalBindings - 1] : sym->bindingStack.back();
             }
             break;
 
         default:
             ELOG("unaccounted for handle type");
-            assert(false);
+            throw std::domain_error("unaccounted for handle type");
             break;
         }
     }
 
-    ListNode* VirtualMachine::readList(std::istream& readStream)
+    void VirtualMachine::buildLambda(Lambda* result, LispHandle args)
+    {
+        // fills in a lambda or closure from (parameters body ...), where
+        // parameters may be qualified and the body may open with assume and
+        // guarantee forms
+        LispHandle parameters = listGet(args, 0);
+        while (true)
+        {
+            if (!isAtom(parameters))
+            {
+                LispHandle param = parameters.car();
+                Symbol* name = labelName(param);
+                if (name)
+                {
+                    result->parameters.push_back(name);
+                    result->parameterQualifiers.push_back(Qualifiers());
+                    for (LispHandle rest = param; rest.tag == rest.ListT && rest.cdr().tag == rest.ListT; )
+                    {
+                        rest = rest.cdr();
+                        if (rest.car().tag == LispHandle::BasicSymbolT)
+                        {
+                            result->parameterQualifiers.back().add(rest.car().basicSymbol);
+                        }
+                    }
+                }
+                else
+                {
+                    throw std::domain_error("non-symbol in lambda parameter list");
+                }
+                parameters = parameters.cdr();
+            }
+            else
+            {
+                // parameter list ended
+                break;
+            }
+        }
+
+        LispHandle forms = args.cdr();
+        while (forms.tag == forms.ListT && forms.cdr().tag == forms.ListT && forms.car().tag == forms.ListT
+               && (forms.car().car().tag == LispHandle::BasicSymbolT)
+               && (forms.car().car().basicSymbol == builtins.assume || forms.car().car().basicSymbol == builtins.guarantee))
+        {
+            // (assume (label qualifier ...) ...) qualifies parameters,
+            // (guarantee (label qualifier ...)) the result
+            bool isAssume = forms.car().car().basicSymbol == builtins.assume;
+            for (LispHandle labels = forms.car().cdr(); labels.tag == labels.ListT; labels = labels.cdr())
+            {
+                LispHandle label = labels.car();
+                Symbol* name = labelName(label);
+                Qualifiers* target = isAssume ? nullptr : &result->result;
+                for (size_t i = 0; isAssume && i < result->parameters.size(); i++)
+                {
+                    if (result->parameters[i] == name)
+                    {
+                        target = &result->parameterQualifiers[i];
+                    }
+                }
+                for (LispHandle rest = label; target && rest.tag == rest.ListT && rest.cdr().tag == rest.ListT; )
+                {
+                    rest = rest.cdr();
+                    if (rest.car().tag == LispHandle::BasicSymbolT)
+                    {
+                        target->add(rest.car().basicSymbol);
+                    }
+                }
+            }
+            forms = forms.cdr();
+        }
+
+        if (isAtom(forms.cdr()))
+        {
+            // body is 1 list
+            result->body = listGet(forms, 0);
+        }
+        else
+        {
+            // body is multiple lists, insert implicit progn
+            result->body = memory.lists.construct(builtins.progn, forms);
+        }
+    }
+
+    NativeFunctionPtr specialFormOf(LispHandle head)
+    {
+        // the special form a list head currently names, if any
+        if (head.tag != head.BasicSymbolT || head.basicSymbol->bindingStack.empty())
+        {
+            return nullptr;
+        }
+        LispHandle value = head.basicSymbol->bindingStack.back();
+        return value.tag == value.SpecialFormT ? value.specialForm : nullptr;
+    }
+
+    void collectFreeVariables(VirtualMachine& vm, LispHandle expr, std::vector<Symbol*>& bound, std::vector<Symbol*>& result)
+    {
+        // adds each symbol that expr may look up and that is not bound inside
+        // expr itself. Errs towards too many, which only costs a capture
+        if (expr.tag == expr.BasicSymbolT)
+        {
+            Symbol* sym = expr.basicSymbol;
+            if (std::find(bound.begin(), bound.end(), sym) == bound.end()
+                && std::find(result.begin(), result.end(), sym) == result.end())
+            {
+                result.push_back(sym);
+            }
+            return;
+        }
+        if (expr.tag != expr.ListT)
+        {
+            return;
+        }
+
+        LispHandle head = expr.car();
+        if (head.tag == head.BasicSymbolT && !head.basicSymbol->bindingStack.empty()
+            && head.basicSymbol->bindingStack.back().tag == LispHandle::MacroT
+            && std::find(bound.begin(), bound.end(), head.basicSymbol) == bound.end())
+        {
+            // only the expansion is ever evaluated
+            collectFreeVariables(vm, vm.expandMacro(head.basicSymbol->bindingStack.back().macro, expr.listNode), bound, result);
+            return;
+        }
+
+        NativeFunctionPtr form = specialFormOf(head);
+        LispHandle rest = expr.cdr();
+        size_t boundSize = bound.size();
+        if (form == quote_SF)
+        {
+            return;
+        }
+        else if (form == assume_SF || form == guarantee_SF)
+        {
+            // declarations, nothing is looked up
+            return;
+        }
+        else if ((form == lambda_SF || form == closure_SF) && rest.tag == rest.ListT)
+        {
+            for (LispHandle params = rest.car(); params.tag == params.ListT; params = params.cdr())
+            {
+                if (labelName(params.car()))
+                {
+                    bound.push_back(labelName(params.car()));
+                }
+            }
+            rest = rest.cdr();
+        }
+        else if (form == let_SF && rest.tag == rest.ListT)
+        {
+            // values are outside the let's scope, names are bound for the body
+            std::vector<Symbol*> names;
+            for (LispHandle bindings = rest.car(); bindings.tag == bindings.ListT; bindings = bindings.cdr())
+            {
+                LispHandle binding = bindings.car();
+                if (binding.tag == binding.ListT)
+                {
+                    if (binding.car().tag == LispHandle::BasicSymbolT)
+                    {
+                        names.push_back(binding.car().basicSymbol);
+                    }
+                    collectFreeVariables(vm, binding.cdr(), bound, result);
+                }
+            }
+            bound.insert(bound.end(), names.begin(), names.end());
+            rest = rest.cdr();
+        }
+        else if (form == def_SF && rest.tag == rest.ListT)
+        {
+            // the name is bound, not looked up
+            rest = rest.cdr();
+        }
+        else if (!form)
+        {
+            // a call, the head is looked up too
+            collectFreeVariables(vm, expr.car(), bound, result);
+        }
+
+        while (rest.tag == rest.ListT)
+        {
+            collectFreeVariables(vm, rest.car(), bound, result);
+            rest = rest.cdr();
+        }
+        bound.resize(boundSize);
+    }
+
+    const std::vector<Symbol*>& VirtualMachine::freeVariables(LispHandle closureArgs)
+    {
+        // the analysis only depends on the source, so it is done once per
+        // closure form however many closures that form makes
+        auto found = freeVariableCache.find(closureArgs.listNode);
+        if (found != freeVariableCache.end())
+        {
+            return found->second;
+        }
+        std::vector<Symbol*> bound;
+        std::vector<Symbol*> result;
+        for (LispHandle params = closureArgs.car(); params.tag == params.ListT; params = params.cdr())
+        {
+            bound.push_back(labelName(params.car()));
+        }
+        for (LispHandle body = closureArgs.cdr(); body.tag == body.ListT; body = body.cdr())
+        {
+            collectFreeVariables(*this, body.car(), bound, result);
+        }
+        return freeVariableCache.emplace(closureArgs.listNode, std::move(result)).first->second;
+    }
+
+    void VirtualMachine::captureLocals(LispHandle args, std::vector<std::pair<Symbol*, LispHandle>>& captured)
+    {
+        // the current local binding of each free symbol of a lambda or
+        // closure form
+        for (Symbol* sym : freeVariables(args))
+        {
+            LispHandle value;
+            if (findLocal(sym, value))
+            {
+                captured.emplace_back(sym, value);
+            }
+        }
+    }
+
+    bool VirtualMachine::findLocal(Symbol* sym, LispHandle& value)
+    {
+        // the innermost local binding the interpreter sees for sym. Outside
+        // any lambda that is any binding above the global ones. Inside one,
+        // a binding made since compiled code handed over, e.g. by a let,
+        // then a slot of the lambda's frame; bindings made further down the
+        // stack belong to its callers and are not seen
+        if (!visibleLocals || exStack.boundSince(sym, visibleLocalsFrame))
+        {
+            if (sym->bindingStack.size() > sym->globalBindings)
+            {
+                value = sym->bindingStack.back();
+                return true;
+            }
+            return false;
+        }
+        for (size_t i = visibleLocals->size(); i > 0; i--)
+        {
+            const std::pair<Symbol*, unsigned int>& slot = (*visibleLocals)[i - 1];
+            if (slot.first == sym)
+            {
+                value = local(slot.second);
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void VirtualMachine::compileBody(Lambda* lambda, Closure* closure, const ListNode* form)
+    {
+        // parameters and captures become slots, so the body reads them by
+        // index instead of through their symbols
+        std::vector<Symbol*> captured;
+        if (closure)
+        {
+            for (std::pair<Symbol*, LispHandle>& capture : closure->captured)
+            {
+                captured.push_back(capture.first);
+            }
+        }
+
+        // a lambda with no source form, e.g. one copied in by Transfer, is
+        // compiled on its own
+        std::vector<CompiledBody>* cached = nullptr;
+        if (form)
+        {
+            cached = &compiledBodyCache[form];
+            for (CompiledBody& entry : *cached)
+            {
+                if (entry.captured == captured)
+                {
+                    lambda->compiledBody = entry.body;
+                    lambda->frameSize = entry.frameSize;
+                    return;
+                }
+            }
+        }
+
+        lambda->compiledBody = compileLambdaBody(*this, lambda, captured, lambda->frameSize);
+        if (cached)
+        {
+            cached->push_back({captured, lambda->compiledBody, lambda->frameSize});
+        }
+    }
+
+    LispHandle VirtualMachine::enter(Lambda* lambda, Closure* closure, size_t argumentBase)
+    {
+        // the values above argumentBase on the argument stack become the
+        // first slots of the lambda's frame, followed by a closure's captured
+        // values and room for the body's lets
+        size_t count = argumentStack.size() - argumentBase;
+        if (count != lambda->parameters.size())
+        {
+            argumentStack.resize(argumentBase);
+            throw std::domain_error("wrong number of arguments to lambda");
+        }
+
+        if (closure)
+        {
+            for (std::pair<Symbol*, LispHandle>& capture : closure->captured)
+            {
+                argumentStack.push_back(capture.second);
+            }
+        }
+        argumentStack.resize(argumentBase + lambda->frameSize);
+
+        // the callee sees none of its caller's locals
+        size_t callerFrameBase = frameBase;
+        const LocalSlots* callerLocals = visibleLocals;
+        frameBase = argumentBase;
+        visibleLocals = nullptr;
+        LispHandle result;
+        try
+        {
+            result = lambda->compiledBody->run(*this);
+        }
+        catch (...)
+        {
+            frameBase = callerFrameBase;
+            visibleLocals = callerLocals;
+            argumentStack.resize(argumentBase);
+            throw;
+        }
+        frameBase = callerFrameBase;
+        visibleLocals = callerLocals;
+        argumentStack.resize(argumentBase);
+
+        if (!lambda->result.satisfiedBy(result))
+        {
+            throw std::domain_error("lambda result does not satisfy its guarantee");
+        }
+        return result;
+    }
+
+    LispHandle VirtualMachine::evaluateWithLocals(LispHandle expr, const LocalSlots& locals)
+    {
+        // the interpreter reads the frame's slots in place, as compiled code
+        // does. Bindings it makes itself go in a frame pushed here, so they
+        // shadow the slots until it returns
+        ExecutionStackScope scope(exStack, "locals");
+        const LocalSlots* outerLocals = visibleLocals;
+        size_t outerLocalsFrame = visibleLocalsFrame;
+        visibleLocals = &locals;
+        visibleLocalsFrame = exStack.depth() - 1;
+        LispHandle result;
+        try
+        {
+            result = evaluate(expr);
+        }
+        catch (...)
+        {
+            visibleLocals = outerLocals;
+            visibleLocalsFrame = outerLocalsFrame;
+            throw;
+        }
+        visibleLocals = outerLocals;
+        visibleLocalsFrame = outerLocalsFrame;
+        return result;
+    }
+
+    LispHandle VirtualMachine::expandMacro(Macro* macro, ListNode* callSite)
+    {
+        // a call site keeps its expansion until the name it called is bound
+        // to a different macro, e.g. by a redefinition
+        auto found = macroExpansions.find(callSite);
+        if (found != macroExpansions.end() && found->second.first == macro)
+        {
+            return found->second.second;
+        }
+        size_t base = argumentStack.size();
+        for (LispHandle args = callSite->second; args.tag == args.ListT; args = args.cdr())
+        {
+            argumentStack.push_back(args.car());
+        }
+        LispHandle expansion = invoke(macro->expander, base);
+        macroExpansions[callSite] = std::make_pair(macro, expansion);
+        return expansion;
+    }
+
+    LispHandle VirtualMachine::callNative(NativeFunctionPtr function, const LispHandle* values, size_t count)
+    {
+        // the argument list only lives for the duration of the call, so it is
+        // consed in the nursery and only promoted if the result holds onto it
+        NurseryScope scope(memory.nursery);
+        LispHandle evaluatedArgs = builtins.nil;
+        for (size_t i = count; i > 0; i--)
+        {
+            evaluatedArgs = constructTemporary(values[i - 1], evaluatedArgs);
+        }
+        return promote(function(*this, evaluatedArgs), scope.getMark());
+    }
+
+    LispHandle VirtualMachine::apply(LispHandle function, const LispHandle* values, size_t count)
+    {
+        // calls an already evaluated function on already evaluated arguments
+        switch (function.tag)
+        {
+        case LispHandle::LambdaT:
+            {
+                size_t base = argumentStack.size();
+                argumentStack.insert(argumentStack.end(), values, values + count);
+                return invoke(function.lambda, base);
+            }
+
+        case LispHandle::ClosureT:
+            {
+                size_t base = argumentStack.size();
+                argumentStack.insert(argumentStack.end(), values, values + count);
+                return invoke(function.closure, base);
+            }
+
+        case LispHandle::NativeFunctionT:
+            return callNative(function.nativeFunction, values, count);
+
+        default:
+            throw std::domain_error("attempt to apply a non-function");
+        }
+    }
+
+    ListNode* VirtualMachine::constructTemporary(LispHandle first, LispHandle second)
+    {
+        if (memory.nursery.isFull())
+        {
+            // deep native recursion, fall back to long-lived memory
+            return memory.lists.construct(first, second);
+        }
+        return memory.nursery.construct(first, second);
+    }
+
+    ListNode* VirtualMachine::forward(ListNode* node)
+    {
+        // copies a nursery cons to long-lived memory and leaves a forwarding
+        // address behind, so shared structure is copied once
+        if (node->first.tag == LispHandle::NullT)
+        {
+            return node->second.listNode;
+        }
+        ListNode* copy = memory.lists.construct(node->first, node->second);
+        node->first = LispHandle();
+        node->second = LispHandle(copy);
+        promotionStack.push_back(copy);
+        return copy;
+    }
+
+    LispHandle VirtualMachine::promote(LispHandle value, size_t nurseryMark)
+    {
+        // moves every nursery cons made since nurseryMark that is reachable
+        // from value into long-lived memory; the copies are scanned in turn
+        // until no reference into the released region remains
+        if (value.tag != value.ListT || !memory.nursery.ownsSince(value.listNode, nurseryMark))
+        {
+            return value;
+        }
+
+        LispHandle result(forward(value.listNode));
+        while (!promotionStack.empty())
+        {
+            ListNode* copy = promotionStack.back();
+            promotionStack.pop_back();
+            for (LispHandle* field : {&copy->first, &copy->second})
+            {
+                if (field->tag == field->ListT && memory.nursery.ownsSince(field->listNode, nurseryMark))
+                {
+                    *field = LispHandle(forward(field->listNode));
+                }
+            }
+        }
+        return result;
+    }
+
+    LispHandle VirtualMachine::readList(std::istream& readStream)
     {
         // called after the '(' of a list, consumes the rest of the list
 
@@ -489,14 +1221,15 @@ namespace lisp
         LispHandle* listTail_Ptr = &resultHandle;
 
         SymbolString currentToken = readToken(readStream);
-        SymbolChar& currentChar = currentToken[0];
 
-        while (currentChar != ')')
+        // the first char is read afresh each time, as assigning a longer
+        // token may move the string's storage
+        while (currentToken[0] != ')')
         {
-            switch (currentChar)
+            switch (currentToken[0])
             {
             case '.':
-                assert(false); // TODO
+                throw std::domain_error("dotted pairs cannot be read");
                 break;
             default:
                 // read in list member, passing in first token
@@ -516,7 +1249,8 @@ namespace lisp
         // list ended, point last cdr to nil
         *listTail_Ptr = LispHandle(builtins.nil);
 
-        return resultHandle.listNode;
+        // nil itself when the list was ()
+        return resultHandle;
     }
 
     SymbolString VirtualMachine::readToken(std::istream& readStream)
@@ -531,8 +1265,7 @@ namespace lisp
             currentChar = readStream.peek();
             if (!readStream)
             {
-                ELOG("unexpected stream failure");
-                return "<Invalid-Token>";
+                break;
             }
             else if (currentChar == ';')
             {
@@ -554,13 +1287,14 @@ namespace lisp
                 // normal symbol tokens
                 SymbolString resultString(1, currentChar);
                 readStream.ignore();
-                while (readStream)
+                while (true)
                 {
-                    currentChar = readStream.peek();
+                    int next = readStream.peek();
+                    currentChar = next;
 
-                    if (isWhiteSpace(currentChar) || isSpecialChar(currentChar))
+                    if (next == EOF || isWhiteSpace(currentChar) || isSpecialChar(currentChar))
                     {
-                        // token ended
+                        // token ended, possibly by the end of the input
                         return resultString;
                         // do not consume the char after the symbol
                     }
@@ -573,8 +1307,8 @@ namespace lisp
                 }
             }
         }
-        ELOG("unexpected stream failure");
-        return "<Invalid-Token>";
+        ELOG("unexpected end of input");
+        throw std::domain_error("unexpected end of input");
     }
 
     Symbol* VirtualMachine::stringToSymbol(SymbolString name)
@@ -4,16 +4,21 @@
 #include "platform.h"
 
 #include <functional>
+#include <cstdint>
 #include <iostream>
 #include <list>
+#include <memory>
 #include <stdexcept>
 #include <string>
+#include <unordered_map>
 #include <vector>
 
 namespace lisp
 {
     typedef char SymbolChar;
     typedef std::string SymbolString;
+    // pointer-sized so that a fixnum does not grow the handle union
+    typedef std::intptr_t Fixnum;
 
     struct ListNode;
     struct Symbol;
@@ -21,11 +26,20 @@ namespace lisp
     class VirtualMachine;
     class Lambda;
     class Closure;
+    struct Macro;
     template <class T>
     class SpecialisedMemory;
     class SymbolTable;
+    class CompiledNode;
+    class Compiler;
+    class Transfer;
+    class HandleTable;
+    class ExternalHandle;
 
     typedef LispHandle (*NativeFunctionPtr) (VirtualMachine&, LispHandle);
+    // symbols given slots in the current frame, a later entry shadows an
+    // earlier one for the same symbol and a null symbol is a reserved slot
+    typedef std::vector<std::pair<Symbol*, unsigned int>> LocalSlots;
 
     LispHandle quote_SF(VirtualMachine& vm, LispHandle args);
     LispHandle def_SF(VirtualMachine& vm, LispHandle args);
@@ -34,6 +48,56 @@ namespace lisp
     LispHandle progn_SF(VirtualMachine& vm, LispHandle args);
     LispHandle cond_SF(VirtualMachine& vm, LispHandle args);
     LispHandle closure_SF(VirtualMachine& vm, LispHandle args);
+    LispHandle defmacro_SF(VirtualMachine& vm, LispHandle args);
+    LispHandle assume_SF(VirtualMachine& vm, LispHandle args);
+    LispHandle guarantee_SF(VirtualMachine& vm, LispHandle args);
+
+    LispHandle add_NF(VirtualMachine& vm, LispHandle args);
+    LispHandle subtract_NF(VirtualMachine& vm, LispHandle args);
+    LispHandle multiply_NF(VirtualMachine& vm, LispHandle args);
+    LispHandle lessThan_NF(VirtualMachine& vm, LispHandle args);
+    LispHandle numEqual_NF(VirtualMachine& vm, LispHandle args);
+    LispHandle car_NF(VirtualMachine& vm, LispHandle args);
+    LispHandle cdr_NF(VirtualMachine& vm, LispHandle args);
+    LispHandle cons_NF(VirtualMachine& vm, LispHandle args);
+    LispHandle list_NF(VirtualMachine& vm, LispHandle args);
+    LispHandle eq_NF(VirtualMachine& vm, LispHandle args);
+    LispHandle atom_NF(VirtualMachine& vm, LispHandle args);
+    LispHandle pmap_NF(VirtualMachine& vm, LispHandle args);
+    LispHandle preduce_NF(VirtualMachine& vm, LispHandle args);
+    LispHandle pforEach_NF(VirtualMachine& vm, LispHandle args);
+
+    // fixnum arithmetic that throws rather than overflow, shared by the
+    // builtins and the compiled operators
+    inline Fixnum fixnumAdd(Fixnum a, Fixnum b)
+    {
+        Fixnum result;
+        if (__builtin_add_overflow(a, b, &result))
+        {
+            throw std::domain_error("fixnum overflow");
+        }
+        return result;
+    }
+
+    inline Fixnum fixnumSubtract(Fixnum a, Fixnum b)
+    {
+        Fixnum result;
+        if (__builtin_sub_overflow(a, b, &result))
+        {
+            throw std::domain_error("fixnum overflow");
+        }
+        return result;
+    }
+
+    inline Fixnum fixnumMultiply(Fixnum a, Fixnum b)
+    {
+        Fixnum result;
+        if (__builtin_mul_overflow(a, b, &result))
+        {
+            throw std::domain_error("fixnum overflow");
+        }
+        return result;
+    }
 
     struct LispHandle
     {
@@ -48,9 +112,11 @@ namespace lisp
             NativeFunctionPtr specialForm;
             Lambda* lambda;
             Closure* closure;
+            Macro* macro;
+            Fixnum fixnum;
         };
 
-        enum : char
+        enum Tag : char
         {
             // specifies a Lisp entity type
             NullT = 0,
@@ -59,7 +125,9 @@ namespace lisp
             NativeFunctionT = 3,
             SpecialFormT = 4,
             LambdaT = 5,
-            ClosureT = 6
+            ClosureT = 6,
+            FixnumT = 7,
+            MacroT = 8
         } tag;
 
         LispHandle() : listNode(nullptr), tag(NullT) {}
@@ -69,6 +137,8 @@ namespace lisp
         LispHandle(NativeFunctionPtr form, int) : specialForm(form), tag(SpecialFormT) {}
         LispHandle(Lambda* lam) : lambda(lam), tag(LambdaT) {}
         LispHandle(Closure* clo) : closure(clo), tag(ClosureT) {}
+        LispHandle(Macro* mac) : macro(mac), tag(MacroT) {}
+        explicit LispHandle(Fixnum value) : fixnum(value), tag(FixnumT) {}
 
         LispHandle car();
         LispHandle cdr();
@@ -90,6 +160,9 @@ namespace lisp
         // holds its name and a typed union pointer to its lookup value
         SymbolString name;
         std::vector<LispHandle> bindingStack;
+        // how many of the bindings were made in the global frame, any above
+        // that are local and get captured by closures
+        size_t globalBindings = 0;
 
     private:
         Symbol(SymbolString newName) : name(newName) {}
@@ -99,10 +172,44 @@ namespace lisp
     };
     std::ostream& operator<<(std::ostream& output, const Symbol& sym);
 
+    class CompiledNode
+    {
+        // a pre-resolved piece of a lambda body, see lisp_compiler.h
+    public:
+        virtual ~CompiledNode() {}
+
+        virtual LispHandle run(VirtualMachine& vm) = 0;
+    };
+
+    struct Qualifiers
+    {
+        // what a label is declared to satisfy, see "type system" in
+        // docs/lisp.md. Unknown qualifiers are accepted and ignored
+        bool fixnum = false; // integer, natural
+        bool natural = false;
+        bool pure = false;
+
+        void add(Symbol* qualifier);
+        bool isChecked() const {return fixnum;}
+        bool satisfiedBy(LispHandle value) const
+        {
+            return (!fixnum || value.tag == LispHandle::FixnumT) && (!natural || value.fixnum >= 0);
+        }
+    };
+
     struct Lambda
     {
         std::vector<Symbol*> parameters;
+        // from (name qualifier ...) parameters or an assume form
+        std::vector<Qualifiers> parameterQualifiers;
+        // from a guarantee form or a qualified def label, checked on return
+        Qualifiers result;
         LispHandle body;
+        // compiled when the lambda is made, shared by every lambda made by
+        // the same form. Parameters, then captures, then the body's lets
+        // take the frame's slots
+        std::shared_ptr<CompiledNode> compiledBody;
+        unsigned int frameSize = 0;
     protected:
         Lambda() {}
     public:
@@ -111,7 +218,24 @@ namespace lisp
 
     struct Closure : public Lambda
     {
-        std::vector<std::pair<Symbol, LispHandle>> environment;
+        // the local bindings the body refers to, taken when the closure was
+        // made and copied into the frame after the arguments on each call
+        std::vector<std::pair<Symbol*, LispHandle>> captured;
+    protected:
+        Closure() {}
+    public:
+        friend class SpecialisedMemory<Closure>;
+    };
+
+    struct Macro
+    {
+        // called on a call site's unevaluated arguments to produce the form
+        // evaluated in its place
+        Lambda* expander;
+    private:
+        Macro() {}
+    public:
+        friend class SpecialisedMemory<Macro>;
     };
 
     class BigInt
@@ -122,74 +246,63 @@ namespace lisp
     template <class T>
     class SpecialisedMemory
     {
-        // this pointer is a
+        // hands out nodes from blocks of blockSize, adding a block when the
+        // last is used up. Blocks never move, so nodes keep their address
+        std::vector<std::unique_ptr<T[]>> blocks;
         T* nodesArray_Ptr;
-        size_t arraySize = 0;
-        size_t defaultSize = 0x10000;
+        size_t arraySize;
         size_t nextFree = 0;
 
     public:
-        SpecialisedMemory()
-        {
-            arraySize = defaultSize;
-            nodesArray_Ptr = new T[arraySize];
-        }
+        static const size_t defaultSize = 0x10000;
 
-        ~SpecialisedMemory()
+        explicit SpecialisedMemory(size_t blockSize = defaultSize)
+            : nodesArray_Ptr(new T[blockSize]), arraySize(blockSize)
         {
-            delete[] nodesArray_Ptr;
+            blocks.emplace_back(nodesArray_Ptr);
         }
 
         T* construct()
         {
-            if (nextFree < arraySize)
+            if (nextFree == arraySize)
             {
-                T* result_Ptr = nodesArray_Ptr + nextFree;
-                nextFree++;
-                return result_Ptr;
-            }
-            else
-            {
-                ELOG("out of memory");
-                return nullptr;
+                nodesArray_Ptr = new T[arraySize];
+                blocks.emplace_back(nodesArray_Ptr);
+                nextFree = 0;
             }
+            return nodesArray_Ptr + nextFree++;
         }
     };
 
     template <>
     class SpecialisedMemory <ListNode>
     {
-        // this pointer is a
+        // grows in blocks like the general case. The nursery checks isFull
+        // before constructing, so it stays in its first block and its marks
+        // are indices into that block
+        std::vector<std::unique_ptr<ListNode[]>> blocks;
         ListNode* nodesArray_Ptr;
-        size_t arraySize = 0;
-        size_t defaultSize = 0x10000;
+        size_t arraySize;
         size_t nextFree = 0;
 
     public:
-        SpecialisedMemory()
-        {
-            arraySize = defaultSize;
-            nodesArray_Ptr = new ListNode[arraySize];
-        }
+        static const size_t defaultSize = 0x10000;
 
-        ~SpecialisedMemory()
+        explicit SpecialisedMemory(size_t blockSize = defaultSize)
+            : nodesArray_Ptr(new ListNode[blockSize]), arraySize(blockSize)
         {
-            delete[] nodesArray_Ptr;
+            blocks.emplace_back(nodesArray_Ptr);
         }
 
         ListNode* construct()
         {
-            if (nextFree < arraySize)
-            {
-                ListNode* result_Ptr = nodesArray_Ptr + nextFree;
-                nextFree++;
-                return result_Ptr;
-            }
-            else
+            if (nextFree == arraySize)
             {
-                ELOG("out of memory");
-                return nullptr;
+                nodesArray_Ptr = new ListNode[arraySize];
+                blocks.emplace_back(nodesArray_Ptr);
+                nextFree = 0;
             }
+            return nodesArray_Ptr + nextFree++;
         }
 
         ListNode* construct(LispHandle first, LispHandle second)
@@ -199,6 +312,19 @@ namespace lisp
             result_Ptr->second = second;
             return result_Ptr;
         }
+
+        // the number of nodes handed out so far
+        size_t size() const {return (blocks.size() - 1) * arraySize + nextFree;}
+        bool isFull() const {return nextFree == arraySize;}
+
+        // a region can be used as a stack of scopes: everything constructed
+        // after a mark is discarded when released back to it
+        size_t mark() const {return nextFree;}
+        void release(size_t oldMark) {nextFree = oldMark;}
+        bool ownsSince(const ListNode* node, size_t oldMark) const
+        {
+            return node >= nodesArray_Ptr + oldMark && node < nodesArray_Ptr + nextFree;
+        }
     };
 
     class SymbolTable
@@ -212,39 +338,117 @@ namespace lisp
     class Memory
     {
     public:
+        explicit Memory(size_t blockSize)
+            : lists(blockSize), nursery(blockSize), lambdas(blockSize), closures(blockSize), macros(blockSize) {}
+
+        // long-lived conses
         SpecialisedMemory<ListNode> lists;
+        // conses that are expected to die with the call that made them,
+        // see VirtualMachine::callNative
+        SpecialisedMemory<ListNode> nursery;
         SpecialisedMemory<Lambda> lambdas;
+        SpecialisedMemory<Closure> closures;
+        SpecialisedMemory<Macro> macros;
         SymbolTable symbols;
     };
 
     typedef ListNode* HandleListNode;
 
-    class ExecutionStackFrame
+    struct ExecutionStackFrame
     {
-        ExecutionStackFrame* nextFrame_PtrWeak = nullptr;
-        std::vector<Symbol*> boundSymbols;
-        std::string contextString_;
-    public:
-        ExecutionStackFrame(ExecutionStackFrame* next, std::string contextString)
-            : nextFrame_PtrWeak(next),
-            contextString_(contextString) {}
-        ~ExecutionStackFrame();
-
-        ExecutionStackFrame* getNext() {return nextFrame_PtrWeak;}
-        void registerBinding(Symbol* key);
+        // the frame's bindings are the entries of ExecutionStack::boundSymbols
+        // from firstBinding up to the next frame's
+        size_t firstBinding;
+        const char* context;
     };
 
     class ExecutionStack
     {
-        ExecutionStackFrame* topFrame_Ptr = nullptr;
+        // frames and their bindings live in 2 vectors that only grow, so
+        // after warm-up pushing a frame or binding in it allocates nothing
+        std::vector<ExecutionStackFrame> frames;
+        std::vector<Symbol*> boundSymbols;
 
     public:
         ExecutionStack();
         ~ExecutionStack();
 
         void bind(Symbol* key, LispHandle value);
+        // binds in the bottom frame, under any local bindings of key
+        void bindGlobal(Symbol* key, LispHandle value);
         void pop_back();
-        void push_back(std::string contextString);
+        void push_back(const char* context);
+        size_t depth() const {return frames.size();}
+        // whether key was bound in frame or one pushed after it
+        bool boundSince(const Symbol* key, size_t frame) const;
+    };
+
+    class ExecutionStackScope
+    {
+        // pushes a frame for its own lifetime, so the frame's bindings are
+        // undone even when evaluation throws
+        ExecutionStack& stack;
+    public:
+        ExecutionStackScope(ExecutionStack& newStack, const char* context)
+            : stack(newStack) {stack.push_back(context);}
+        ~ExecutionStackScope() {stack.pop_back();}
+
+        ExecutionStackScope(const ExecutionStackScope&) = delete;
+        ExecutionStackScope& operator=(const ExecutionStackScope&) = delete;
+    };
+
+    class NurseryScope
+    {
+        // discards every nursery cons made during its lifetime, anything that
+        // must survive has to be promoted before the scope ends
+        SpecialisedMemory<ListNode>& nursery;
+        size_t startMark;
+    public:
+        explicit NurseryScope(SpecialisedMemory<ListNode>& newNursery)
+            : nursery(newNursery), startMark(newNursery.mark()) {}
+        ~NurseryScope() {nursery.release(startMark);}
+
+        size_t getMark() const {return startMark;}
+
+        NurseryScope(const NurseryScope&) = delete;
+        NurseryScope& operator=(const NurseryScope&) = delete;
+    };
+
+    class Printer
+    {
+        /*
+        Writes Lisp values as text into a buffer that is kept between calls.
+        Uses an explicit work stack, so depth is limited by memory rather
+        than the native stack. A first pass finds conses reachable more than
+        once, which are then written as #n= on first use and #n# after, so
+        shared and cyclic structure prints finitely.
+        */
+        struct Task
+        {
+            enum Kind : char
+            {
+                Value,    // print handle
+                ListRest, // handle is the cdr of a list being printed
+                Close     // write ')'
+            } kind;
+            LispHandle handle;
+        };
+
+        std::string buffer;
+        // seen once: 0, seen again: -1, labelled: n > 0
+        std::unordered_map<const ListNode*, int> labels;
+        std::vector<Task> tasks;
+        std::vector<const ListNode*> pending;
+        int nextLabel = 0;
+
+        void findShared(LispHandle expr);
+        bool isShared(const ListNode* node);
+        void writeAtom(LispHandle expr);
+        void writeLabel(int label, char suffix);
+
+    public:
+        // the result stays valid until the next call
+        const std::string& print(LispHandle expr, Symbol* nil);
     };
 
     class NativeCalledLisp
@@ -272,6 +476,24 @@ namespace lisp
         Symbol* progn;
         Symbol* cond;
         Symbol* closure;
+        Symbol* defmacro;
+        Symbol* assume;
+        Symbol* guarantee;
+        Symbol* t;
+        Symbol* add;
+        Symbol* subtract;
+        Symbol* multiply;
+        Symbol* lessThan;
+        Symbol* numEqual;
+        Symbol* car;
+        Symbol* cdr;
+        Symbol* cons;
+        Symbol* list;
+        Symbol* eq;
+        Symbol* atom;
+        Symbol* pmap;
+        Symbol* preduce;
+        Symbol* pforEach;
 
         std::vector<std::pair<Symbol*&, SymbolString>> bindings =
         {
@@ -283,6 +505,24 @@ namespace lisp
             {progn, "progn"},
             {cond, "cond"},
             {closure, "closure"},
+            {defmacro, "defmacro"},
+            {assume, "assume"},
+            {guarantee, "guarantee"},
+            {t, "t"},
+            {add, "+"},
+            {subtract, "-"},
+            {multiply, "*"},
+            {lessThan, "<"},
+            {numEqual, "="},
+            {car, "car"},
+            {cdr, "cdr"},
+            {cons, "cons"},
+            {list, "list"},
+            {eq, "eq"},
+            {atom, "atom"},
+            {pmap, "pmap"},
+            {preduce, "preduce"},
+            {pforEach, "pfor-each"},
         };
 
         Builtins(VirtualMachine& parentVM);
@@ -290,12 +530,58 @@ namespace lisp
 
     class VirtualMachine
     {
-        ExecutionStack exStack;
+        // memory must outlive exStack, whose frames unbind symbols in it
         Memory memory;
+        ExecutionStack exStack;
         Builtins builtins;
+        // evaluated arguments waiting to be bound, shared by all calls so
+        // that a call does not allocate its own argument array. A called
+        // lambda's frame is the slots from its arguments onwards
+        std::vector<LispHandle> argumentStack;
+        size_t frameBase = 0;
+        // the current frame's slots the interpreter can see while it runs a
+        // form handed over by compiled code, and the exStack frame pushed
+        // for it, see evaluateWithLocals. Null outside any lambda
+        const LocalSlots* visibleLocals = nullptr;
+        size_t visibleLocalsFrame = 0;
+        // scratch space for promote, kept to avoid reallocating
+        std::vector<ListNode*> promotionStack;
+        Printer printer;
+        // free symbols of each closure form's body, keyed by the form
+        std::unordered_map<const ListNode*, std::vector<Symbol*>> freeVariableCache;
+        struct CompiledBody
+        {
+            std::vector<Symbol*> captured;
+            std::shared_ptr<CompiledNode> body;
+            unsigned int frameSize;
+        };
+        // compiled bodies of each lambda or closure form, one per distinct
+        // set of captures (usually just one)
+        std::unordered_map<const ListNode*, std::vector<CompiledBody>> compiledBodyCache;
+        // the expansion of each macro call site, and the macro that made it
+        std::unordered_map<const ListNode*, std::pair<Macro*, LispHandle>> macroExpansions;
+        // values referenced from native code, see lisp_handles.h
+        std::shared_ptr<HandleTable> handles;
+
+        void buildLambda(Lambda* result, LispHandle args);
+        void compileBody(Lambda* lambda, Closure* closure, const ListNode* form);
+        const std::vector<Symbol*>& freeVariables(LispHandle closureArgs);
+        void captureLocals(LispHandle args, std::vector<std::pair<Symbol*, LispHandle>>& captured);
+        bool findLocal(Symbol* sym, LispHandle& value);
+        LispHandle enter(Lambda* lambda, Closure* closure, size_t argumentBase);
+        ListNode* constructTemporary(LispHandle first, LispHandle second);
+        ListNode* forward(ListNode* node);
+        LispHandle promote(LispHandle value, size_t nurseryMark);
 
         public:
-        VirtualMachine();
+        // the fewest list items worth sending to another thread by pmap etc.
+        static const unsigned int parallelThreshold = 32;
+
+        // the arena block size of a VM forked by pmap etc., which usually
+        // holds one function and a share of a list
+        static const size_t forkBlockSize = 0x400;
+
+        explicit VirtualMachine(size_t blockSize = SpecialisedMemory<ListNode>::defaultSize);
         /*~VirtualMachine();
 
         // forbid copying
@@ -305,6 +591,7 @@ namespace lisp
 
         void bind(Symbol* key, LispHandle value) {exStack.bind(key, value);}
         void print(LispHandle expr, std::ostream& printStream);
+        const std::string& printToBuffer(LispHandle expr) {return printer.print(expr, builtins.nil);}
         void printLn(LispHandle expr, std::ostream& printStream)
         {
             print(expr, printStream);
@@ -313,8 +600,25 @@ namespace lisp
         LispHandle read(std::istream& readStream);
         LispHandle read(std::istream& readStream, SymbolString thisToken);
         LispHandle evaluate(LispHandle expr);
+        LispHandle evaluateWithLocals(LispHandle expr, const LocalSlots& locals);
+        LispHandle expandMacro(Macro* macro, ListNode* callSite);
+        LispHandle& local(unsigned int slot) {return argumentStack[frameBase + slot];}
+        size_t argumentBase() {return argumentStack.size();}
+        void pushArgument(LispHandle value) {argumentStack.push_back(value);}
+        LispHandle* argumentsFrom(size_t base) {return argumentStack.data() + base;}
+        void popArguments(size_t base) {argumentStack.resize(base);}
+        LispHandle invoke(Lambda* lambda, size_t argumentBase) {return enter(lambda, nullptr, argumentBase);}
+        LispHandle invoke(Closure* closure, size_t argumentBase) {return enter(closure, closure, argumentBase);}
+        LispHandle callNative(NativeFunctionPtr function, const LispHandle* values, size_t count);
+        LispHandle apply(LispHandle function, const LispHandle* values, size_t count);
+        // a native reference to value, which reads as null once released or
+        // once this VM is gone
+        ExternalHandle hold(LispHandle value);
+        ListNode* cons(LispHandle first, LispHandle second) {return memory.lists.construct(first, second);}
+        size_t heapSize() const {return memory.lists.size();}
+        LispHandle truth(bool value) {return value ? LispHandle(builtins.t) : LispHandle(builtins.nil);}
         void readFile(std::string path);
-        ListNode* readList(std::istream& readStream);
+        LispHandle readList(std::istream& readStream);
         SymbolString readToken(std::istream& readStream);
         Symbol* stringToSymbol(SymbolString name);
         bool isAtom(LispHandle expr); // nil is considered an atom
@@ -328,6 +632,26 @@ namespace lisp
         friend LispHandle progn_SF(VirtualMachine& vm, LispHandle args);
         friend LispHandle cond_SF(VirtualMachine& vm, LispHandle args);
         friend LispHandle closure_SF(VirtualMachine& vm, LispHandle args);
+        friend LispHandle defmacro_SF(VirtualMachine& vm, LispHandle args);
+
+        friend class Compiler;
+        friend class Transfer;
+    };
+
+    class ArgumentScope
+    {
+        // drops every argument pushed during its lifetime, so the argument
+        // stack is back where it was even when evaluating one throws
+        VirtualMachine& vm;
+        size_t base;
+    public:
+        explicit ArgumentScope(VirtualMachine& newVM) : vm(newVM), base(newVM.argumentBase()) {}
+        ~ArgumentScope() {vm.popArguments(base);}
+
+        size_t getBase() const {return base;}
+
+        ArgumentScope(const ArgumentScope&) = delete;
+        ArgumentScope& operator=(const ArgumentScope&) = delete;
     };
 }
 
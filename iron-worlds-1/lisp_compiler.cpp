@@ -0,0 +1,1024 @@
+#include "lisp_compiler.h"
+
+#include <algorithm>
+
+namespace lisp
+{
+    typedef std::unique_ptr<CompiledNode> NodePtr;
+
+    bool isBoundTo(Symbol* sym, LispHandle::Tag tag, NativeFunctionPtr function)
+    {
+        // guard used by nodes compiled against a builtin binding
+        if (sym->bindingStack.empty())
+        {
+            return false;
+        }
+        LispHandle value = sym->bindingStack.back();
+        if (value.tag != tag)
+        {
+            return false;
+        }
+        return (tag == LispHandle::SpecialFormT ? value.specialForm : value.nativeFunction) == function;
+    }
+
+    bool CompileGuard::holds() const
+    {
+        if (sym->bindingStack.empty())
+        {
+            return false;
+        }
+        LispHandle value = sym->bindingStack.back();
+        if (value.tag != expected.tag)
+        {
+            return false;
+        }
+        if (value.tag == LispHandle::FixnumT)
+        {
+            return value.fixnum == expected.fixnum;
+        }
+        return value.listNode == expected.listNode;
+    }
+
+    bool allHold(const std::vector<CompileGuard>& guards)
+    {
+        for (const CompileGuard& guard : guards)
+        {
+            if (!guard.holds())
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    bool isPureBuiltin(NativeFunctionPtr function)
+    {
+        // builtins with no effects and a result that depends only on their
+        // arguments, so they can be run at compile time. cons and list are
+        // left out since each call must make a fresh cons
+        return function == add_NF || function == subtract_NF || function == multiply_NF
+            || function == lessThan_NF || function == numEqual_NF || function == car_NF
+            || function == cdr_NF || function == eq_NF || function == atom_NF;
+    }
+
+    class InterpretNode : public CompiledNode
+    {
+        // a form the compiler does not handle, left to the interpreter along
+        // with the slots it can see. Other nodes keep one to fall back on
+        // when a guard fails
+        LispHandle source;
+        LocalSlots locals;
+    public:
+        InterpretNode(LispHandle expr, const LocalSlots& visible) : source(expr), locals(visible) {}
+
+        LispHandle run(VirtualMachine& vm) {return vm.evaluateWithLocals(source, locals);}
+    };
+
+    class ConstantNode : public CompiledNode
+    {
+        LispHandle value;
+    public:
+        explicit ConstantNode(LispHandle newValue) : value(newValue) {}
+
+        LispHandle run(VirtualMachine&) {return value;}
+    };
+
+    class LocalNode : public CompiledNode
+    {
+        unsigned int slot;
+    public:
+        explicit LocalNode(unsigned int newSlot) : slot(newSlot) {}
+
+        LispHandle run(VirtualMachine& vm) {return vm.local(slot);}
+    };
+
+    class GuardedConstantNode : public CompiledNode
+    {
+        // a value worked out at compile time from bindings that may change
+        LispHandle value;
+        std::vector<CompileGuard> guards;
+        InterpretNode fallback;
+    public:
+        GuardedConstantNode(LispHandle newValue, std::vector<CompileGuard> newGuards, InterpretNode newFallback)
+            : value(newValue), guards(std::move(newGuards)), fallback(newFallback) {}
+
+        LispHandle run(VirtualMachine& vm)
+        {
+            if (!allHold(guards))
+            {
+                return fallback.run(vm);
+            }
+            return value;
+        }
+    };
+
+    class SymbolNode : public CompiledNode
+    {
+        Symbol* sym;
+    public:
+        explicit SymbolNode(Symbol* newSym) : sym(newSym) {}
+
+        LispHandle run(VirtualMachine&)
+        {
+            // a free symbol in a body is global, the bindings above that
+            // belong to whoever called this lambda
+            if (sym->globalBindings == 0)
+            {
+                ELOG("Unbound symbol (" << sym->name << ")");
+                throw std::domain_error("unbound symbol");
+            }
+            return sym->bindingStack[sym->globalBindings - 1];
+        }
+    };
+
+    class CondNode : public CompiledNode
+    {
+        Symbol* head;
+        std::vector<std::pair<NodePtr, NodePtr>> clauses;
+        // the result of a clause whose test is known to pass, if any
+        NodePtr final;
+        LispHandle terminator;
+        // what the clauses left out at compile time relied on
+        std::vector<CompileGuard> guards;
+        InterpretNode fallback;
+    public:
+        CondNode(Symbol* newHead, InterpretNode newFallback) : head(newHead), fallback(newFallback) {}
+
+        void addClause(NodePtr test, NodePtr result)
+        {
+            clauses.emplace_back(std::move(test), std::move(result));
+        }
+        void addGuards(const std::vector<CompileGuard>& newGuards)
+        {
+            guards.insert(guards.end(), newGuards.begin(), newGuards.end());
+        }
+        void setFinal(NodePtr result) {final = std::move(result);}
+        void setTerminator(LispHandle newTerminator) {terminator = newTerminator;}
+
+        LispHandle run(VirtualMachine& vm)
+        {
+            if (!isBoundTo(head, LispHandle::SpecialFormT, cond_SF) || !allHold(guards))
+            {
+                return fallback.run(vm);
+            }
+            for (std::pair<NodePtr, NodePtr>& clause : clauses)
+            {
+                if (!vm.isNil(clause.first->run(vm)))
+                {
+                    return clause.second->run(vm);
+                }
+            }
+            if (final)
+            {
+                return final->run(vm);
+            }
+            return terminator;
+        }
+    };
+
+    class PrognNode : public CompiledNode
+    {
+        Symbol* head;
+        std::vector<NodePtr> forms;
+        InterpretNode fallback;
+    public:
+        PrognNode(Symbol* newHead, std::vector<NodePtr> newForms, InterpretNode newFallback)
+            : head(newHead), forms(std::move(newForms)), fallback(newFallback) {}
+
+        LispHandle run(VirtualMachine& vm)
+        {
+            if (!isBoundTo(head, LispHandle::SpecialFormT, progn_SF))
+            {
+                return fallback.run(vm);
+            }
+            LispHandle result;
+            for (NodePtr& form : forms)
+            {
+                result = form->run(vm);
+            }
+            return result;
+        }
+    };
+
+    class LetNode : public CompiledNode
+    {
+        // values go straight into the slots after those already in scope
+        Symbol* head;
+        unsigned int firstSlot;
+        std::vector<NodePtr> values;
+        std::vector<NodePtr> body;
+        InterpretNode fallback;
+    public:
+        LetNode(Symbol* newHead, unsigned int newFirstSlot, std::vector<NodePtr> newValues,
+                std::vector<NodePtr> newBody, InterpretNode newFallback)
+            : head(newHead), firstSlot(newFirstSlot), values(std::move(newValues)),
+            body(std::move(newBody)), fallback(newFallback) {}
+
+        LispHandle run(VirtualMachine& vm)
+        {
+            if (!isBoundTo(head, LispHandle::SpecialFormT, let_SF))
+            {
+                return fallback.run(vm);
+            }
+            for (size_t i = 0; i < values.size(); i++)
+            {
+                // the value may grow the argument stack, so take it first
+                LispHandle value = values[i]->run(vm);
+                vm.local(firstSlot + i) = value;
+            }
+            LispHandle result;
+            for (NodePtr& form : body)
+            {
+                result = form->run(vm);
+            }
+            return result;
+        }
+    };
+
+    class InlineNode : public CompiledNode
+    {
+        // a call to a small pure lambda, with the body compiled in place.
+        // Arguments go in reserved slots of the caller's frame
+        Symbol* head;
+        Lambda* lambda;
+        unsigned int firstSlot;
+        std::vector<NodePtr> arguments;
+        NodePtr body;
+        InterpretNode fallback;
+    public:
+        InlineNode(Symbol* newHead, Lambda* newLambda, unsigned int newFirstSlot,
+                   std::vector<NodePtr> newArguments, NodePtr newBody, InterpretNode newFallback)
+            : head(newHead), lambda(newLambda), firstSlot(newFirstSlot),
+            arguments(std::move(newArguments)), body(std::move(newBody)), fallback(newFallback) {}
+
+        LispHandle run(VirtualMachine& vm)
+        {
+            if (head->bindingStack.empty() || head->bindingStack.back().tag != LispHandle::LambdaT
+                || head->bindingStack.back().lambda != lambda)
+            {
+                return fallback.run(vm);
+            }
+            for (size_t i = 0; i < arguments.size(); i++)
+            {
+                LispHandle value = arguments[i]->run(vm);
+                vm.local(firstSlot + i) = value;
+            }
+            return body->run(vm);
+        }
+    };
+
+    class MacroNode : public CompiledNode
+    {
+        // a macro call compiled as its expansion, for as long as the head
+        // names the macro that expanded it
+        Symbol* head;
+        Macro* macro;
+        NodePtr expansion;
+        InterpretNode fallback;
+    public:
+        MacroNode(Symbol* newHead, Macro* newMacro, NodePtr newExpansion, InterpretNode newFallback)
+            : head(newHead), macro(newMacro), expansion(std::move(newExpansion)), fallback(newFallback) {}
+
+        LispHandle run(VirtualMachine& vm)
+        {
+            if (head->bindingStack.empty() || head->bindingStack.back().tag != LispHandle::MacroT
+                || head->bindingStack.back().macro != macro)
+            {
+                return fallback.run(vm);
+            }
+            return expansion->run(vm);
+        }
+    };
+
+    class CallNode : public CompiledNode
+    {
+        NodePtr function;
+        std::vector<NodePtr> arguments;
+        InterpretNode fallback;
+    public:
+        CallNode(NodePtr newFunction, std::vector<NodePtr> newArguments, InterpretNode newFallback)
+            : function(std::move(newFunction)), arguments(std::move(newArguments)), fallback(newFallback) {}
+
+        LispHandle run(VirtualMachine& vm)
+        {
+            LispHandle functionValue = function->run(vm);
+            switch (functionValue.tag)
+            {
+            case LispHandle::LambdaT:
+                {
+                    ArgumentScope values(vm);
+                    for (NodePtr& argument : arguments)
+                    {
+                        vm.pushArgument(argument->run(vm));
+                    }
+                    return vm.invoke(functionValue.lambda, values.getBase());
+                }
+
+            case LispHandle::ClosureT:
+                {
+                    ArgumentScope values(vm);
+                    for (NodePtr& argument : arguments)
+                    {
+                        vm.pushArgument(argument->run(vm));
+                    }
+                    return vm.invoke(functionValue.closure, values.getBase());
+                }
+
+            case LispHandle::NativeFunctionT:
+                {
+                    ArgumentScope values(vm);
+                    for (NodePtr& argument : arguments)
+                    {
+                        vm.pushArgument(argument->run(vm));
+                    }
+                    return vm.callNative(functionValue.nativeFunction, vm.argumentsFrom(values.getBase()), arguments.size());
+                }
+
+            default:
+                // the head is now a special form or not a function at all
+                return fallback.run(vm);
+            }
+        }
+    };
+
+    enum class FixnumOperator
+    {
+        Add, Subtract, Multiply, LessThan, NumEqual
+    };
+
+    class FixnumOperatorNode : public CompiledNode
+    {
+        // a 2-argument call to a builtin arithmetic function, done inline
+        // while both operands are fixnums
+        Symbol* head;
+        NativeFunctionPtr builtin;
+        FixnumOperator op;
+        NodePtr left, right;
+        InterpretNode fallback;
+    public:
+        FixnumOperatorNode(Symbol* newHead, NativeFunctionPtr newBuiltin, FixnumOperator newOp,
+                           NodePtr newLeft, NodePtr newRight, InterpretNode newFallback)
+            : head(newHead), builtin(newBuiltin), op(newOp),
+            left(std::move(newLeft)), right(std::move(newRight)), fallback(newFallback) {}
+
+        LispHandle run(VirtualMachine& vm)
+        {
+            if (!isBoundTo(head, LispHandle::NativeFunctionT, builtin))
+            {
+                return fallback.run(vm);
+            }
+            LispHandle values[2] = {left->run(vm), right->run(vm)};
+            if (values[0].tag == LispHandle::FixnumT && values[1].tag == LispHandle::FixnumT)
+            {
+                Fixnum a = values[0].fixnum;
+                Fixnum b = values[1].fixnum;
+                switch (op)
+                {
+                case FixnumOperator::Add:
+                    return LispHandle(fixnumAdd(a, b));
+                case FixnumOperator::Subtract:
+                    return LispHandle(fixnumSubtract(a, b));
+                case FixnumOperator::Multiply:
+                    return LispHandle(fixnumMultiply(a, b));
+                case FixnumOperator::LessThan:
+                    return vm.truth(a < b);
+                case FixnumOperator::NumEqual:
+                    return vm.truth(a == b);
+                default:
+                    break;
+                }
+            }
+            // not fixnums, let the builtin report the type error
+            return vm.callNative(builtin, values, 2);
+        }
+    };
+
+    unsigned int Compiler::addLocal(Symbol* sym)
+    {
+        unsigned int slot = slotBase + locals.size();
+        locals.emplace_back(sym, slot);
+        if (slot + 1 > frameSize)
+        {
+            frameSize = slot + 1;
+        }
+        if (fixnumSlots.size() < frameSize)
+        {
+            fixnumSlots.resize(frameSize);
+        }
+        fixnumSlots[slot] = false;
+        return slot;
+    }
+
+    void Compiler::addEntryGuard(Symbol* sym, LispHandle expected)
+    {
+        for (const CompileGuard& guard : entryGuards)
+        {
+            if (guard.sym == sym)
+            {
+                return;
+            }
+        }
+        entryGuards.push_back({sym, expected});
+    }
+
+    bool Compiler::isKnownFixnum(LispHandle expr)
+    {
+        // whether expr is sure to give a fixnum in a specialised body, given
+        // the entry guards this adds
+        if (expr.tag == LispHandle::FixnumT)
+        {
+            return true;
+        }
+        if (expr.tag == LispHandle::BasicSymbolT)
+        {
+            for (size_t i = locals.size(); i > 0; i--)
+            {
+                if (locals[i - 1].first == expr.basicSymbol)
+                {
+                    return fixnumSlots[locals[i - 1].second];
+                }
+            }
+            return false;
+        }
+        if (!specialising || expr.tag != LispHandle::ListT)
+        {
+            return false;
+        }
+
+        LispHandle head = expr.car();
+        if (head.tag != LispHandle::BasicSymbolT || isLocal(head.basicSymbol)
+            || head.basicSymbol->bindingStack.empty())
+        {
+            return false;
+        }
+        LispHandle headValue = head.basicSymbol->bindingStack.back();
+        if (headValue.tag != LispHandle::NativeFunctionT
+            || (headValue.nativeFunction != add_NF && headValue.nativeFunction != subtract_NF
+                && headValue.nativeFunction != multiply_NF))
+        {
+            return false;
+        }
+        LispHandle args = expr.cdr();
+        if (args.tag != LispHandle::ListT || args.cdr().tag != LispHandle::ListT || !vm.isNil(args.cdr().cdr())
+            || !isKnownFixnum(args.car()) || !isKnownFixnum(args.cdr().car()))
+        {
+            return false;
+        }
+        addEntryGuard(head.basicSymbol, headValue);
+        return true;
+    }
+
+    bool Compiler::isLocal(Symbol* sym) const
+    {
+        for (const std::pair<Symbol*, unsigned int>& local : locals)
+        {
+            if (local.first == sym)
+            {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    class UncheckedFixnumNode : public CompiledNode
+    {
+        // arithmetic in a specialised body, where both operands are known to
+        // be fixnums and the builtin's binding was checked on entry
+        FixnumOperator op;
+        NodePtr left, right;
+    public:
+        UncheckedFixnumNode(FixnumOperator newOp, NodePtr newLeft, NodePtr newRight)
+            : op(newOp), left(std::move(newLeft)), right(std::move(newRight)) {}
+
+        LispHandle run(VirtualMachine& vm)
+        {
+            Fixnum a = left->run(vm).fixnum;
+            Fixnum b = right->run(vm).fixnum;
+            switch (op)
+            {
+            case FixnumOperator::Add:
+                return LispHandle(fixnumAdd(a, b));
+            case FixnumOperator::Subtract:
+                return LispHandle(fixnumSubtract(a, b));
+            case FixnumOperator::Multiply:
+                return LispHandle(fixnumMultiply(a, b));
+            case FixnumOperator::LessThan:
+                return vm.truth(a < b);
+            default:
+                return vm.truth(a == b);
+            }
+        }
+    };
+
+    class EntryCheckNode : public CompiledNode
+    {
+        // runs the specialised body when the arguments satisfy their
+        // qualifiers and the bindings it relies on still hold
+        std::vector<std::pair<unsigned int, Qualifiers>> checks;
+        std::vector<CompileGuard> guards;
+        NodePtr specialised;
+        std::shared_ptr<CompiledNode> generic;
+    public:
+        EntryCheckNode(std::vector<std::pair<unsigned int, Qualifiers>> newChecks, std::vector<CompileGuard> newGuards,
+                       NodePtr newSpecialised, std::shared_ptr<CompiledNode> newGeneric)
+            : checks(std::move(newChecks)), guards(std::move(newGuards)),
+            specialised(std::move(newSpecialised)), generic(newGeneric) {}
+
+        LispHandle run(VirtualMachine& vm)
+        {
+            for (std::pair<unsigned int, Qualifiers>& check : checks)
+            {
+                if (!check.second.satisfiedBy(vm.local(check.first)))
+                {
+                    return generic->run(vm);
+                }
+            }
+            if (!allHold(guards))
+            {
+                return generic->run(vm);
+            }
+            return specialised->run(vm);
+        }
+    };
+
+    std::shared_ptr<CompiledNode> compileLambdaBody(VirtualMachine& vm, Lambda* lambda,
+        const std::vector<Symbol*>& captured, unsigned int& frameSize)
+    {
+        Compiler generic(vm);
+        for (Symbol* parameter : lambda->parameters)
+        {
+            generic.addLocal(parameter);
+        }
+        for (Symbol* sym : captured)
+        {
+            generic.addLocal(sym);
+        }
+        std::shared_ptr<CompiledNode> genericBody(generic.compile(lambda->body));
+        frameSize = generic.getFrameSize();
+
+        std::vector<std::pair<unsigned int, Qualifiers>> checks;
+        for (size_t i = 0; i < lambda->parameterQualifiers.size(); i++)
+        {
+            if (lambda->parameterQualifiers[i].isChecked())
+            {
+                checks.emplace_back(i, lambda->parameterQualifiers[i]);
+            }
+        }
+        if (checks.empty())
+        {
+            return genericBody;
+        }
+
+        Compiler specialised(vm);
+        specialised.specialise();
+        for (Symbol* parameter : lambda->parameters)
+        {
+            specialised.addLocal(parameter);
+        }
+        for (Symbol* sym : captured)
+        {
+            specialised.addLocal(sym);
+        }
+        for (std::pair<unsigned int, Qualifiers>& check : checks)
+        {
+            specialised.setFixnumSlot(check.first);
+        }
+        NodePtr specialisedBody = specialised.compile(lambda->body);
+        if (specialised.getEntryGuards().empty())
+        {
+            // nothing was left unchecked, so there is nothing to gain
+            return genericBody;
+        }
+        if (specialised.getFrameSize() > frameSize)
+        {
+            frameSize = specialised.getFrameSize();
+        }
+        return std::shared_ptr<CompiledNode>(new EntryCheckNode(std::move(checks), specialised.getEntryGuards(),
+            std::move(specialisedBody), genericBody));
+    }
+
+    NodePtr Compiler::compile(LispHandle expr)
+    {
+        switch (expr.tag)
+        {
+        case LispHandle::FixnumT:
+            return NodePtr(new ConstantNode(expr));
+
+        case LispHandle::BasicSymbolT:
+            // innermost binding wins
+            for (size_t i = locals.size(); i > 0; i--)
+            {
+                if (locals[i - 1].first == expr.basicSymbol)
+                {
+                    return NodePtr(new LocalNode(locals[i - 1].second));
+                }
+            }
+            return NodePtr(new SymbolNode(expr.basicSymbol));
+
+        case LispHandle::ListT:
+            {
+                LispHandle value;
+                std::vector<CompileGuard> guards;
+                if (foldConstant(expr, value, guards))
+                {
+                    return NodePtr(new GuardedConstantNode(value, std::move(guards), InterpretNode(expr, locals)));
+                }
+                return compileList(expr);
+            }
+
+        default:
+            return NodePtr(new InterpretNode(expr, locals));
+        }
+    }
+
+    bool Compiler::foldConstant(LispHandle expr, LispHandle& value, std::vector<CompileGuard>& guards)
+    {
+        // works out expr's value now if it only depends on literals, global
+        // bindings and pure builtins, adding a guard for each binding read
+        switch (expr.tag)
+        {
+        case LispHandle::FixnumT:
+            value = expr;
+            return true;
+
+        case LispHandle::BasicSymbolT:
+            {
+                Symbol* sym = expr.basicSymbol;
+                if (isLocal(sym) || sym->bindingStack.empty() || sym->bindingStack.size() != sym->globalBindings)
+                {
+                    return false;
+                }
+                value = sym->bindingStack.back();
+                guards.push_back({sym, value});
+                return true;
+            }
+
+        case LispHandle::ListT:
+            break;
+
+        default:
+            return false;
+        }
+
+        LispHandle head = expr.car();
+        if (head.tag != LispHandle::BasicSymbolT || isLocal(head.basicSymbol)
+            || head.basicSymbol->bindingStack.empty())
+        {
+            return false;
+        }
+        LispHandle headValue = head.basicSymbol->bindingStack.back();
+
+        if (headValue.tag == LispHandle::SpecialFormT && headValue.specialForm == quote_SF)
+        {
+            if (expr.cdr().tag != LispHandle::ListT)
+            {
+                return false;
+            }
+            value = expr.cdr().car();
+            guards.push_back({head.basicSymbol, headValue});
+            return true;
+        }
+
+        if (headValue.tag != LispHandle::NativeFunctionT || !isPureBuiltin(headValue.nativeFunction))
+        {
+            return false;
+        }
+        std::vector<LispHandle> values;
+        std::vector<CompileGuard> argumentGuards;
+        LispHandle args = expr.cdr();
+        for (; args.tag == LispHandle::ListT; args = args.cdr())
+        {
+            LispHandle argumentValue;
+            if (!foldConstant(args.car(), argumentValue, argumentGuards))
+            {
+                return false;
+            }
+            values.push_back(argumentValue);
+        }
+        if (!vm.isNil(args))
+        {
+            return false;
+        }
+        try
+        {
+            value = vm.callNative(headValue.nativeFunction, values.data(), values.size());
+        }
+        catch (std::exception&)
+        {
+            // leave the error to be raised when the code actually runs
+            return false;
+        }
+        guards.insert(guards.end(), argumentGuards.begin(), argumentGuards.end());
+        guards.push_back({head.basicSymbol, headValue});
+        return true;
+    }
+
+    bool Compiler::isPure(LispHandle expr, const std::vector<Symbol*>& parameters, unsigned int& size)
+    {
+        // true if expr only reads parameters, globals and quoted data through
+        // cond and pure builtins. size counts the conses looked at
+        if (expr.tag != LispHandle::ListT)
+        {
+            return expr.tag == LispHandle::FixnumT || expr.tag == LispHandle::BasicSymbolT;
+        }
+        LispHandle head = expr.car();
+        if (head.tag != LispHandle::BasicSymbolT || head.basicSymbol->bindingStack.empty()
+            || std::find(parameters.begin(), parameters.end(), head.basicSymbol) != parameters.end())
+        {
+            return false;
+        }
+        LispHandle headValue = head.basicSymbol->bindingStack.back();
+        if (headValue.tag == LispHandle::SpecialFormT && headValue.specialForm == quote_SF)
+        {
+            size++;
+            return true;
+        }
+        bool isCond = headValue.tag == LispHandle::SpecialFormT && headValue.specialForm == cond_SF;
+        if (!isCond && !(headValue.tag == LispHandle::NativeFunctionT && isPureBuiltin(headValue.nativeFunction)))
+        {
+            return false;
+        }
+        for (LispHandle rest = expr.cdr(); rest.tag == LispHandle::ListT; rest = rest.cdr())
+        {
+            if (++size > inlineLimit)
+            {
+                return false;
+            }
+            if (!isCond)
+            {
+                if (!isPure(rest.car(), parameters, size))
+                {
+                    return false;
+                }
+                continue;
+            }
+            if (rest.car().tag != LispHandle::ListT)
+            {
+                return false;
+            }
+            for (LispHandle part = rest.car(); part.tag == LispHandle::ListT; part = part.cdr())
+            {
+                if (!isPure(part.car(), parameters, size))
+                {
+                    return false;
+                }
+            }
+        }
+        return true;
+    }
+
+    bool Compiler::isInlinable(Lambda* lambda)
+    {
+        if (std::find(inlining.begin(), inlining.end(), lambda) != inlining.end())
+        {
+            return false;
+        }
+        if (lambda->result.isChecked())
+        {
+            // the guarantee is checked on return, which inlining would skip
+            return false;
+        }
+        unsigned int size = 0;
+        return isPure(lambda->body, lambda->parameters, size) && size <= inlineLimit;
+    }
+
+    NodePtr Compiler::compileList(LispHandle expr)
+    {
+        LispHandle head = expr.car();
+        if (head.tag != LispHandle::BasicSymbolT || isLocal(head.basicSymbol)
+            || head.basicSymbol->bindingStack.empty())
+        {
+            return compileCall(expr);
+        }
+
+        Symbol* headSymbol = head.basicSymbol;
+        LispHandle headValue = headSymbol->bindingStack.back();
+
+        if (headValue.tag == LispHandle::SpecialFormT)
+        {
+            // well formed quotes have already been folded
+            if (headValue.specialForm == cond_SF)
+            {
+                return compileCond(headSymbol, expr);
+            }
+            else if (headValue.specialForm == progn_SF)
+            {
+                return compileProgn(headSymbol, expr);
+            }
+            else if (headValue.specialForm == let_SF)
+            {
+                return compileLet(headSymbol, expr);
+            }
+            // def and the lambda forms stay interpreted
+            return NodePtr(new InterpretNode(expr, locals));
+        }
+
+        if (headValue.tag == LispHandle::LambdaT && isInlinable(headValue.lambda))
+        {
+            return compileInline(headSymbol, headValue.lambda, expr);
+        }
+
+        if (headValue.tag == LispHandle::MacroT)
+        {
+            LispHandle expansion = vm.expandMacro(headValue.macro, expr.listNode);
+            return NodePtr(new MacroNode(headSymbol, headValue.macro, compile(expansion), InterpretNode(expr, locals)));
+        }
+
+        if (headValue.tag == LispHandle::NativeFunctionT)
+        {
+            std::vector<NodePtr> arguments;
+            if (!compileArguments(expr.cdr(), arguments))
+            {
+                return NodePtr(new InterpretNode(expr, locals));
+            }
+
+            FixnumOperator op;
+            NativeFunctionPtr builtin = headValue.nativeFunction;
+            if (builtin == add_NF)
+                op = FixnumOperator::Add;
+            else if (builtin == subtract_NF)
+                op = FixnumOperator::Subtract;
+            else if (builtin == multiply_NF)
+                op = FixnumOperator::Multiply;
+            else if (builtin == lessThan_NF)
+                op = FixnumOperator::LessThan;
+            else if (builtin == numEqual_NF)
+                op = FixnumOperator::NumEqual;
+            else
+                return compileCall(expr);
+
+            if (arguments.size() != 2)
+            {
+                return compileCall(expr);
+            }
+            if (specialising && isKnownFixnum(expr.cdr().car()) && isKnownFixnum(expr.cdr().cdr().car()))
+            {
+                addEntryGuard(headSymbol, headValue);
+                return NodePtr(new UncheckedFixnumNode(op, std::move(arguments[0]), std::move(arguments[1])));
+            }
+            return NodePtr(new FixnumOperatorNode(headSymbol, builtin, op,
+                std::move(arguments[0]), std::move(arguments[1]), InterpretNode(expr, locals)));
+        }
+
+        return compileCall(expr);
+    }
+
+    NodePtr Compiler::compileCond(Symbol* head, LispHandle expr)
+    {
+        std::unique_ptr<CondNode> result(new CondNode(head, InterpretNode(expr, locals)));
+        LispHandle clauses = expr.cdr();
+        while (clauses.tag == LispHandle::ListT)
+        {
+            LispHandle clause = clauses.car();
+            if (clause.tag != LispHandle::ListT || vm.isAtom(clause.cdr()))
+            {
+                // malformed clause, keep the interpreter's behaviour
+                return NodePtr(new InterpretNode(expr, locals));
+            }
+
+            LispHandle testValue;
+            std::vector<CompileGuard> testGuards;
+            if (!foldConstant(clause.car(), testValue, testGuards))
+            {
+                result->addClause(compile(clause.car()), compile(clause.cdr().car()));
+            }
+            else
+            {
+                result->addGuards(testGuards);
+                if (!vm.isNil(testValue))
+                {
+                    // always taken, so no later clause is reachable
+                    result->setFinal(compile(clause.cdr().car()));
+                    return NodePtr(std::move(result));
+                }
+                // never taken, leave it out
+            }
+            clauses = clauses.cdr();
+        }
+        result->setTerminator(clauses);
+        return NodePtr(std::move(result));
+    }
+
+    NodePtr Compiler::compileProgn(Symbol* head, LispHandle expr)
+    {
+        std::vector<NodePtr> forms;
+        if (!compileArguments(expr.cdr(), forms))
+        {
+            return NodePtr(new InterpretNode(expr, locals));
+        }
+        return NodePtr(new PrognNode(head, std::move(forms), InterpretNode(expr, locals)));
+    }
+
+    NodePtr Compiler::compileLet(Symbol* head, LispHandle expr)
+    {
+        // values are compiled in the enclosing scope, the body with each name
+        // in a fresh slot. The slots are reserved first, so that lets and
+        // inlined calls within the values use slots beyond them
+        InterpretNode fallback(expr, locals);
+        LispHandle rest = expr.cdr();
+        if (rest.tag != LispHandle::ListT)
+        {
+            return NodePtr(new InterpretNode(fallback));
+        }
+
+        std::vector<Symbol*> names;
+        std::vector<LispHandle> valueForms;
+        for (LispHandle bindings = rest.car(); bindings.tag == LispHandle::ListT; bindings = bindings.cdr())
+        {
+            LispHandle binding = bindings.car();
+            if (binding.tag != LispHandle::ListT || binding.car().tag != LispHandle::BasicSymbolT
+                || vm.isAtom(binding.cdr()))
+            {
+                // malformed binding, let the interpreter report it
+                return NodePtr(new InterpretNode(fallback));
+            }
+            names.push_back(binding.car().basicSymbol);
+            valueForms.push_back(binding.cdr().car());
+        }
+
+        size_t outerLocals = locals.size();
+        unsigned int firstSlot = slotBase + locals.size();
+        for (size_t i = 0; i < names.size(); i++)
+        {
+            addLocal(nullptr);
+        }
+        std::vector<NodePtr> values;
+        std::vector<bool> knownFixnums;
+        for (LispHandle valueForm : valueForms)
+        {
+            values.push_back(compile(valueForm));
+            knownFixnums.push_back(isKnownFixnum(valueForm));
+        }
+        for (size_t i = 0; i < names.size(); i++)
+        {
+            locals[outerLocals + i].first = names[i];
+            fixnumSlots[firstSlot + i] = knownFixnums[i];
+        }
+        std::vector<NodePtr> body;
+        bool proper = compileArguments(rest.cdr(), body);
+        locals.resize(outerLocals);
+        if (!proper)
+        {
+            return NodePtr(new InterpretNode(fallback));
+        }
+        return NodePtr(new LetNode(head, firstSlot, std::move(values), std::move(body), fallback));
+    }
+
+    NodePtr Compiler::compileInline(Symbol* head, Lambda* lambda, LispHandle expr)
+    {
+        // arguments are compiled in this scope into reserved slots, then the
+        // body in a scope holding only its parameters, mapped onto them
+        InterpretNode fallback(expr, locals);
+        size_t outerLocals = locals.size();
+        unsigned int firstSlot = slotBase + locals.size();
+        for (size_t i = 0; i < lambda->parameters.size(); i++)
+        {
+            addLocal(nullptr);
+        }
+        std::vector<NodePtr> arguments;
+        if (!compileArguments(expr.cdr(), arguments) || arguments.size() != lambda->parameters.size())
+        {
+            // leave the error to the call
+            locals.resize(outerLocals);
+            return compileCall(expr);
+        }
+
+        LocalSlots callerLocals;
+        callerLocals.swap(locals);
+        unsigned int callerSlotBase = slotBase;
+        slotBase = firstSlot;
+        for (Symbol* parameter : lambda->parameters)
+        {
+            addLocal(parameter);
+        }
+        inlining.push_back(lambda);
+        NodePtr body = compile(lambda->body);
+        inlining.pop_back();
+        slotBase = callerSlotBase;
+        locals.swap(callerLocals);
+        locals.resize(outerLocals);
+
+        return NodePtr(new InlineNode(head, lambda, firstSlot, std::move(arguments), std::move(body), fallback));
+    }
+
+    NodePtr Compiler::compileCall(LispHandle expr)
+    {
+        std::vector<NodePtr> arguments;
+        if (!compileArguments(expr.cdr(), arguments))
+        {
+            return NodePtr(new InterpretNode(expr, locals));
+        }
+        return NodePtr(new CallNode(compile(expr.car()), std::move(arguments), InterpretNode(expr, locals)));
+    }
+
+    bool Compiler::compileArguments(LispHandle args, std::vector<NodePtr>& result)
+    {
+        // false if the argument list is improper
+        while (args.tag == LispHandle::ListT)
+        {
+            result.push_back(compile(args.car()));
+            args = args.cdr();
+        }
+        return vm.isNil(args);
+    }
+}
@@ -0,0 +1,103 @@
+#ifndef LISP_COMPILER_H_INCLUDED
+#define LISP_COMPILER_H_INCLUDED
+
+#include "lisp.h"
+
+#include <memory>
+
+namespace lisp
+{
+    /*
+    Turns a lambda body into a tree of CompiledNodes when the lambda is made.
+    Each node has its form decided once (slot load, symbol load, cond, let,
+    call, fixnum arithmetic) instead of re-dispatching on the list structure
+    every evaluation.
+
+    Parameters, captures and let names are lexically addressed: they get a
+    slot index in the frame and never touch their symbols. Only free symbols
+    are looked up through Symbol::bindingStack. Frames are flat, since a
+    lambda or closure made inside a body copies the local values it refers
+    to into its own frame.
+
+    Nodes guard the assumptions they were compiled under, e.g. that + is
+    still bound to the builtin or that both operands are fixnums. A failed
+    guard, or a form the compiler does not handle, hands the original
+    expression to VirtualMachine::evaluateWithLocals along with the slots
+    in scope, so compiled and interpreted code always agree.
+
+    Some work is done once at compile time: calls to pure builtins on
+    constant arguments are folded, cond clauses with constant tests are
+    dropped or made final, and calls to small pure lambdas (not, and, or)
+    are inlined into the caller's frame. Constants may come from globals, so
+    each such decision carries CompileGuards on the bindings it read.
+
+    This is portable C++ rather than emitted machine code: the Win32 target
+    is 32-bit, and nodes can be replaced one form at a time.
+    */
+    struct CompileGuard
+    {
+        // a compile-time decision holds while sym is bound to expected
+        Symbol* sym;
+        LispHandle expected;
+
+        bool holds() const;
+    };
+
+    // compiles lambda's body with its parameters and then captured in the
+    // first slots. With fixnum qualified parameters the result also holds a
+    // version specialised on them, picked per call by an entry check
+    std::shared_ptr<CompiledNode> compileLambdaBody(VirtualMachine& vm, Lambda* lambda,
+        const std::vector<Symbol*>& captured, unsigned int& frameSize);
+
+    class Compiler
+    {
+        VirtualMachine& vm;
+        // slots in scope at the form being compiled, innermost last. A null
+        // symbol marks a slot that is reserved but not yet visible
+        LocalSlots locals;
+        // the first slot of the current scope, above 0 inside an inlined body
+        unsigned int slotBase = 0;
+        unsigned int frameSize = 0;
+        // lambdas being inlined, so a lambda is never inlined into itself
+        std::vector<Lambda*> inlining;
+        // set when compiling a body specialised on its qualifiers: slots
+        // known to hold fixnums, and bindings checked once on entry in place
+        // of the guards the unchecked nodes leave out
+        bool specialising = false;
+        std::vector<bool> fixnumSlots;
+        std::vector<CompileGuard> entryGuards;
+
+        // the most source conses a lambda body may have to be inlined
+        static const unsigned int inlineLimit = 24;
+
+    public:
+        explicit Compiler(VirtualMachine& parentVM) : vm(parentVM) {}
+
+        // gives sym the next slot, for the parameters and captures of the
+        // body about to be compiled
+        unsigned int addLocal(Symbol* sym);
+        unsigned int getFrameSize() const {return frameSize;}
+        void specialise() {specialising = true;}
+        void setFixnumSlot(unsigned int slot) {fixnumSlots[slot] = true;}
+        const std::vector<CompileGuard>& getEntryGuards() const {return entryGuards;}
+
+        std::unique_ptr<CompiledNode> compile(LispHandle expr);
+
+    private:
+        bool isLocal(Symbol* sym) const;
+        bool foldConstant(LispHandle expr, LispHandle& value, std::vector<CompileGuard>& guards);
+        bool isPure(LispHandle expr, const std::vector<Symbol*>& parameters, unsigned int& size);
+        bool isInlinable(Lambda* lambda);
+        bool isKnownFixnum(LispHandle expr);
+        void addEntryGuard(Symbol* sym, LispHandle expected);
+        std::unique_ptr<CompiledNode> compileList(LispHandle expr);
+        std::unique_ptr<CompiledNode> compileLet(Symbol* head, LispHandle expr);
+        std::unique_ptr<CompiledNode> compileInline(Symbol* head, Lambda* lambda, LispHandle expr);
+        std::unique_ptr<CompiledNode> compileCond(Symbol* head, LispHandle expr);
+        std::unique_ptr<CompiledNode> compileProgn(Symbol* head, LispHandle expr);
+        std::unique_ptr<CompiledNode> compileCall(LispHandle expr);
+        bool compileArguments(LispHandle args, std::vector<std::unique_ptr<CompiledNode>>& result);
+    };
+}
+
+#endif // LISP_COMPILER_H_INCLUDED
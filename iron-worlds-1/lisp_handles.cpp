@@ -0,0 +1,96 @@
+#include "lisp_handles.h"
+
+namespace lisp
+{
+    HandleTable::Id HandleTable::add(LispHandle value)
+    {
+        std::uint32_t index;
+        if (freeSlots.empty())
+        {
+            index = entries.size();
+            entries.emplace_back();
+        }
+        else
+        {
+            index = freeSlots.back();
+            freeSlots.pop_back();
+        }
+        Entry& entry = entries[index];
+        entry.value = value;
+        return {index, entry.generation};
+    }
+
+    void HandleTable::remove(Id id)
+    {
+        if (id.index >= entries.size() || entries[id.index].generation != id.generation)
+        {
+            // already released
+            return;
+        }
+        Entry& entry = entries[id.index];
+        entry.value = LispHandle();
+        entry.generation++;
+        freeSlots.push_back(id.index);
+    }
+
+    ExternalHandle& ExternalHandle::operator=(ExternalHandle&& other)
+    {
+        if (this != &other)
+        {
+            reset();
+            table = std::move(other.table);
+            id = other.id;
+            other.table.reset();
+        }
+        return *this;
+    }
+
+    void ExternalHandle::reset()
+    {
+        if (std::shared_ptr<HandleTable> owner = table.lock())
+        {
+            owner->remove(id);
+        }
+        table.reset();
+    }
+
+    LispHandle ExternalHandle::get() const
+    {
+        if (std::shared_ptr<HandleTable> owner = table.lock())
+        {
+            return owner->get(id);
+        }
+        return LispHandle();
+    }
+
+    VirtualMachine* ExternalHandle::machine() const
+    {
+        if (std::shared_ptr<HandleTable> owner = table.lock())
+        {
+            return &owner->machine();
+        }
+        return nullptr;
+    }
+
+    LispHandle ExternalHandle::call(const LispHandle* args, size_t count) const
+    {
+        std::shared_ptr<HandleTable> owner = table.lock();
+        if (!owner)
+        {
+            return LispHandle();
+        }
+        LispHandle function = owner->get(id);
+        if (function.tag == LispHandle::NullT)
+        {
+            return function;
+        }
+        return owner->machine().apply(function, args, count);
+    }
+
+    ExternalHandle VirtualMachine::hold(LispHandle value)
+    {
+        // a native reference can outlive any nursery scope
+        value = promote(value, 0);
+        return ExternalHandle(handles, handles->add(value));
+    }
+}
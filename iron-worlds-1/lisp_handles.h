@@ -0,0 +1,86 @@
+#ifndef LISP_HANDLES_H_INCLUDED
+#define LISP_HANDLES_H_INCLUDED
+
+#include "lisp.h"
+
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+namespace lisp
+{
+    /*
+    The VM's record of Lisp values held from native code, see "application
+    Interface" in docs/lisp.md. Each value gets a slot, and each slot a
+    generation that is bumped when the slot is released, so an id naming a
+    released (or reused) slot is recognised as stale in O(1). The table
+    belongs to one VM and dies with it.
+    */
+    class HandleTable
+    {
+    public:
+        struct Id
+        {
+            std::uint32_t index;
+            std::uint32_t generation;
+        };
+
+    private:
+        struct Entry
+        {
+            LispHandle value;
+            std::uint32_t generation = 0;
+        };
+
+        VirtualMachine& vm;
+        std::vector<Entry> entries;
+        std::vector<std::uint32_t> freeSlots;
+
+    public:
+        explicit HandleTable(VirtualMachine& parentVM) : vm(parentVM) {}
+
+        Id add(LispHandle value);
+        void remove(Id id);
+        // null if id is stale
+        LispHandle get(Id id) const
+        {
+            if (id.index < entries.size() && entries[id.index].generation == id.generation)
+            {
+                return entries[id.index].value;
+            }
+            return LispHandle();
+        }
+        VirtualMachine& machine() {return vm;}
+    };
+
+    class ExternalHandle
+    {
+        // a native reference to a Lisp value, from VirtualMachine::hold. It
+        // releases its slot when destroyed, and reads as null once its VM is
+        // gone
+        std::weak_ptr<HandleTable> table;
+        HandleTable::Id id;
+
+    public:
+        ExternalHandle() : id{0, 0} {}
+        ExternalHandle(std::weak_ptr<HandleTable> newTable, HandleTable::Id newId)
+            : table(newTable), id(newId) {}
+        ~ExternalHandle() {reset();}
+
+        ExternalHandle(ExternalHandle&& other) : table(std::move(other.table)), id(other.id) {other.table.reset();}
+        ExternalHandle& operator=(ExternalHandle&& other);
+        ExternalHandle(const ExternalHandle&) = delete;
+        ExternalHandle& operator=(const ExternalHandle&) = delete;
+
+        void reset();
+        // null once the value can no longer be reached
+        LispHandle get() const;
+        explicit operator bool() const {return get().tag != LispHandle::NullT;}
+        // null once the VM is gone
+        VirtualMachine* machine() const;
+        // calls the held function with args, returning null if it is gone
+        LispHandle call(const LispHandle* args, size_t count) const;
+    };
+}
+
+#endif // LISP_HANDLES_H_INCLUDED
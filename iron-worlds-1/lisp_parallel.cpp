@@ -0,0 +1,303 @@
+#include "lisp_parallel.h"
+#include "concurrency.h"
+
+namespace lisp
+{
+    LispHandle Transfer::copy(LispHandle value)
+    {
+        switch (value.tag)
+        {
+        case LispHandle::ListT:
+            return copyList(value.listNode);
+
+        case LispHandle::BasicSymbolT:
+            return copySymbol(value.basicSymbol);
+
+        case LispHandle::LambdaT:
+            return copyLambda(value.lambda);
+
+        case LispHandle::ClosureT:
+            return copyClosure(value.closure);
+
+        case LispHandle::MacroT:
+            return copyMacro(value.macro);
+
+        default:
+            // fixnums, and natives which are the same in every VM
+            return value;
+        }
+    }
+
+    LispHandle Transfer::copyList(ListNode* node)
+    {
+        // recurses on car only, so long lists do not deepen the native stack
+        auto found = copied.find(node);
+        if (found != copied.end())
+        {
+            return found->second;
+        }
+
+        ListNode* head = target.memory.lists.construct();
+        copied[node] = LispHandle(head);
+        head->first = copy(node->first);
+
+        ListNode* tail = head;
+        LispHandle rest = node->second;
+        while (rest.tag == LispHandle::ListT)
+        {
+            found = copied.find(rest.listNode);
+            if (found != copied.end())
+            {
+                tail->second = found->second;
+                return LispHandle(head);
+            }
+            ListNode* cell = target.memory.lists.construct();
+            copied[rest.listNode] = LispHandle(cell);
+            tail->second = LispHandle(cell);
+            cell->first = copy(rest.listNode->first);
+            tail = cell;
+            rest = rest.listNode->second;
+        }
+        tail->second = copy(rest);
+        return LispHandle(head);
+    }
+
+    LispHandle Transfer::copyLambda(Lambda* lambda)
+    {
+        auto found = copied.find(lambda);
+        if (found != copied.end())
+        {
+            return found->second;
+        }
+
+        Lambda* result = target.memory.lambdas.construct();
+        copied[lambda] = LispHandle(result);
+        copyLambdaParts(lambda, result);
+        target.compileBody(result, nullptr, nullptr);
+        return LispHandle(result);
+    }
+
+    LispHandle Transfer::copyClosure(Closure* closure)
+    {
+        auto found = copied.find(closure);
+        if (found != copied.end())
+        {
+            return found->second;
+        }
+
+        Closure* result = target.memory.closures.construct();
+        copied[closure] = LispHandle(result);
+        copyLambdaParts(closure, result);
+        for (std::pair<Symbol*, LispHandle>& capture : closure->captured)
+        {
+            result->captured.emplace_back(copySymbol(capture.first), copy(capture.second));
+        }
+        target.compileBody(result, result, nullptr);
+        return LispHandle(result);
+    }
+
+    LispHandle Transfer::copyMacro(Macro* macro)
+    {
+        auto found = copied.find(macro);
+        if (found != copied.end())
+        {
+            return found->second;
+        }
+
+        Macro* result = target.memory.macros.construct();
+        copied[macro] = LispHandle(result);
+        result->expander = copyLambda(macro->expander).lambda;
+        return LispHandle(result);
+    }
+
+    void Transfer::copyLambdaParts(Lambda* lambda, Lambda* result)
+    {
+        for (Symbol* parameter : lambda->parameters)
+        {
+            result->parameters.push_back(copySymbol(parameter));
+        }
+        result->parameterQualifiers = lambda->parameterQualifiers;
+        result->result = lambda->result;
+        result->body = copy(lambda->body);
+    }
+
+    Symbol* Transfer::copySymbol(Symbol* sym)
+    {
+        Symbol* result = target.stringToSymbol(sym->name);
+        if (withBindings && copied.find(sym) == copied.end())
+        {
+            // record first, a definition may refer to itself
+            copied[sym] = LispHandle(result);
+            if (result->bindingStack.empty() && !sym->bindingStack.empty())
+            {
+                target.bind(result, copy(sym->bindingStack.back()));
+            }
+        }
+        return result;
+    }
+
+    std::vector<LispHandle> listToVector(VirtualMachine& vm, LispHandle list)
+    {
+        std::vector<LispHandle> result;
+        while (list.tag == LispHandle::ListT)
+        {
+            result.push_back(list.car());
+            list = list.cdr();
+        }
+        if (!vm.isNil(list))
+        {
+            throw std::domain_error("expected a proper list");
+        }
+        return result;
+    }
+
+    size_t chunkCount(size_t itemCount)
+    {
+        // 1 means not worth running in parallel
+        size_t chunks = itemCount / VirtualMachine::parallelThreshold;
+        size_t concurrency = concurrency::WorkerPool::shared().getConcurrency();
+        if (chunks > concurrency)
+        {
+            chunks = concurrency;
+        }
+        return chunks > 1 ? chunks : 1;
+    }
+
+    enum class ChunkMode
+    {
+        Map, Reduce, ForEach
+    };
+
+    std::vector<LispHandle> runChunks(VirtualMachine& vm, LispHandle function, const std::vector<LispHandle>& items, size_t chunks, ChunkMode mode)
+    {
+        // each chunk runs in a forked VM on a pool thread. Map keeps every
+        // result, Reduce keeps one per chunk, ForEach keeps none. Results
+        // are copied back here, on the calling thread, once all are done
+        std::vector<std::unique_ptr<VirtualMachine>> workers(chunks);
+        std::vector<std::vector<LispHandle>> chunkResults(chunks);
+        std::vector<std::function<void()>> jobs;
+
+        for (size_t chunk = 0; chunk < chunks; chunk++)
+        {
+            size_t begin = items.size() * chunk / chunks;
+            size_t end = items.size() * (chunk + 1) / chunks;
+            jobs.push_back([&vm, &workers, &chunkResults, &items, function, chunk, begin, end, mode]
+            {
+                workers[chunk].reset(new VirtualMachine(VirtualMachine::forkBlockSize));
+                VirtualMachine& worker = *workers[chunk];
+                Transfer forkIn(vm, worker, true);
+                LispHandle workerFunction = forkIn.copy(function);
+                std::vector<LispHandle>& results = chunkResults[chunk];
+
+                LispHandle accumulator = forkIn.copy(items[begin]);
+                for (size_t i = begin; i < end; i++)
+                {
+                    if (mode == ChunkMode::Reduce)
+                    {
+                        if (i == begin)
+                        {
+                            continue;
+                        }
+                        LispHandle pair[2] = {accumulator, forkIn.copy(items[i])};
+                        accumulator = worker.apply(workerFunction, pair, 2);
+                    }
+                    else
+                    {
+                        LispHandle item = forkIn.copy(items[i]);
+                        LispHandle result = worker.apply(workerFunction, &item, 1);
+                        if (mode == ChunkMode::Map)
+                        {
+                            results.push_back(result);
+                        }
+                    }
+                }
+                if (mode == ChunkMode::Reduce)
+                {
+                    results.push_back(accumulator);
+                }
+            });
+        }
+
+        concurrency::WorkerPool::shared().runAll(jobs);
+
+        std::vector<LispHandle> merged;
+        for (size_t chunk = 0; chunk < chunks; chunk++)
+        {
+            Transfer mergeOut(*workers[chunk], vm, false);
+            for (LispHandle result : chunkResults[chunk])
+            {
+                merged.push_back(mergeOut.copy(result));
+            }
+        }
+        return merged;
+    }
+
+    LispHandle vectorToList(VirtualMachine& vm, const std::vector<LispHandle>& items)
+    {
+        LispHandle result = vm.truth(false);
+        for (size_t i = items.size(); i > 0; i--)
+        {
+            result = vm.cons(items[i - 1], result);
+        }
+        return result;
+    }
+
+    LispHandle pmap_NF(VirtualMachine& vm, LispHandle args)
+    {
+        // (pmap f list)
+        LispHandle function = args.car();
+        std::vector<LispHandle> items = listToVector(vm, args.cdr().car());
+        size_t chunks = chunkCount(items.size());
+        if (chunks == 1)
+        {
+            std::vector<LispHandle> results;
+            for (LispHandle item : items)
+            {
+                results.push_back(vm.apply(function, &item, 1));
+            }
+            return vectorToList(vm, results);
+        }
+        return vectorToList(vm, runChunks(vm, function, items, chunks, ChunkMode::Map));
+    }
+
+    LispHandle preduce_NF(VirtualMachine& vm, LispHandle args)
+    {
+        // (preduce f initial list), f must be associative since each chunk
+        // is folded separately before the chunk results are folded in order
+        LispHandle function = args.car();
+        LispHandle accumulator = args.cdr().car();
+        std::vector<LispHandle> items = listToVector(vm, args.cdr().cdr().car());
+        size_t chunks = chunkCount(items.size());
+        if (chunks > 1)
+        {
+            items = runChunks(vm, function, items, chunks, ChunkMode::Reduce);
+        }
+        for (LispHandle item : items)
+        {
+            LispHandle pair[2] = {accumulator, item};
+            accumulator = vm.apply(function, pair, 2);
+        }
+        return accumulator;
+    }
+
+    LispHandle pforEach_NF(VirtualMachine& vm, LispHandle args)
+    {
+        // (pfor-each f list), bindings made by f in a worker are not seen by
+        // the caller, so this is for checks that signal through errors
+        LispHandle function = args.car();
+        std::vector<LispHandle> items = listToVector(vm, args.cdr().car());
+        size_t chunks = chunkCount(items.size());
+        if (chunks == 1)
+        {
+            for (LispHandle item : items)
+            {
+                vm.apply(function, &item, 1);
+            }
+        }
+        else
+        {
+            runChunks(vm, function, items, chunks, ChunkMode::ForEach);
+        }
+        return vm.truth(false);
+    }
+}
@@ -0,0 +1,42 @@
+#ifndef LISP_PARALLEL_H_INCLUDED
+#define LISP_PARALLEL_H_INCLUDED
+
+#include "lisp.h"
+
+#include <unordered_map>
+
+namespace lisp
+{
+    /*
+    Copies Lisp values between VirtualMachines, which share no memory or
+    symbols. Structure sharing (and cycles) in the source is kept.
+
+    When copying into a fresh VM with bindings enabled, each symbol met
+    brings its current value along, so the target ends up with a read-only
+    snapshot of whatever the copied code can reach. pmap and friends give
+    each worker thread such a snapshot, with its own memory and nursery,
+    then copy the results back on the calling thread.
+    */
+    class Transfer
+    {
+        VirtualMachine& source;
+        VirtualMachine& target;
+        bool withBindings;
+        std::unordered_map<const void*, LispHandle> copied;
+
+        LispHandle copyList(ListNode* node);
+        LispHandle copyLambda(Lambda* lambda);
+        LispHandle copyClosure(Closure* closure);
+        LispHandle copyMacro(Macro* macro);
+        void copyLambdaParts(Lambda* lambda, Lambda* result);
+        Symbol* copySymbol(Symbol* sym);
+
+    public:
+        Transfer(VirtualMachine& sourceVM, VirtualMachine& targetVM, bool copyBindings)
+            : source(sourceVM), target(targetVM), withBindings(copyBindings) {}
+
+        LispHandle copy(LispHandle value);
+    };
+}
+
+#endif // LISP_PARALLEL_H_INCLUDED
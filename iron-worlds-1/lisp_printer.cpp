@@ -0,0 +1,183 @@
+#include "lisp.h"
+
+#include <cstdio>
+
+namespace lisp
+{
+    void Printer::findShared(LispHandle expr)
+    {
+        // depth-first over conses, marking any reached twice; a shared
+        // cons is not entered again, which is also what stops cycles
+        labels.clear();
+        pending.clear();
+        if (expr.tag == expr.ListT)
+        {
+            pending.push_back(expr.listNode);
+        }
+        while (!pending.empty())
+        {
+            const ListNode* node = pending.back();
+            pending.pop_back();
+            auto inserted = labels.emplace(node, 0);
+            if (!inserted.second)
+            {
+                inserted.first->second = -1;
+                continue;
+            }
+            if (node->second.tag == LispHandle::ListT)
+            {
+                pending.push_back(node->second.listNode);
+            }
+            if (node->first.tag == LispHandle::ListT)
+            {
+                pending.push_back(node->first.listNode);
+            }
+        }
+    }
+
+    bool Printer::isShared(const ListNode* node)
+    {
+        return labels[node] != 0;
+    }
+
+    void Printer::writeLabel(int label, char suffix)
+    {
+        buffer += '#';
+        buffer += std::to_string(label);
+        buffer += suffix;
+    }
+
+    void Printer::writeAtom(LispHandle expr)
+    {
+        char address[32];
+        switch (expr.tag)
+        {
+        case LispHandle::BasicSymbolT:
+            if (expr.basicSymbol)
+            {
+                buffer += expr.basicSymbol->name;
+            }
+            else
+            {
+                buffer += "<nullptr>";
+            }
+            break;
+
+        case LispHandle::FixnumT:
+            buffer += std::to_string(static_cast<long long>(expr.fixnum));
+            break;
+
+        case LispHandle::NativeFunctionT:
+        case LispHandle::SpecialFormT:
+            std::snprintf(address, sizeof(address), "%p", reinterpret_cast<void*>(expr.nativeFunction));
+            buffer += (expr.tag == expr.NativeFunctionT) ? "#<native " : "#<special-form ";
+            buffer += address;
+            buffer += '>';
+            break;
+
+        case LispHandle::LambdaT:
+        case LispHandle::ClosureT:
+        case LispHandle::MacroT:
+            {
+                Lambda* lambda = expr.lambda;
+                if (expr.tag == expr.LambdaT)
+                {
+                    buffer += "#<lambda (";
+                }
+                else if (expr.tag == expr.ClosureT)
+                {
+                    lambda = expr.closure;
+                    buffer += "#<closure (";
+                }
+                else
+                {
+                    lambda = expr.macro->expander;
+                    buffer += "#<macro (";
+                }
+                for (size_t i = 0; i < lambda->parameters.size(); i++)
+                {
+                    if (i > 0)
+                    {
+                        buffer += ' ';
+                    }
+                    buffer += lambda->parameters[i]->name;
+                }
+                buffer += ")>";
+            }
+            break;
+
+        default:
+            buffer += "#<null>";
+            break;
+        }
+    }
+
+    const std::string& Printer::print(LispHandle expr, Symbol* nil)
+    {
+        buffer.clear();
+        tasks.clear();
+        nextLabel = 0;
+        findShared(expr);
+
+        tasks.push_back({Task::Value, expr});
+        while (!tasks.empty())
+        {
+            Task task = tasks.back();
+            tasks.pop_back();
+            LispHandle handle = task.handle;
+
+            switch (task.kind)
+            {
+            case Task::Value:
+                if (handle.tag != handle.ListT)
+                {
+                    writeAtom(handle);
+                    break;
+                }
+                if (isShared(handle.listNode))
+                {
+                    int& label = labels[handle.listNode];
+                    if (label > 0)
+                    {
+                        writeLabel(label, '#');
+                        break;
+                    }
+                    label = ++nextLabel;
+                    writeLabel(label, '=');
+                }
+                buffer += '(';
+                tasks.push_back({Task::ListRest, handle.listNode->second});
+                tasks.push_back({Task::Value, handle.listNode->first});
+                break;
+
+            case Task::ListRest:
+                if (handle.tag == handle.BasicSymbolT && handle.basicSymbol == nil)
+                {
+                    buffer += ')';
+                }
+                else if (handle.tag == handle.ListT && !isShared(handle.listNode))
+                {
+                    buffer += ' ';
+                    tasks.push_back({Task::ListRest, handle.listNode->second});
+                    tasks.push_back({Task::Value, handle.listNode->first});
+                }
+                else
+                {
+                    // an atom, or a shared tail which needs its own label
+                    buffer += " . ";
+                    tasks.push_back({Task::Close, LispHandle()});
+                    tasks.push_back({Task::Value, handle});
+                }
+                break;
+
+            case Task::Close:
+                buffer += ')';
+                break;
+
+            default:
+                break;
+            }
+        }
+        return buffer;
+    }
+}
@@ -1,6 +1,427 @@
 #include "matrix.h"
+#include "concurrency.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define MATRIX_X86_KERNELS
+#include <immintrin.h>
+#endif
 
 namespace matrix
 {
+    namespace
+    {
+        /*
+        4x4 times 4xcolumns kernels. Every one works a column at a time, as
+        a result column is the left matrix's columns weighted by the right
+        column's entries. The sums are taken in the same order as the
+        generic operator*, without fused multiply-adds, so every kernel
+        gives exactly its result.
+
+        The SSE and AVX kernels are compiled for their instruction sets
+        whatever the build targets, and only called once the CPU is known
+        to have them.
+        */
+        template <typename T>
+        void multiplyPlain(const T* left, const T* right, T* result, size_t columns)
+        {
+            for (size_t j = 0; j < columns; j++)
+            {
+                // the whole column is worked out before any of it is stored,
+                // in case result is right
+                T column[4];
+                for (unsigned int i = 0; i < 4; i++)
+                {
+                    T sum = 0;
+                    for (unsigned int k = 0; k < 4; k++)
+                    {
+                        sum += left[i + 4 * k] * right[k + 4 * j];
+                    }
+                    column[i] = sum;
+                }
+                for (unsigned int i = 0; i < 4; i++)
+                {
+                    result[i + 4 * j] = column[i];
+                }
+            }
+        }
+
+#ifdef MATRIX_X86_KERNELS
+        __attribute__((target("sse")))
+        void multiplySSE(const float* left, const float* right, float* result, size_t columns)
+        {
+            __m128 column0 = _mm_loadu_ps(left);
+            __m128 column1 = _mm_loadu_ps(left + 4);
+            __m128 column2 = _mm_loadu_ps(left + 8);
+            __m128 column3 = _mm_loadu_ps(left + 12);
+            for (size_t j = 0; j < columns; j++)
+            {
+                const float* weights = right + 4 * j;
+                __m128 sum = _mm_mul_ps(column0, _mm_set1_ps(weights[0]));
+                sum = _mm_add_ps(sum, _mm_mul_ps(column1, _mm_set1_ps(weights[1])));
+                sum = _mm_add_ps(sum, _mm_mul_ps(column2, _mm_set1_ps(weights[2])));
+                sum = _mm_add_ps(sum, _mm_mul_ps(column3, _mm_set1_ps(weights[3])));
+                _mm_storeu_ps(result + 4 * j, sum);
+            }
+        }
+
+        __attribute__((target("sse2")))
+        void multiplySSE2(const double* left, const double* right, double* result, size_t columns)
+        {
+            // a column of doubles takes two registers, top and bottom
+            __m128d top[4], bottom[4];
+            for (unsigned int k = 0; k < 4; k++)
+            {
+                top[k] = _mm_loadu_pd(left + 4 * k);
+                bottom[k] = _mm_loadu_pd(left + 4 * k + 2);
+            }
+            for (size_t j = 0; j < columns; j++)
+            {
+                const double* weights = right + 4 * j;
+                __m128d weight = _mm_set1_pd(weights[0]);
+                __m128d topSum = _mm_mul_pd(top[0], weight);
+                __m128d bottomSum = _mm_mul_pd(bottom[0], weight);
+                for (unsigned int k = 1; k < 4; k++)
+                {
+                    weight = _mm_set1_pd(weights[k]);
+                    topSum = _mm_add_pd(topSum, _mm_mul_pd(top[k], weight));
+                    bottomSum = _mm_add_pd(bottomSum, _mm_mul_pd(bottom[k], weight));
+                }
+                _mm_storeu_pd(result + 4 * j, topSum);
+                _mm_storeu_pd(result + 4 * j + 2, bottomSum);
+            }
+        }
+
+        __attribute__((target("avx")))
+        void multiplyAVX(const double* left, const double* right, double* result, size_t columns)
+        {
+            __m256d column0 = _mm256_loadu_pd(left);
+            __m256d column1 = _mm256_loadu_pd(left + 4);
+            __m256d column2 = _mm256_loadu_pd(left + 8);
+            __m256d column3 = _mm256_loadu_pd(left + 12);
+            for (size_t j = 0; j < columns; j++)
+            {
+                const double* weights = right + 4 * j;
+                __m256d sum = _mm256_mul_pd(column0, _mm256_set1_pd(weights[0]));
+                sum = _mm256_add_pd(sum, _mm256_mul_pd(column1, _mm256_set1_pd(weights[1])));
+                sum = _mm256_add_pd(sum, _mm256_mul_pd(column2, _mm256_set1_pd(weights[2])));
+                sum = _mm256_add_pd(sum, _mm256_mul_pd(column3, _mm256_set1_pd(weights[3])));
+                _mm256_storeu_pd(result + 4 * j, sum);
+            }
+        }
+#endif
+
+        /*
+        transforms of points in separate arrays, [begin, end) of them. The
+        vector kernels take several points at once, one per lane, with the
+        matrix's entries each spread across a register, and leave the few
+        points past the last full register to the plain kernel. A point's
+        coordinates are all read before any are written, so the output may
+        be the input.
+        */
+        template <typename T>
+        void transformArraysPlain(const T* mat, const PointArrays<const T>& points, const PointArrays<T>& result, size_t begin, size_t end)
+        {
+            for (size_t p = begin; p < end; p++)
+            {
+                T in[4] = {points.x[p], points.y[p], points.z[p], points.w ? points.w[p] : T(1)};
+                T out[4];
+                for (unsigned int i = 0; i < 4; i++)
+                {
+                    T sum = 0;
+                    for (unsigned int k = 0; k < 4; k++)
+                    {
+                        sum += mat[i + 4 * k] * in[k];
+                    }
+                    out[i] = sum;
+                }
+                result.x[p] = out[0];
+                result.y[p] = out[1];
+                result.z[p] = out[2];
+                if (result.w)
+                {
+                    result.w[p] = out[3];
+                }
+            }
+        }
+
+#ifdef MATRIX_X86_KERNELS
+        __attribute__((target("sse")))
+        void transformArraysSSE(const float* mat, const PointArrays<const float>& points, const PointArrays<float>& result, size_t begin, size_t end)
+        {
+            __m128 entries[16];
+            for (unsigned int k = 0; k < 16; k++)
+            {
+                entries[k] = _mm_set1_ps(mat[k]);
+            }
+            float* outputs[4] = {result.x, result.y, result.z, result.w};
+            unsigned int rows = result.w ? 4 : 3;
+            size_t p = begin;
+            for (; p + 4 <= end; p += 4)
+            {
+                __m128 x = _mm_loadu_ps(points.x + p);
+                __m128 y = _mm_loadu_ps(points.y + p);
+                __m128 z = _mm_loadu_ps(points.z + p);
+                __m128 w = points.w ? _mm_loadu_ps(points.w + p) : _mm_set1_ps(1);
+                __m128 out[4];
+                for (unsigned int i = 0; i < rows; i++)
+                {
+                    __m128 sum = _mm_mul_ps(entries[i], x);
+                    sum = _mm_add_ps(sum, _mm_mul_ps(entries[i + 4], y));
+                    sum = _mm_add_ps(sum, _mm_mul_ps(entries[i + 8], z));
+                    out[i] = _mm_add_ps(sum, _mm_mul_ps(entries[i + 12], w));
+                }
+                for (unsigned int i = 0; i < rows; i++)
+                {
+                    _mm_storeu_ps(outputs[i] + p, out[i]);
+                }
+            }
+            transformArraysPlain(mat, points, result, p, end);
+        }
+
+        __attribute__((target("avx")))
+        void transformArraysAVX(const float* mat, const PointArrays<const float>& points, const PointArrays<float>& result, size_t begin, size_t end)
+        {
+            __m256 entries[16];
+            for (unsigned int k = 0; k < 16; k++)
+            {
+                entries[k] = _mm256_set1_ps(mat[k]);
+            }
+            float* outputs[4] = {result.x, result.y, result.z, result.w};
+            unsigned int rows = result.w ? 4 : 3;
+            size_t p = begin;
+            for (; p + 8 <= end; p += 8)
+            {
+                __m256 x = _mm256_loadu_ps(points.x + p);
+                __m256 y = _mm256_loadu_ps(points.y + p);
+                __m256 z = _mm256_loadu_ps(points.z + p);
+                __m256 w = points.w ? _mm256_loadu_ps(points.w + p) : _mm256_set1_ps(1);
+                __m256 out[4];
+                for (unsigned int i = 0; i < rows; i++)
+                {
+                    __m256 sum = _mm256_mul_ps(entries[i], x);
+                    sum = _mm256_add_ps(sum, _mm256_mul_ps(entries[i + 4], y));
+                    sum = _mm256_add_ps(sum, _mm256_mul_ps(entries[i + 8], z));
+                    out[i] = _mm256_add_ps(sum, _mm256_mul_ps(entries[i + 12], w));
+                }
+                for (unsigned int i = 0; i < rows; i++)
+                {
+                    _mm256_storeu_ps(outputs[i] + p, out[i]);
+                }
+            }
+            // GCC leaves this out before a tail call, and SSE code after it
+            // then runs several times slower
+            _mm256_zeroupper();
+            transformArraysPlain(mat, points, result, p, end);
+        }
+
+        __attribute__((target("sse2")))
+        void transformArraysSSE2(const double* mat, const PointArrays<const double>& points, const PointArrays<double>& result, size_t begin, size_t end)
+        {
+            __m128d entries[16];
+            for (unsigned int k = 0; k < 16; k++)
+            {
+                entries[k] = _mm_set1_pd(mat[k]);
+            }
+            double* outputs[4] = {result.x, result.y, result.z, result.w};
+            unsigned int rows = result.w ? 4 : 3;
+            size_t p = begin;
+            for (; p + 2 <= end; p += 2)
+            {
+                __m128d x = _mm_loadu_pd(points.x + p);
+                __m128d y = _mm_loadu_pd(points.y + p);
+                __m128d z = _mm_loadu_pd(points.z + p);
+                __m128d w = points.w ? _mm_loadu_pd(points.w + p) : _mm_set1_pd(1);
+                __m128d out[4];
+                for (unsigned int i = 0; i < rows; i++)
+                {
+                    __m128d sum = _mm_mul_pd(entries[i], x);
+                    sum = _mm_add_pd(sum, _mm_mul_pd(entries[i + 4], y));
+                    sum = _mm_add_pd(sum, _mm_mul_pd(entries[i + 8], z));
+                    out[i] = _mm_add_pd(sum, _mm_mul_pd(entries[i + 12], w));
+                }
+                for (unsigned int i = 0; i < rows; i++)
+                {
+                    _mm_storeu_pd(outputs[i] + p, out[i]);
+                }
+            }
+            transformArraysPlain(mat, points, result, p, end);
+        }
+
+        __attribute__((target("avx")))
+        void transformArraysAVX(const double* mat, const PointArrays<const double>& points, const PointArrays<double>& result, size_t begin, size_t end)
+        {
+            __m256d entries[16];
+            for (unsigned int k = 0; k < 16; k++)
+            {
+                entries[k] = _mm256_set1_pd(mat[k]);
+            }
+            double* outputs[4] = {result.x, result.y, result.z, result.w};
+            unsigned int rows = result.w ? 4 : 3;
+            size_t p = begin;
+            for (; p + 4 <= end; p += 4)
+            {
+                __m256d x = _mm256_loadu_pd(points.x + p);
+                __m256d y = _mm256_loadu_pd(points.y + p);
+                __m256d z = _mm256_loadu_pd(points.z + p);
+                __m256d w = points.w ? _mm256_loadu_pd(points.w + p) : _mm256_set1_pd(1);
+                __m256d out[4];
+                for (unsigned int i = 0; i < rows; i++)
+                {
+                    __m256d sum = _mm256_mul_pd(entries[i], x);
+                    sum = _mm256_add_pd(sum, _mm256_mul_pd(entries[i + 4], y));
+                    sum = _mm256_add_pd(sum, _mm256_mul_pd(entries[i + 8], z));
+                    out[i] = _mm256_add_pd(sum, _mm256_mul_pd(entries[i + 12], w));
+                }
+                for (unsigned int i = 0; i < rows; i++)
+                {
+                    _mm256_storeu_pd(outputs[i] + p, out[i]);
+                }
+            }
+            // GCC leaves this out before a tail call, and SSE code after it
+            // then runs several times slower
+            _mm256_zeroupper();
+            transformArraysPlain(mat, points, result, p, end);
+        }
+#endif
+
+        typedef void (*FloatKernel)(const float*, const float*, float*, size_t);
+        typedef void (*DoubleKernel)(const double*, const double*, double*, size_t);
+
+        typedef void (*FloatArraysKernel)(const float*, const PointArrays<const float>&, const PointArrays<float>&, size_t, size_t);
+        typedef void (*DoubleArraysKernel)(const double*, const PointArrays<const double>&, const PointArrays<double>&, size_t, size_t);
+
+        FloatKernel chooseFloatKernel()
+        {
+#ifdef MATRIX_X86_KERNELS
+            __builtin_cpu_init();
+            if (__builtin_cpu_supports("sse"))
+            {
+                return multiplySSE;
+            }
+#endif
+            return multiplyPlain<float>;
+        }
+
+        DoubleKernel chooseDoubleKernel()
+        {
+#ifdef MATRIX_X86_KERNELS
+            __builtin_cpu_init();
+            if (__builtin_cpu_supports("avx"))
+            {
+                return multiplyAVX;
+            }
+            if (__builtin_cpu_supports("sse2"))
+            {
+                return multiplySSE2;
+            }
+#endif
+            return multiplyPlain<double>;
+        }
+
+        FloatArraysKernel chooseFloatArraysKernel()
+        {
+#ifdef MATRIX_X86_KERNELS
+            __builtin_cpu_init();
+            if (__builtin_cpu_supports("avx"))
+            {
+                return transformArraysAVX;
+            }
+            if (__builtin_cpu_supports("sse"))
+            {
+                return transformArraysSSE;
+            }
+#endif
+            return transformArraysPlain<float>;
+        }
+
+        DoubleArraysKernel chooseDoubleArraysKernel()
+        {
+#ifdef MATRIX_X86_KERNELS
+            __builtin_cpu_init();
+            if (__builtin_cpu_supports("avx"))
+            {
+                return transformArraysAVX;
+            }
+            if (__builtin_cpu_supports("sse2"))
+            {
+                return transformArraysSSE2;
+            }
+#endif
+            return transformArraysPlain<double>;
+        }
+
+        template <typename Work>
+        void runInChunks(size_t count, Work work)
+        {
+            // work(begin, end) for pieces of [0, count), spread over the
+            // shared pool once there are enough points to be worth it
+            size_t chunks = count / parallelBatchThreshold;
+            size_t concurrency = concurrency::WorkerPool::shared().getConcurrency();
+            if (chunks > concurrency)
+            {
+                chunks = concurrency;
+            }
+            if (chunks <= 1)
+            {
+                work(0, count);
+                return;
+            }
+            std::vector<std::function<void()>> jobs;
+            for (size_t chunk = 0; chunk < chunks; chunk++)
+            {
+                size_t begin = count * chunk / chunks;
+                size_t end = count * (chunk + 1) / chunks;
+                jobs.push_back([&work, begin, end] {work(begin, end);});
+            }
+            concurrency::WorkerPool::shared().runAll(jobs);
+        }
+    }
+
+    void multiply4(const float* left, const float* right, float* result, size_t columns)
+    {
+        // chosen on first use, which may be before main
+        static const FloatKernel kernel = chooseFloatKernel();
+        kernel(left, right, result, columns);
+    }
+
+    void multiply4(const double* left, const double* right, double* result, size_t columns)
+    {
+        static const DoubleKernel kernel = chooseDoubleKernel();
+        kernel(left, right, result, columns);
+    }
+
+    void transformBatch(const Matrix<float, 4>& mat, const float* points, float* result, size_t count)
+    {
+        // interleaved points are a 4xcount matrix, column-major
+        runInChunks(count, [&mat, points, result] (size_t begin, size_t end)
+        {
+            multiply4(mat.data, points + 4 * begin, result + 4 * begin, end - begin);
+        });
+    }
+
+    void transformBatch(const Matrix<double, 4>& mat, const double* points, double* result, size_t count)
+    {
+        runInChunks(count, [&mat, points, result] (size_t begin, size_t end)
+        {
+            multiply4(mat.data, points + 4 * begin, result + 4 * begin, end - begin);
+        });
+    }
+
+    void transformBatch(const Matrix<float, 4>& mat, const PointArrays<const float>& points, const PointArrays<float>& result, size_t count)
+    {
+        static const FloatArraysKernel kernel = chooseFloatArraysKernel();
+        runInChunks(count, [&mat, &points, &result] (size_t begin, size_t end)
+        {
+            kernel(mat.data, points, result, begin, end);
+        });
+    }
 
+    void transformBatch(const Matrix<double, 4>& mat, const PointArrays<const double>& points, const PointArrays<double>& result, size_t count)
+    {
+        static const DoubleArraysKernel kernel = chooseDoubleArraysKernel();
+        runInChunks(count, [&mat, &points, &result] (size_t begin, size_t end)
+        {
+            kernel(mat.data, points, result, begin, end);
+        });
+    }
 }
@@ -2,6 +2,7 @@
 #define MATRIX_H_INCLUDED
 
 #include <cmath>
+#include <cstddef>
 #include <iostream>
 
 namespace matrix
@@ -20,12 +21,19 @@ namespace matrix
     X35
 
     */
+
+    // passed to a constructor to leave the cells unset, for results that
+    // are about to be overwritten anyway
+    enum Uninitialised {uninitialised};
+
     template <typename ELEMENTTYPE, unsigned int M, unsigned int N = M>
     class Matrix
     {
     public:
         ELEMENTTYPE data[M * N];
 
+        explicit Matrix(Uninitialised) {}
+
         Matrix()
         {
             // initialise as a null matrix
@@ -120,6 +128,47 @@ namespace matrix
         return result;
     }
 
+    /*
+    an affine transform that scales along the axes and then translates:
+    sx 0  0  tx
+    0  sy 0  ty
+    0  0  sz tz
+    0  0  0  1
+    kept as its six numbers. A product of these stays one, and multiplying
+    a matrix by one updates its rows or columns in a single pass instead of
+    making the full matrix and a full product
+    */
+    template <typename T>
+    class Affine
+    {
+    public:
+        T scaling[3];
+        T offset[3];
+
+        operator Matrix<T, 4>() const
+        {
+            Matrix<T, 4> result;
+            for (unsigned int i = 0; i < 3; i++)
+            {
+                result.data[5 * i] = scaling[i];
+                result.data[12 + i] = offset[i];
+            }
+            return result;
+        }
+    };
+
+    template <typename T>
+    Affine<T> translate(T x, T y, T z)
+    {
+        return {{1, 1, 1}, {x, y, z}};
+    }
+
+    template <typename T>
+    Affine<T> scale(T x, T y, T z)
+    {
+        return {{x, y, z}, {0, 0, 0}};
+    }
+
     template <typename T, unsigned int M>
     T vectorAbsolute(Matrix<T, M, 1> vec)
     {
@@ -132,39 +181,259 @@ namespace matrix
     }
 
     template <typename T, unsigned int M>
-    Matrix<T, M> minor(Matrix<T, M+1> oldMat, unsigned int i, unsigned int j)
+    Matrix<T, M> minor(const Matrix<T, M+1>& oldMat, unsigned int i, unsigned int j)
     {
-        Matrix<T, M> result;
-        unsigned int newI = 0;
-        for (unsigned int oldI = 0; oldI <= M; oldI++)
+        // oldMat without row i and column j. M cannot be deduced, so call
+        // as minor<T, M>
+        Matrix<T, M> result(uninitialised);
+        unsigned int newJ = 0;
+        for (unsigned int oldJ = 0; oldJ <= M; oldJ++)
         {
-            if (oldI != i)
+            if (oldJ != j)
             {
-                unsigned int newJ = 0;
-                for (unsigned int oldJ = 0; oldJ <= M; oldJ++)
+                unsigned int newI = 0;
+                for (unsigned int oldI = 0; oldI <= M; oldI++)
                 {
-                    if (oldJ != j)
+                    if (oldI != i)
                     {
-                        &result.getPtrAt(newI, newJ) = oldMat.getAt(oldI, oldJ);
+                        result.getRefAt(newI, newJ) = oldMat.getAtConst(oldI, oldJ);
+                        newI++;
                     }
-                    newJ++;
                 }
-                newI++;
+                newJ++;
             }
         }
         return result;
     }
 
+    /*
+    determinants and inverses, by size so that the sizes in use get a
+    closed form. Any other size expands along its first column or takes
+    the adjugate, through minors of the next size down. The inverse of a
+    singular matrix has infinite or NaN cells
+    */
+    template <typename T, unsigned int M>
+    struct Determinant
+    {
+        static T of(const Matrix<T, M>& mat)
+        {
+            T sum = 0;
+            for (unsigned int i = 0; i < M; i++)
+            {
+                T term = mat.getAtConst(i, 0) * Determinant<T, M - 1>::of(minor<T, M - 1>(mat, i, 0));
+                sum += i % 2 ? -term : term;
+            }
+            return sum;
+        }
+    };
+
+    template <typename T>
+    struct Determinant<T, 1>
+    {
+        static T of(const Matrix<T, 1>& mat) {return mat.data[0];}
+    };
+
+    template <typename T>
+    struct Determinant<T, 2>
+    {
+        static T of(const Matrix<T, 2>& mat) {return mat.data[0] * mat.data[3] - mat.data[2] * mat.data[1];}
+    };
+
+    template <typename T>
+    struct Determinant<T, 3>
+    {
+        static T of(const Matrix<T, 3>& mat)
+        {
+            const T* a = mat.data;
+            return a[0] * (a[4] * a[8] - a[7] * a[5])
+                - a[3] * (a[1] * a[8] - a[7] * a[2])
+                + a[6] * (a[1] * a[5] - a[4] * a[2]);
+        }
+    };
+
+    template <typename T>
+    struct SubDeterminants4
+    {
+        // the 2x2 determinants of the top two rows (s) and the bottom two
+        // rows (c), from which a 4x4 determinant and inverse are made
+        T s[6], c[6];
+
+        explicit SubDeterminants4(const Matrix<T, 4>& mat)
+        {
+            const T* a = mat.data;
+            s[0] = a[0] * a[5] - a[1] * a[4];
+            s[1] = a[0] * a[9] - a[1] * a[8];
+            s[2] = a[0] * a[13] - a[1] * a[12];
+            s[3] = a[4] * a[9] - a[5] * a[8];
+            s[4] = a[4] * a[13] - a[5] * a[12];
+            s[5] = a[8] * a[13] - a[9] * a[12];
+            c[0] = a[2] * a[7] - a[3] * a[6];
+            c[1] = a[2] * a[11] - a[3] * a[10];
+            c[2] = a[2] * a[15] - a[3] * a[14];
+            c[3] = a[6] * a[11] - a[7] * a[10];
+            c[4] = a[6] * a[15] - a[7] * a[14];
+            c[5] = a[10] * a[15] - a[11] * a[14];
+        }
+
+        T determinant() const
+        {
+            return s[0] * c[5] - s[1] * c[4] + s[2] * c[3] + s[3] * c[2] - s[4] * c[1] + s[5] * c[0];
+        }
+    };
+
+    template <typename T>
+    struct Determinant<T, 4>
+    {
+        static T of(const Matrix<T, 4>& mat) {return SubDeterminants4<T>(mat).determinant();}
+    };
+
+    template <typename T, unsigned int M>
+    T determinant(const Matrix<T, M>& mat)
+    {
+        return Determinant<T, M>::of(mat);
+    }
+
     template <typename T, unsigned int M>
-    T determinant(Matrix<T, M> oldMat)
+    struct Inverse
     {
+        static Matrix<T, M> of(const Matrix<T, M>& mat)
+        {
+            Matrix<T, M> result(uninitialised);
+            T inverseDeterminant = 1 / determinant(mat);
+            for (unsigned int i = 0; i < M; i++)
+            {
+                for (unsigned int j = 0; j < M; j++)
+                {
+                    T cofactor = Determinant<T, M - 1>::of(minor<T, M - 1>(mat, j, i));
+                    result.getRefAt(i, j) = ((i + j) % 2 ? -cofactor : cofactor) * inverseDeterminant;
+                }
+            }
+            return result;
+        }
+    };
 
+    template <typename T>
+    struct Inverse<T, 1>
+    {
+        static Matrix<T, 1> of(const Matrix<T, 1>& mat)
+        {
+            Matrix<T, 1> result(uninitialised);
+            result.data[0] = 1 / mat.data[0];
+            return result;
+        }
+    };
+
+    template <typename T>
+    struct Inverse<T, 4>
+    {
+        static Matrix<T, 4> of(const Matrix<T, 4>& mat)
+        {
+            SubDeterminants4<T> sub(mat);
+            const T* s = sub.s;
+            const T* c = sub.c;
+            const T* a = mat.data;
+            T k = 1 / sub.determinant();
+            Matrix<T, 4> result(uninitialised);
+            T* b = result.data;
+            b[0] = (a[5] * c[5] - a[9] * c[4] + a[13] * c[3]) * k;
+            b[1] = (-a[1] * c[5] + a[9] * c[2] - a[13] * c[1]) * k;
+            b[2] = (a[1] * c[4] - a[5] * c[2] + a[13] * c[0]) * k;
+            b[3] = (-a[1] * c[3] + a[5] * c[1] - a[9] * c[0]) * k;
+            b[4] = (-a[4] * c[5] + a[8] * c[4] - a[12] * c[3]) * k;
+            b[5] = (a[0] * c[5] - a[8] * c[2] + a[12] * c[1]) * k;
+            b[6] = (-a[0] * c[4] + a[4] * c[2] - a[12] * c[0]) * k;
+            b[7] = (a[0] * c[3] - a[4] * c[1] + a[8] * c[0]) * k;
+            b[8] = (a[7] * s[5] - a[11] * s[4] + a[15] * s[3]) * k;
+            b[9] = (-a[3] * s[5] + a[11] * s[2] - a[15] * s[1]) * k;
+            b[10] = (a[3] * s[4] - a[7] * s[2] + a[15] * s[0]) * k;
+            b[11] = (-a[3] * s[3] + a[7] * s[1] - a[11] * s[0]) * k;
+            b[12] = (-a[6] * s[5] + a[10] * s[4] - a[14] * s[3]) * k;
+            b[13] = (a[2] * s[5] - a[10] * s[2] + a[14] * s[1]) * k;
+            b[14] = (-a[2] * s[4] + a[6] * s[2] - a[14] * s[0]) * k;
+            b[15] = (a[2] * s[3] - a[6] * s[1] + a[10] * s[0]) * k;
+            return result;
+        }
+    };
+
+    template <typename T, unsigned int M>
+    Matrix<T, M> inverse(const Matrix<T, M>& mat)
+    {
+        return Inverse<T, M>::of(mat);
+    }
+
+    template <typename T>
+    Matrix<T, 4> affineInverse(const Matrix<T, 4>& mat)
+    {
+        // for a matrix whose bottom row is 0 0 0 1, such as a basis or view
+        // matrix: the inverse is the inverse of the top left 3x3, A, with
+        // -A^-1 times the last column beside it
+        const T* a = mat.data;
+        T cofactors[9] =
+        {
+            a[5] * a[10] - a[6] * a[9], a[2] * a[9] - a[1] * a[10], a[1] * a[6] - a[2] * a[5],
+            a[6] * a[8] - a[4] * a[10], a[0] * a[10] - a[2] * a[8], a[2] * a[4] - a[0] * a[6],
+            a[4] * a[9] - a[5] * a[8], a[1] * a[8] - a[0] * a[9], a[0] * a[5] - a[1] * a[4]
+        };
+        T k = 1 / (a[0] * cofactors[0] + a[4] * cofactors[1] + a[8] * cofactors[2]);
+        Matrix<T, 4> result(uninitialised);
+        T* b = result.data;
+        for (unsigned int j = 0; j < 3; j++)
+        {
+            for (unsigned int i = 0; i < 3; i++)
+            {
+                b[i + 4 * j] = cofactors[i + 3 * j] * k;
+            }
+            b[3 + 4 * j] = 0;
+        }
+        for (unsigned int i = 0; i < 3; i++)
+        {
+            b[12 + i] = -(b[i] * a[12] + b[4 + i] * a[13] + b[8 + i] * a[14]);
+        }
+        b[15] = 1;
+        return result;
+    }
+
+    template <typename T>
+    Matrix<T, 4> rigidInverse(const Matrix<T, 4>& mat)
+    {
+        // for a rotation followed by a translation, whose 3x3 is orthonormal
+        // and so inverted by transposing it. Only as exact as that 3x3 is
+        // orthonormal, see affineInverse otherwise
+        const T* a = mat.data;
+        Matrix<T, 4> result(uninitialised);
+        T* b = result.data;
+        for (unsigned int j = 0; j < 3; j++)
+        {
+            for (unsigned int i = 0; i < 3; i++)
+            {
+                b[i + 4 * j] = a[j + 4 * i];
+            }
+            b[3 + 4 * j] = 0;
+        }
+        for (unsigned int i = 0; i < 3; i++)
+        {
+            b[12 + i] = -(b[i] * a[12] + b[4 + i] * a[13] + b[8 + i] * a[14]);
+        }
+        b[15] = 1;
+        return result;
+    }
+
+    template <typename T>
+    Affine<T> inverse(const Affine<T>& affine)
+    {
+        Affine<T> result;
+        for (unsigned int i = 0; i < 3; i++)
+        {
+            result.scaling[i] = 1 / affine.scaling[i];
+            result.offset[i] = -affine.offset[i] * result.scaling[i];
+        }
+        return result;
     }
 
     template <typename T, unsigned int MLEFT, unsigned int MNCOMMON, unsigned int NRIGHT>
     Matrix<T, MLEFT, NRIGHT> operator*(const Matrix<T, MLEFT, MNCOMMON>& leftMatrix, const Matrix<T, MNCOMMON, NRIGHT>& rightMatrix)
     {
-        Matrix<T, MLEFT, NRIGHT> result;
+        Matrix<T, MLEFT, NRIGHT> result(uninitialised);
         for (unsigned int i = 0; i < MLEFT; i++)
         {
             for (unsigned int j = 0; j < NRIGHT; j++)
@@ -180,10 +449,132 @@ namespace matrix
         return result;
     }
 
+    // a 4x4 matrix times a 4xcolumns one, all column-major. Uses SSE or AVX
+    // when the CPU has them, see matrix.cpp. A result column may be the
+    // same memory as its right column
+    void multiply4(const float* left, const float* right, float* result, size_t columns);
+    void multiply4(const double* left, const double* right, double* result, size_t columns);
+
+    // points in separate coordinate arrays. A null w is taken as all 1 when
+    // read and skipped when written
+    template <typename T>
+    struct PointArrays
+    {
+        T* x;
+        T* y;
+        T* z;
+        T* w;
+    };
+
+    // batches of at least this many points are split between the shared
+    // worker pool's threads
+    const size_t parallelBatchThreshold = 1 << 16;
+
+    // applies mat to count points, as mat * point for each. Interleaved
+    // points are x, y, z, w after each other. The output may be the input
+    void transformBatch(const Matrix<float, 4>& mat, const float* points, float* result, size_t count);
+    void transformBatch(const Matrix<double, 4>& mat, const double* points, double* result, size_t count);
+    void transformBatch(const Matrix<float, 4>& mat, const PointArrays<const float>& points, const PointArrays<float>& result, size_t count);
+    void transformBatch(const Matrix<double, 4>& mat, const PointArrays<const double>& points, const PointArrays<double>& result, size_t count);
+
+    // the products that transforms are made of take the kernels above
+    template <>
+    inline Matrix<float, 4, 4> operator*(const Matrix<float, 4, 4>& leftMatrix, const Matrix<float, 4, 4>& rightMatrix)
+    {
+        Matrix<float, 4, 4> result(uninitialised);
+        multiply4(leftMatrix.data, rightMatrix.data, result.data, 4);
+        return result;
+    }
+
+    template <>
+    inline Matrix<float, 4, 1> operator*(const Matrix<float, 4, 4>& leftMatrix, const Matrix<float, 4, 1>& rightMatrix)
+    {
+        Matrix<float, 4, 1> result(uninitialised);
+        multiply4(leftMatrix.data, rightMatrix.data, result.data, 1);
+        return result;
+    }
+
+    template <>
+    inline Matrix<double, 4, 4> operator*(const Matrix<double, 4, 4>& leftMatrix, const Matrix<double, 4, 4>& rightMatrix)
+    {
+        Matrix<double, 4, 4> result(uninitialised);
+        multiply4(leftMatrix.data, rightMatrix.data, result.data, 4);
+        return result;
+    }
+
+    template <>
+    inline Matrix<double, 4, 1> operator*(const Matrix<double, 4, 4>& leftMatrix, const Matrix<double, 4, 1>& rightMatrix)
+    {
+        Matrix<double, 4, 1> result(uninitialised);
+        multiply4(leftMatrix.data, rightMatrix.data, result.data, 1);
+        return result;
+    }
+
+    template <typename T>
+    Affine<T> operator*(const Affine<T>& leftAffine, const Affine<T>& rightAffine)
+    {
+        Affine<T> result;
+        for (unsigned int i = 0; i < 3; i++)
+        {
+            result.scaling[i] = leftAffine.scaling[i] * rightAffine.scaling[i];
+            result.offset[i] = leftAffine.scaling[i] * rightAffine.offset[i] + leftAffine.offset[i];
+        }
+        return result;
+    }
+
+    template <typename T, unsigned int N>
+    Matrix<T, 4, N> operator*(const Affine<T>& leftAffine, const Matrix<T, 4, N>& rightMatrix)
+    {
+        // scales the top three rows and adds the bottom row's share of the
+        // offset to them
+        Matrix<T, 4, N> result(uninitialised);
+        for (unsigned int j = 0; j < N; j++)
+        {
+            const T* column = rightMatrix.data + 4 * j;
+            T* resultColumn = result.data + 4 * j;
+            for (unsigned int i = 0; i < 3; i++)
+            {
+                resultColumn[i] = leftAffine.scaling[i] * column[i] + leftAffine.offset[i] * column[3];
+            }
+            resultColumn[3] = column[3];
+        }
+        return result;
+    }
+
+    template <typename T, unsigned int M>
+    void operator*=(Matrix<T, M, 4>& mat, const Affine<T>& rightAffine)
+    {
+        // the last column gains the offset's mix of the others, then those
+        // are scaled
+        for (unsigned int i = 0; i < M; i++)
+        {
+            T sum = 0;
+            for (unsigned int k = 0; k < 3; k++)
+            {
+                sum += mat.data[i + M * k] * rightAffine.offset[k];
+            }
+            mat.data[i + M * 3] += sum;
+        }
+        for (unsigned int k = 0; k < 3; k++)
+        {
+            for (unsigned int i = 0; i < M; i++)
+            {
+                mat.data[i + M * k] *= rightAffine.scaling[k];
+            }
+        }
+    }
+
+    template <typename T, unsigned int M>
+    Matrix<T, M, 4> operator*(Matrix<T, M, 4> leftMatrix, const Affine<T>& rightAffine)
+    {
+        leftMatrix *= rightAffine;
+        return leftMatrix;
+    }
+
     template <typename T, unsigned int M, unsigned int N>
     Matrix<T, M, N> operator*(const Matrix<T, M, N>& mat, const T scalar)
     {
-        Matrix<T, M, N> result;
+        Matrix<T, M, N> result(uninitialised);
         for (unsigned int i = 0; i < M * N; i++)
         {
             *(result.getRaw() + i) = mat.data[i] * scalar;
@@ -212,7 +603,7 @@ namespace matrix
     template <typename T, unsigned int M, unsigned int N>
     Matrix<T, M, N> operator+(const Matrix<T, M, N>& leftMatrix, const Matrix<T, M, N>& rightMatrix)
     {
-        Matrix<T, M, N> result;
+        Matrix<T, M, N> result(uninitialised);
         for (unsigned int i = 0; i < M * N; i++)
         {
             *(result.getRaw() + i) = leftMatrix.data[i] + rightMatrix.data[i];
@@ -237,7 +628,7 @@ namespace matrix
         {
             for (unsigned int j = 0; j < N; j++)
             {
-                outStream << mat.getAt(i, j) << ", ";
+                outStream << mat.getAtConst(i, j) << ", ";
             }
             outStream << "\n    ";
         }
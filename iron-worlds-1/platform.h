@@ -43,7 +43,10 @@
 #include <assert.h>
 #include <fstream>
 #include <iostream>
+#include <memory>
+#include <string>
 #include <unordered_map>
+#include <vector>
 
 
 
@@ -73,6 +76,44 @@ namespace platform
     extern std::unordered_map<unsigned int, InputCode> inputCodeMap;
 
     void sleepForMilliseconds(int time);
+
+    class FileChangeMonitor
+    {
+        // reports modification of a set of files, implemented per platform
+    public:
+        virtual ~FileChangeMonitor() {}
+
+        virtual bool watch(const std::string& path) = 0;
+        // blocks for up to timeoutMilliseconds, appending the paths of any
+        // watched files that were modified
+        virtual void waitForChanges(int timeoutMilliseconds, std::vector<std::string>& changedPaths) = 0;
+    };
+
+    std::unique_ptr<FileChangeMonitor> makeFileChangeMonitor();
+
+    class LocalServer
+    {
+        // a stream server on a local socket, serving any number of clients,
+        // each identified by a number that is never reused
+    public:
+        virtual ~LocalServer() {}
+
+        // blocks for up to timeoutMilliseconds or until woken, accepting
+        // new clients and appending whatever text arrived from each one.
+        // Clients gone since the last call are appended to closed first
+        virtual void waitForInput(int timeoutMilliseconds, std::vector<std::pair<int, std::string>>& received,
+                                  std::vector<int>& closed) = 0;
+        // never blocks: what the client does not take yet is buffered for
+        // later. Ignored if the client has gone away
+        virtual void send(int client, const std::string& text) = 0;
+        // closes the client's connection, dropping any unsent output
+        virtual void disconnect(int client) = 0;
+        // makes a waitForInput in progress return early, from any thread
+        virtual void wake() = 0;
+    };
+
+    // nullptr if the server cannot be set up
+    std::unique_ptr<LocalServer> makeLocalServer(const std::string& address);
 }
 
 #endif // BOTTOM_PORTABILITY_BOOKEND_H_INCLUDED
@@ -0,0 +1,194 @@
+#include "repl.h"
+
+#include <iostream>
+#include <sstream>
+
+namespace repl
+{
+    size_t completeFormLength(const std::string& text, bool& malformed)
+    {
+        int depth = 0;
+        bool inAtom = false;
+        malformed = false;
+        for (size_t i = 0; i < text.size(); i++)
+        {
+            char c = text[i];
+            if (c == ';')
+            {
+                size_t lineEnd = text.find('\n', i);
+                if (lineEnd == std::string::npos)
+                {
+                    return 0;
+                }
+                i = lineEnd;
+                c = '\n';
+            }
+
+            if (c == ' ' || c == '\t' || c == '\n' || c == '\r')
+            {
+                if (inAtom && depth == 0)
+                {
+                    return i;
+                }
+                inAtom = false;
+            }
+            else if (c == '(' || c == ')')
+            {
+                if (inAtom && depth == 0)
+                {
+                    // a bracket ends an atom at the top, and starts the next form
+                    return i;
+                }
+                inAtom = false;
+                if (c == '(')
+                {
+                    depth++;
+                }
+                else if (depth == 0)
+                {
+                    malformed = true;
+                    return i + 1;
+                }
+                else if (--depth == 0)
+                {
+                    return i + 1;
+                }
+            }
+            else if (c != '\'')
+            {
+                // the reader makes every '.' a token of its own, and has no
+                // dotted pairs to read it into
+                malformed = malformed || c == '.';
+                inAtom = true;
+            }
+        }
+        return 0;
+    }
+
+    ReplServer::ReplServer(const std::string& address)
+        : server(platform::makeLocalServer(address)), stopping(false)
+    {
+        if (server)
+        {
+            serverThread = std::thread(&ReplServer::serverLoop, this);
+        }
+        else
+        {
+            // not only in debug builds, as the REPL is simply absent otherwise
+            std::cerr << "REPL unavailable: cannot listen on " << address << "\n";
+        }
+    }
+
+    ReplServer::~ReplServer()
+    {
+        if (server)
+        {
+            stopping = true;
+            server->wake();
+            serverThread.join();
+        }
+    }
+
+    void ReplServer::serverLoop()
+    {
+        std::vector<std::pair<int, std::string>> received;
+        std::vector<int> closed;
+        Message response;
+        while (!stopping)
+        {
+            received.clear();
+            closed.clear();
+            server->waitForInput(50, received, closed);
+            for (int client : closed)
+            {
+                partialInput.erase(client);
+            }
+            for (std::pair<int, std::string>& chunk : received)
+            {
+                std::string& text = partialInput[chunk.first];
+                text += chunk.second;
+                bool malformed;
+                if (text.size() > maxPartialInput && completeFormLength(text, malformed) == 0)
+                {
+                    // a form this long is not coming from someone typing
+                    server->send(chunk.first, "Form too long, disconnecting\n");
+                    server->disconnect(chunk.first);
+                    partialInput.erase(chunk.first);
+                }
+            }
+
+            // pass on complete forms a client at a time, so that one sending
+            // a lot cannot fill the queue ahead of the rest. Anything that
+            // does not fit stays in partialInput until the next round
+            bool queueFull = false;
+            bool passedAny = true;
+            while (passedAny && !queueFull)
+            {
+                passedAny = false;
+                for (auto& input : partialInput)
+                {
+                    bool malformed;
+                    size_t length = completeFormLength(input.second, malformed);
+                    if (length == 0)
+                    {
+                        continue;
+                    }
+                    if (malformed)
+                    {
+                        // answered here, so the VM never reads it
+                        size_t start = input.second.find_first_not_of(" \t\r\n");
+                        server->send(input.first, "Malformed form: " + input.second.substr(start, length - start) + "\n");
+                    }
+                    else if (!commands.push({input.first, input.second.substr(0, length)}))
+                    {
+                        queueFull = true;
+                        break;
+                    }
+                    input.second.erase(0, length);
+                    passedAny = true;
+                }
+            }
+
+            while (responses.pop(response))
+            {
+                server->send(response.client, response.text);
+            }
+        }
+    }
+
+    unsigned int ReplServer::serviceCommands(lisp::VirtualMachine& vm, unsigned int maxCommands)
+    {
+        if (!server)
+        {
+            return 0;
+        }
+        unsigned int serviced = 0;
+        Message command;
+        while (serviced < maxCommands && commands.pop(command))
+        {
+            std::ostringstream output;
+            try
+            {
+                std::istringstream input(command.text);
+                lisp::LispHandle result = vm.evaluate(vm.read(input));
+                output << "--> ";
+                vm.printLn(result, output);
+            }
+            catch (std::exception const &exc)
+            {
+                output << "Exception caught: " << exc.what() << "\n";
+            }
+
+            if (!responses.push({command.client, output.str()}))
+            {
+                ELOG("REPL response queue full, dropping a response");
+            }
+            serviced++;
+        }
+        if (serviced > 0)
+        {
+            server->wake();
+        }
+        return serviced;
+    }
+}
@@ -0,0 +1,70 @@
+#ifndef REPL_H_INCLUDED
+#define REPL_H_INCLUDED
+
+#include "concurrency.h"
+#include "lisp.h"
+#include "platform.h"
+
+#include <atomic>
+#include <string>
+#include <thread>
+#include <unordered_map>
+
+namespace repl
+{
+    // the length of the first complete form in text, including any leading
+    // whitespace and comments, or 0 if no form is complete yet. A form the
+    // reader would reject, a stray ')' or one with a dotted pair, is
+    // measured all the same and has malformed set, so it can be dropped
+    size_t completeFormLength(const std::string& text, bool& malformed);
+
+    class ReplServer
+    {
+        /*
+        Serves a read-eval-print loop over a local socket. A background
+        thread accepts clients and splits what they send into complete
+        forms, which are passed through a lock-free queue to the thread that
+        owns the VirtualMachine. That thread evaluates them in
+        serviceCommands, at a point of its choosing, and the printed results
+        go back through a second queue to be sent.
+
+        Neither thread ever waits for the other, so slow or idle clients
+        cannot stall the frame loop.
+        */
+        struct Message
+        {
+            int client;
+            std::string text;
+        };
+
+        static const size_t queueCapacity = 64;
+
+        std::unique_ptr<platform::LocalServer> server;
+        concurrency::SpscQueue<Message, queueCapacity> commands;
+        concurrency::SpscQueue<Message, queueCapacity> responses;
+        // text received that does not make a complete form yet, per client.
+        // A client whose unfinished form grows past maxPartialInput is dropped
+        static const size_t maxPartialInput = 1 << 20;
+        std::unordered_map<int, std::string> partialInput;
+
+        std::atomic<bool> stopping;
+        std::thread serverThread;
+
+        void serverLoop();
+
+    public:
+        explicit ReplServer(const std::string& address);
+        ~ReplServer();
+
+        ReplServer(const ReplServer&) = delete;
+        ReplServer& operator=(const ReplServer&) = delete;
+
+        bool isListening() const {return server != nullptr;}
+
+        // evaluates up to maxCommands queued forms on the calling thread,
+        // returns how many were evaluated
+        unsigned int serviceCommands(lisp::VirtualMachine& vm, unsigned int maxCommands = 16);
+    };
+}
+
+#endif // REPL_H_INCLUDED
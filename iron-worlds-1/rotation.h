@@ -48,7 +48,7 @@ namespace rotation
         matrix::Matrix<T, 4> getMatrix()
         {
             normalise();
-            matrix::Matrix<T, 4> result;
+            matrix::Matrix<T, 4> result(matrix::uninitialised);
             result.data[0] = 1 - 2 * this->data[1] * this->data[1] - 2 * this->data[2] * this->data[2];
             result.data[1] = 2 * (this->data[0] * this->data[1] + this->data[3] * this->data[2]);
             result.data[2] = 2 * (this->data[0] * this->data[2] - this->data[3] * this->data[1]);
@@ -2,15 +2,25 @@
 
 namespace scene
 {
-    matrix::Matrix<double, 4> Perspective::getPerspectiveMatrix()
+    matrix::Matrix<double, 4> Perspective::getViewMatrix()
     {
-        matrix::Matrix<double, 4> result;
+        matrix::Matrix<double, 4> result = worldAngularDisplacementQuaternion.getMatrix();
 
-        result = worldAngularDisplacementQuaternion.getMatrix();
+        result *= matrix::translate(worldDisplacement.data[0], worldDisplacement.data[1], worldDisplacement.data[2]);
 
-        result *= matrix::makeTranslate(worldDisplacement.data[0], worldDisplacement.data[1], worldDisplacement.data[2]);
+        return result;
+    }
 
-        return matrix::makeFrustum<double>() * result;
+    matrix::Matrix<double, 4> Perspective::getInverseViewMatrix()
+    {
+        // the quaternion is only renormalised once it drifts, so its rotation
+        // is not quite orthonormal and the transpose would not be exact
+        return matrix::affineInverse(getViewMatrix());
+    }
+
+    matrix::Matrix<double, 4> Perspective::getPerspectiveMatrix()
+    {
+        return matrix::makeFrustum<double>() * getViewMatrix();
     }
 
 
@@ -14,6 +14,9 @@ namespace scene
         matrix::Matrix<double, 3, 1> worldDisplacement;
         rotation::Quaternion<double> worldAngularDisplacementQuaternion;
 
+        // world to camera space, and back
+        matrix::Matrix<double, 4> getViewMatrix();
+        matrix::Matrix<double, 4> getInverseViewMatrix();
         matrix::Matrix<double, 4> getPerspectiveMatrix();
     };
 
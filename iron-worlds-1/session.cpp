@@ -1,10 +1,13 @@
 #include "session.h"
+#include "trace.h"
 
+#include <cctype>
 #include <functional>
+#include <stdexcept>
 
 namespace session
 {
-    Session::Session(): symbolTable{},
+    Session::Session(): symbolTable{}, symbolIndex{},
         trueAtomPtr(makeAtom("t")),
         errorAtomPtr(makeAtom("error")),
         labelAtomPtr(makeAtom("label")),
@@ -13,8 +16,8 @@ namespace session
         condAtomPtr(makeAtom("cond")),
         defineAtomPtr(makeAtom("define"))
     {
-        nilAtomPtr = std::make_shared<structure::Nil>("nil");
-        symbolTable.push_back(nilAtomPtr);
+        nilAtomPtr = structure::make<structure::Nil>("nil");
+        addSymbol(nilAtomPtr);
 
         struct FunPair
         {
@@ -33,246 +36,210 @@ namespace session
         };
         for (auto item : functions)
         {
-            structure::PrimaryFunctionPtr atom = std::make_shared<structure::PrimaryFunction>(item.name);
+            structure::PrimaryFunctionPtr atom = structure::make<structure::PrimaryFunction>(item.name);
             atom->functionPtr = item.functionPtr;
             item.symbolPtrReference = atom;
-            symbolTable.push_back(atom);
+            addSymbol(atom);
         }
 
-        globalEnvironmentPtr = std::make_shared<structure::SPair>(nilAtomPtr, nilAtomPtr);
+        globalEnvironment = {nullptr, 0, 0};
     }
 
     void Session::printS(structure::SExpressionPtr sexp, std::ostream& out)
     {
-        // prints an S-expression in the usual format
-        // an atom prints as itself
-        if (sexp->isAtom())
-        {
-            out << sexp;
-            return;
-        }
-        else
-        {
-            // to print a list, first open a bracket
-            out << "(";
-            // then print the first item
-            printS(car0(sexp), out);
-            // then check the next item
-            auto i = cdr0(sexp);
-            // the linked list will continue until we reach an atom
-            while (!i->isAtom())
+        // prints an S-expression in the usual format. The tails of the lists
+        // it is inside wait on printTails, so nesting does not recurse
+        const size_t base = printTails.size();
+        while (true)
+        {
+            // a list opens a bracket and prints its first item, going down
+            // until that item is an atom, which prints as itself
+            while (!sexp->isAtom())
             {
-                // print each item in the list with a space
-                out << " ";
-                printS(car0(i), out);
-                i = cdr0(i);
+                out << "(";
+                printTails.push_back(cdr0(sexp));
+                sexp = car0(sexp);
             }
-            // a list might not end in nil, especially if it has been consed
-            if (i != nilAtomPtr || false)
-            {
-                out << " . " << i;
-            }
-            out << ")";
-        }
-    }
-
-    std::string Session::preTokenise(std::string inString)
-    {
-        // inserts appropriate whitespace near brackets, converts all whitespace to spaces
-        std::pair<std::string, std::string> replacementRules[] = {{"(", " ( "}, {")", " ) "}, {"'", " ' "}, {"\n", " "}, {"\t", " "}};
+            out << sexp;
 
-        for (std::pair<std::string, std::string>& rule : replacementRules)
-        {
-            std::string::iterator loc = inString.begin();
-            while (loc != inString.end())
+            // then carry on with the innermost list that has items left,
+            // closing those that have run out
+            while (true)
             {
-                bool match = true;
-                std::string::iterator patternChar = rule.first.begin();
-                std::string::iterator matchChar = loc;
-                while (patternChar != rule.first.end() && matchChar != inString.end())
+                if (printTails.size() == base)
                 {
-                    if (*patternChar != *matchChar)
-                    {
-                        match = false;
-                    }
-
-                    ++matchChar;
-                    ++patternChar;
+                    return;
                 }
-                if (match)
+                structure::SExpressionPtr& i = printTails.back();
+                if (!i->isAtom())
                 {
-                    int index = loc - inString.begin();
-                    inString.replace(loc - inString.begin(), rule.first.size(), rule.second);
-                    loc = inString.begin() + index;
-                    int displacement = rule.second.size() - rule.first.size();
-                    while (displacement < 0 && loc != inString.end() && loc != inString.begin() - 1)
-                    {
-                        ++displacement;
-                        --loc;
-                    }
-                    while (displacement > 0 && loc != inString.end())
-                    {
-                        --displacement;
-                        ++loc;
-                    }
+                    // print each item in the list with a space
+                    out << " ";
+                    sexp = car0(i);
+                    i = cdr0(i);
+                    break;
                 }
-                if (loc != inString.end())
+                // a list might not end in nil, especially if it has been consed
+                if (i != nilAtomPtr)
                 {
-                    ++loc;
+                    out << " . " << i;
                 }
+                out << ")";
+                printTails.pop_back();
             }
         }
-        return inString;
     }
 
-    std::vector<std::string> Session::tokenise(std::string inString)
+    TokenCursor::Kind TokenCursor::next()
     {
-        inString = preTokenise(inString);
-        // splits by spaces, discards empty strings created
-        std::vector<std::string> tokens;
-        std::string::iterator startLoc = inString.begin();
-        std::string::iterator endLoc = inString.begin();
-
-        while (endLoc != inString.end())
+        while (position != end && std::isspace(static_cast<unsigned char>(*position)))
         {
-            while ((endLoc != inString.end()) && (*endLoc != ' '))
-            {
-                ++endLoc;
-            }
-            if (endLoc == inString.end())
-            {
-                if (startLoc != endLoc)
-                {
-                    // we found a token
-                    std::string token (startLoc, endLoc);
-                    tokens.push_back(token);
-                }
-            }
-            else
-            {
-                if (startLoc != endLoc)
-                {
-                    // we found a token
-                    std::string token (startLoc, endLoc);
-                    tokens.push_back(token);
-                }
-                startLoc = endLoc + 1;
-                endLoc = startLoc;
-            }
+            ++position;
         }
-        return tokens;
+        if (position == end)
+        {
+            return End;
+        }
+        switch (*position)
+        {
+        case '(':
+            ++position;
+            return Open;
+        case ')':
+            ++position;
+            return Close;
+        case '\'':
+            ++position;
+            return Quote;
+        default:
+            break;
+        }
+        const char* start = position;
+        while (position != end && !std::isspace(static_cast<unsigned char>(*position))
+               && *position != '(' && *position != ')' && *position != '\'')
+        {
+            ++position;
+        }
+        currentName.assign(start, position);
+        return Name;
+    }
+
+    TokenCursor::Kind TokenCursor::peek()
+    {
+        const char* oldPosition = position;
+        Kind result = next();
+        position = oldPosition;
+        return result;
     }
 
-    structure::AtomPtr Session::symbolLookup(std::string keyName)
+    structure::AtomPtr Session::symbolLookup(const std::string& keyName)
     {
-        structure::AtomPtr result = nullptr;
-        for (auto atom : symbolTable)
+        auto found = symbolIndex.find(keyName);
+        if (found == symbolIndex.end())
         {
-            if (atom->name_ == keyName)
-            {
-                result = atom;
-            }
+            return nullptr;
         }
-        return result;
+        return found->second;
+    }
+
+    void Session::addSymbol(structure::AtomPtr atom)
+    {
+        // atoms are never removed, so the pointers handed out stay valid
+        symbolTable.push_back(atom);
+        symbolIndex.emplace(atom->name_, atom);
     }
 
-    structure::AtomPtr Session::makeAtom(std::string inString)
+    structure::AtomPtr Session::makeAtom(const std::string& inString)
     {
-        structure::AtomPtr result;
         structure::AtomPtr lookupResult = symbolLookup(inString);
         if (lookupResult == nullptr)
         {
-            result = std::make_shared<structure::Atom>(inString);
-            symbolTable.push_back(result);
-        }
-        else
-        {
-            result = lookupResult;
+            structure::AtomPtr result = structure::make<structure::Atom>(inString);
+            addSymbol(result);
+            return result;
         }
-        return result;
+        return lookupResult;
     }
 
-    structure::SExpressionPtr Session::parseSingleSExpression(std::vector<std::string>& tokens, int& depth)
+    structure::SExpressionPtr Session::parseSingleSExpression(TokenCursor& tokens)
     {
         // will consume one complete S-Expression from tokens
-        if (tokens.size() == 0)
+        switch (tokens.next())
         {
-            // input ended before completing the S-Expression
-            // TODO: handle this
-        }
-        std::string token = tokens[0];
-        tokens.erase(tokens.begin()); //TODO: this is an inefficient operation on vectors
-        if (token == "(")
-        {
-            // this is a list, so we will recursively pull out all contained S-Expressions
-            // S-Expression lists take the form of linked lists
+        case TokenCursor::Open:
+            {
+                // this is a list, so we will recursively pull out all contained S-Expressions
+                // S-Expression lists take the form of linked lists
 
-            /*
+                /*
 
-            (): Nil
+                (): Nil
 
-            (a b c): 0-> 0-> 0-> Nil
-                     |   |   |
-                     v   V   V
-                     a   b   c
+                (a b c): 0-> 0-> 0-> Nil
+                         |   |   |
+                         v   V   V
+                         a   b   c
 
-            */
+                */
 
-            // first make our list root, this will be cut off from the returned value
+                // first make our list root, this will be cut off from the returned value
 
-            structure::SPairPtr rootPtr = std::make_shared<structure::SPair>();
-            structure::SPairPtr lastPtr = rootPtr;
+                structure::SPairPtr rootPtr = structure::make<structure::SPair>();
+                structure::SPairPtr lastPtr = rootPtr;
 
-            while (tokens[0] != ")")
-            {
-                // this loop runs through once for each contained S-Expression
+                TokenCursor::Kind following = tokens.peek();
+                while (following != TokenCursor::Close && following != TokenCursor::End)
+                {
+                    // this loop runs through once for each contained S-Expression
+
+                    // add a new list unit
+                    structure::SPairPtr newUnitPtr = structure::make<structure::SPair>();
+                    lastPtr->next_ = newUnitPtr;
 
-                // add a new list unit
-                structure::SPairPtr newUnitPtr = std::make_shared<structure::SPair>();
-                lastPtr->next_ = newUnitPtr;
+                    // move the pointer along
+                    lastPtr = newUnitPtr;
 
-                // move the pointer along
-                lastPtr = newUnitPtr;
+                    // fill our new list unit and remove this contained S-Expression
+                    lastPtr->data_ = parseSingleSExpression(tokens);
+                    following = tokens.peek();
+                }
+                //finally make the end of the list point to NIL
+                lastPtr->next_ = nilAtomPtr;
+
+                // now we remove our matching ), input that ends first is
+                // taken as closed
+                tokens.next();
 
-                // fill our new list unit and remove this contained S-Expression
-                lastPtr->data_ = parseSingleSExpression(tokens, depth);
+                // this algorithm prepends a superfluous pair, so we remove it now
+                return rootPtr->next_;
             }
-            //finally make the end of the list point to NIL
-            lastPtr->next_ = nilAtomPtr;
 
-            // now we remove our matching )
-            tokens.erase(tokens.begin());
+        case TokenCursor::Quote:
+            {
+                // is quote shorthand
+                auto arg = structure::make<structure::SPair>(parseSingleSExpression(tokens), nilAtomPtr);
+                return structure::make<structure::SPair>(quoteAtomPtr, arg);
+            }
 
-            // this algorithm prepends a superfluous pair, so we remove it now
-            return rootPtr->next_;
-        }
-        else if (token == "'")
-        {
-            // is quote shorthand
-            auto arg = std::make_shared<structure::SPair>(parseSingleSExpression(tokens, depth), nilAtomPtr);
-            return std::make_shared<structure::SPair>(quoteAtomPtr, arg);
-        }
-        else if (token == ")")
-        {
-            // unexpected )
-            // TODO: handle this
-        }
-        else
-        {
-            return makeAtom(token);
+        case TokenCursor::Name:
+            return makeAtom(tokens.name());
+
+        default:
+            // unexpected ) or the input ended before completing the
+            // S-Expression
+            ELOG("parsing problem, expected an S-Expression");
+            return errorAtomPtr;
         }
-        std::cout << "\nParsing Problem - reached end of non-void parse function\n";
-        return errorAtomPtr;
     }
 
     structure::SExpressionPtr Session::read(std::istream& inStream)
     {
-        structure::SExpressionString inString;
-        inStream >> inString;
-        std::vector<std::string> tokens = tokenise(inString.content);
-        int depth = 0;
-        structure::SExpressionPtr SExpressionPtr = parseSingleSExpression(tokens, depth);
-        return SExpressionPtr;
+        // reads the next S-expression, text after it on the stream is kept
+        // for the next read from the same stream. At the end of input this
+        // is error, with inStream's failbit set
+        inStream >> inputText;
+        TokenCursor tokens(inputText.begin(), inputText.end());
+        return parseSingleSExpression(tokens);
     }
 
     structure::SExpressionPtr Session::atomLisp(structure::SExpressionPtr argList)
@@ -295,15 +262,14 @@ namespace session
             ELOG("error in eq, given " << argList);
             return errorAtomPtr;
         }
-        LOG(argList);
-        if (car0(argList) == car0(cdr0(argList)))
+        bool equal = car0(argList) == car0(cdr0(argList));
+        trace::record(trace::EventKind::Eq, nullptr, equal, traceDepth);
+        if (equal)
         {
             return trueAtomPtr;
         }
         else
         {
-            std::cout << "returning ";
-            LOG(nilAtomPtr);
             return nilAtomPtr;
         }
     }
@@ -318,92 +284,194 @@ namespace session
         return cdr0(car0(argList));
     }
 
-    structure::SExpressionPtr Session::car0(structure::SExpressionPtr arg)
+    structure::SExpressionPtr Session::car0(const structure::SExpressionPtr& arg)
     {
-        structure::SPairPtr maybePair = std::dynamic_pointer_cast<structure::SPair>(arg);
-        if (maybePair == nullptr)
+        if (arg->kind != structure::SExpression::PairK)
         {
             return errorAtomPtr;
         }
-        else
-        {
-            return maybePair->data_;
-        }
+        return static_cast<structure::SPair*>(arg.get())->data_;
     }
 
-    structure::SExpressionPtr Session::cdr0(structure::SExpressionPtr arg)
+    structure::SExpressionPtr Session::cdr0(const structure::SExpressionPtr& arg)
     {
-        structure::SPairPtr maybePair = std::dynamic_pointer_cast<structure::SPair>(arg);
-        if (maybePair == nullptr)
+        if (arg->kind != structure::SExpression::PairK)
         {
             return errorAtomPtr;
         }
-        else
-        {
-            return maybePair->next_;
-        }
+        return static_cast<structure::SPair*>(arg.get())->next_;
     }
 
     structure::SExpressionPtr Session::consLisp(structure::SExpressionPtr argList)
     {
-        std::cout << "consing ";
-        LOG(argList);
-        auto result = std::make_shared<structure::SPair>(car0(argList), car0(cdr0(argList)));
-        std::cout << "consed ";
-        LOG(result);
+        auto result = structure::make<structure::SPair>(car0(argList), car0(cdr0(argList)));
+        trace::record(trace::EventKind::Cons, result.get(), 0, traceDepth);
         return result;
     }
 
     structure::SExpressionPtr Session::defLisp(structure::SExpressionPtr argList)
     {
         // (a b)
-        auto bindPair = std::make_shared<structure::SPair>(car0(cdr0(argList)), nilAtomPtr); // (b)
-        auto bindList = std::make_shared<structure::SPair>(car0(argList), bindPair); // (a b)
-        auto newGlobalEnvironmentPtr = std::make_shared<structure::SPair>(bindList, globalEnvironmentPtr);
-        globalEnvironmentPtr = newGlobalEnvironmentPtr;
+        bindGlobal(car0(argList), car0(cdr0(argList)));
         return car0(argList);
     }
 
-    structure::SExpressionPtr Session::assoc0(structure::SExpressionPtr key, structure::SExpressionPtr environment)
+    void Session::bindGlobal(structure::SExpressionPtr key, structure::SExpressionPtr value)
+    {
+        Binding& binding = globalBindings[key.get()];
+        // the binding keeps its key alive, so the address can't be reused
+        binding.key = key;
+        binding.value = value;
+    }
+
+    structure::SExpressionPtr Session::assoc0(const structure::SExpressionPtr& key, const Environment& environment)
     {
-        auto i = environment;
-        while (car0(car0(i)) != key && i != nilAtomPtr)
+        // the innermost binding of key, the newest one within a frame
+        const Environment* frame = &environment;
+        for (; frame->parent; frame = frame->parent)
         {
-            i = cdr0(i);
+            for (size_t i = frame->end; i > frame->begin; i--)
+            {
+                if (frameBindings[i - 1].key == key)
+                {
+                    return frameBindings[i - 1].value;
+                }
+            }
         }
-        if (i == nilAtomPtr)
+        auto found = globalBindings.find(key.get());
+        if (found == globalBindings.end())
         {
             return errorAtomPtr;
         }
-        else
-        {
-            return car0(cdr0(car0(i)));
-        }
+        return found->second.value;
     }
 
-    structure::SExpressionPtr Session::evalList(structure::SExpressionPtr expression, structure::SExpressionPtr environment)
+    structure::SExpressionPtr Session::eval0(structure::SExpressionPtr expression, const Environment& environment)
     {
-        if (expression == nilAtomPtr)
+        // evaluation is a stack of steps, each either producing a value,
+        // which is passed to the step below it, or pushing the steps that
+        // will. So nesting costs a task rather than a native stack frame. A
+        // nested eval0, from apply0, only runs the steps above where it
+        // started
+        const size_t taskBase = tasks.size();
+        const size_t valueBase = values.size();
+        const size_t frameBase = frames.size();
+        const size_t bindingBase = frameBindings.size();
+        const std::uint16_t depthBase = traceDepth;
+        structure::SExpressionPtr value;
+        try
+        {
+            pushTask(EvalTask::Evaluate, expression, environment);
+            while (tasks.size() > taskBase)
+            {
+                EvalTask task = std::move(tasks.back());
+                tasks.pop_back();
+                runTask(task, value);
+            }
+        }
+        catch (...)
         {
-            return nilAtomPtr;
+            tasks.erase(tasks.begin() + taskBase, tasks.end());
+            values.erase(values.begin() + valueBase, values.end());
+            frames.resize(frameBase);
+            frameBindings.resize(bindingBase);
+            traceDepth = depthBase;
+            throw;
         }
-        else
+        return value;
+    }
+
+    void Session::pushTask(EvalTask::Kind kind, const structure::SExpressionPtr& expression, const Environment& environment, size_t mark)
+    {
+        tasks.push_back({kind, expression, nullptr, nullptr, &environment, mark});
+    }
+
+    void Session::runTask(EvalTask& task, structure::SExpressionPtr& value)
+    {
+        const Environment& environment = *task.environment;
+        switch (task.kind)
         {
-            return std::make_shared<structure::SPair>(eval0(car0(expression), environment), evalList(cdr0(expression), environment));
+        case EvalTask::Evaluate:
+            evaluate(task.expression, environment, value);
+            break;
+
+        case EvalTask::TraceExit:
+            --traceDepth;
+            trace::record(trace::EventKind::EvaluateExit, value.get(), 0, traceDepth);
+            break;
+
+        case EvalTask::NextClause:
+            if (value != nilAtomPtr)
+            {
+                pushTask(EvalTask::Evaluate, car0(cdr0(car0(task.expression))), environment);
+            }
+            else
+            {
+                nextClause(cdr0(task.expression), environment, value);
+            }
+            break;
+
+        case EvalTask::NextItem:
+            values.push_back(std::move(value));
+            nextItem(task.expression, environment, task.mark, value);
+            break;
+
+        case EvalTask::Define:
+            bindGlobal(car0(value), car0(cdr0(value)));
+            value = car0(cdr0(value));
+            break;
+
+        case EvalTask::CallNamed:
+            {
+                auto carExpression = car0(task.expression);
+                structure::PrimaryFunctionPtr maybePrimaryFunction = structure::refCast<structure::PrimaryFunction>(carExpression);
+                if (maybePrimaryFunction)
+                {
+                    trace::record(trace::EventKind::Call, maybePrimaryFunction.get(), 0, traceDepth);
+                    value = (this->*(maybePrimaryFunction->functionPtr))(value);
+                }
+                else
+                {
+                    auto lambda = assoc0(carExpression, environment);
+                    pushTask(EvalTask::Evaluate, structure::make<structure::SPair>(lambda, value), environment);
+                }
+            }
+            break;
+
+        case EvalTask::NextArgument:
+            frameBindings.push_back({car0(task.parameters), value}); // (p a)
+            nextArgument(task.expression, cdr0(task.parameters), cdr0(task.arguments), environment, task.mark, value);
+            break;
+
+        case EvalTask::Reapply:
+            pushTask(EvalTask::Evaluate, structure::make<structure::SPair>(value, cdr0(task.expression)), environment);
+            break;
+
+        case EvalTask::DropFrame:
+            // frames end in the order they began, so this one is the last
+            frameBindings.resize(task.mark);
+            frames.pop_back();
+            break;
+
+        default:
+            throw std::domain_error("unknown evaluation task");
         }
     }
 
-    structure::SExpressionPtr Session::eval0(structure::SExpressionPtr expression, structure::SExpressionPtr environment)
+    void Session::evaluate(const structure::SExpressionPtr& expression, const Environment& environment, structure::SExpressionPtr& value)
     {
-        std::cout << "evaluating ";
-        printS(expression, std::cout);
-        std::cout << "\nwith environment ";
-        printS(environment, std::cout);
-        std::cout << std::endl;
+        if (trace::enabled())
+        {
+            trace::record(trace::EventKind::EvaluateEnter, expression.get(), 0, traceDepth);
+            ++traceDepth;
+            pushTask(EvalTask::TraceExit, nullptr, environment);
+        }
+
         if (expression->isAtom())
         {
             // look up the atom in the environment
-            return assoc0(expression, environment);
+            value = assoc0(expression, environment);
+            return;
         }
 
         auto carExpression = car0(expression);
@@ -411,27 +479,17 @@ namespace session
         {
             if (carExpression == quoteAtomPtr)
             {
-                return car0(cdr0(expression));
+                value = car0(cdr0(expression));
             }
             else if (carExpression == lambdaAtomPtr)
             {
                 // a lambda-expression should be evaluated with arguments, if it
                 // is evaluated without arguments make a closure out of it
-                return expression;
+                value = expression;
             }
             else if (carExpression == condAtomPtr)
             {
-                /*OUT(cdr0(expression));*/
-                auto loc = cdr0(expression);
-                while (loc != nilAtomPtr)
-                {
-                    if (eval0(car0(car0(loc)), environment) != nilAtomPtr)
-                    {
-                        return eval0(car0(cdr0(car0(loc))), environment);
-                    }
-                    loc = cdr0(loc);
-                }
-                return nilAtomPtr;
+                nextClause(cdr0(expression), environment, value);
             }
             else if (carExpression == defineAtomPtr)
             {
@@ -443,28 +501,17 @@ namespace session
                 evaluate both: it is not hard to just quote the b, and evaluate a because why not
                 */
 
-                auto evaluatedArgs = evalList(cdr0(expression), environment);
-                auto newPair = std::make_shared<structure::SPair>(evaluatedArgs, globalEnvironmentPtr->next_);
-                globalEnvironmentPtr->next_ = newPair;
-                return car0(cdr0(evaluatedArgs));
+                pushTask(EvalTask::Define, nullptr, environment);
+                nextItem(cdr0(expression), environment, values.size(), value);
             }
             else if (carExpression == errorAtomPtr)
             {
-                return errorAtomPtr;
+                value = errorAtomPtr;
             }
             else
             {
-                auto evaluatedArgs = evalList(cdr0(expression), environment);
-                structure::PrimaryFunctionPtr maybePrimaryFunction = std::dynamic_pointer_cast<structure::PrimaryFunction>(carExpression);
-                if (maybePrimaryFunction)
-                {
-                    return (this->*(maybePrimaryFunction->functionPtr))(evaluatedArgs);
-                }
-                else
-                {
-                    auto lambda = assoc0(car0(expression), environment);
-                    return eval0(std::make_shared<structure::SPair>(lambda, evaluatedArgs), environment);
-                }
+                pushTask(EvalTask::CallNamed, expression, environment);
+                nextItem(cdr0(expression), environment, values.size(), value);
             }
         }
         else
@@ -476,68 +523,120 @@ namespace session
             if (caarExpression == labelAtomPtr)
             {
                 auto functionSexp = car0(cdr0(cdr0(carExpression))); // function
-                auto bindList = std::make_shared<structure::SPair>(carExpression, nilAtomPtr); // ((label name function))
-                auto newBinding = std::make_shared<structure::SPair>(car0(cdr0(carExpression)), bindList); // (name (label name function))
-                auto newEnvironment = std::make_shared<structure::SPair>(newBinding, environment);
+                size_t begin = frameBindings.size();
+                frameBindings.push_back({car0(cdr0(carExpression)), carExpression}); // (name (label name function))
+                frames.push_back({&environment, begin, frameBindings.size()});
+                pushTask(EvalTask::DropFrame, nullptr, environment, begin);
                 auto newArgList = cdr0(expression);
-                return eval0(std::make_shared<structure::SPair>(functionSexp, newArgList), newEnvironment);
+                pushTask(EvalTask::Evaluate, structure::make<structure::SPair>(functionSexp, newArgList), frames.back());
             }
             /*
             ((lambda (p1 p2 p3) sexp) a1 a2 a3) becomes sexp with (p1 a1), (p2 a2), (p3 a3) added to the environment
             */
-            if (caarExpression == lambdaAtomPtr)
+            else if (caarExpression == lambdaAtomPtr)
             {
                 auto parameters = car0(cdr0(carExpression)); // (p1 p2 p3)
                 auto arguments = cdr0(expression); // (a1 a2 a3)
-                auto newEnvironment = environment;
-                while (parameters != nilAtomPtr && arguments != nilAtomPtr)
-                {
-                    auto evaluatedArg = eval0(car0(arguments), environment);
-                    auto bindValue = std::make_shared<structure::SPair>(evaluatedArg, nilAtomPtr); // (a)
-                    auto bindPair = std::make_shared<structure::SPair>(car0(parameters), bindValue); // (p a)
-                    newEnvironment = std::make_shared<structure::SPair>(bindPair, newEnvironment);
-                    arguments = cdr0(arguments);
-                    parameters = cdr0(parameters);
-                }
-                if (parameters == nilAtomPtr && arguments == nilAtomPtr)
-                {
-                    return eval0(car0(cdr0(cdr0(carExpression))), newEnvironment);
-                }
-                else
-                {
-                    std::cout << "wrong number of args\n";
-                    // wrong number of arguments
-                    return errorAtomPtr;
-                }
+                nextArgument(expression, parameters, arguments, environment, frameBindings.size(), value);
             }
             else
             {
-                return eval0(std::make_shared<structure::SPair>(eval0(carExpression, environment), cdr0(expression)), environment);
+                pushTask(EvalTask::Reapply, expression, environment);
+                pushTask(EvalTask::Evaluate, carExpression, environment);
             }
         }
-        std::cout << "reached end of eval0\n";
-        return errorAtomPtr;
     }
 
-    structure::SExpressionPtr Session::appq0(structure::SExpressionPtr argList)
+    void Session::nextClause(const structure::SExpressionPtr& clauses, const Environment& environment, structure::SExpressionPtr& value)
     {
-        if (argList == nilAtomPtr)
+        // tests the first of clauses, the rest wait for it to fail
+        if (clauses == nilAtomPtr)
         {
-            return nilAtomPtr;
+            value = nilAtomPtr;
+            return;
+        }
+        pushTask(EvalTask::NextClause, clauses, environment);
+        pushTask(EvalTask::Evaluate, car0(car0(clauses)), environment);
+    }
+
+    void Session::nextItem(const structure::SExpressionPtr& items, const Environment& environment, size_t mark, structure::SExpressionPtr& value)
+    {
+        // evaluates a list an item at a time, left to right, gathering the
+        // values from mark onwards. The list is built once they are all in
+        if (!items->isAtom())
+        {
+            tasks.push_back({EvalTask::NextItem, cdr0(items), nullptr, nullptr, &environment, mark});
+            pushTask(EvalTask::Evaluate, car0(items), environment);
+            return;
+        }
+        structure::SExpressionPtr list = nilAtomPtr;
+        while (values.size() > mark)
+        {
+            list = structure::make<structure::SPair>(std::move(values.back()), std::move(list));
+            values.pop_back();
+        }
+        value = std::move(list);
+    }
+
+    void Session::nextArgument(const structure::SExpressionPtr& expression, const structure::SExpressionPtr& parameters,
+        const structure::SExpressionPtr& arguments, const Environment& environment, size_t mark, structure::SExpressionPtr& value)
+    {
+        // each argument is evaluated before its binding is added, any frames
+        // made meanwhile are gone by then, so the bindings from mark end up
+        // next to each other
+        if (parameters != nilAtomPtr && arguments != nilAtomPtr)
+        {
+            tasks.push_back({EvalTask::NextArgument, expression, parameters, arguments, &environment, mark});
+            pushTask(EvalTask::Evaluate, car0(arguments), environment);
+        }
+        else if (parameters == nilAtomPtr && arguments == nilAtomPtr)
+        {
+            frames.push_back({&environment, mark, frameBindings.size()});
+            pushTask(EvalTask::DropFrame, nullptr, environment, mark);
+            pushTask(EvalTask::Evaluate, car0(cdr0(cdr0(car0(expression)))), frames.back());
         }
         else
         {
-            structure::SExpressionPtr sPair = std::make_shared<structure::SPair>(car0(argList), nilAtomPtr);
-            structure::SExpressionPtr quotedPair = std::make_shared<structure::SPair>(quoteAtomPtr, sPair);
-            auto result = std::make_shared<structure::SPair>(quotedPair, appq0(cdr0(argList)));
-            return result;
+            // wrong number of arguments
+            frameBindings.resize(mark);
+            trace::record(trace::EventKind::Error, expression.get(), 0, traceDepth);
+            ELOG("wrong number of arguments to lambda");
+            value = errorAtomPtr;
+        }
+    }
+
+    void Session::dumpTrace(std::ostream& out)
+    {
+        // atoms outlive the session's expressions, so they can be named
+        std::vector<std::pair<const void*, std::string>> names;
+        for (const structure::AtomPtr& atom : symbolTable)
+        {
+            names.emplace_back(atom.get(), atom->name_);
         }
+        trace::dump(out, names);
+    }
+
+    structure::SExpressionPtr Session::appq0(structure::SExpressionPtr argList)
+    {
+        // (a1 a2 ...) becomes ((quote a1) (quote a2) ...), built front to back
+        structure::SPairPtr rootPtr = structure::make<structure::SPair>();
+        structure::SPairPtr lastPtr = rootPtr;
+        for (; !argList->isAtom(); argList = cdr0(argList))
+        {
+            structure::SExpressionPtr sPair = structure::make<structure::SPair>(car0(argList), nilAtomPtr);
+            structure::SExpressionPtr quotedPair = structure::make<structure::SPair>(quoteAtomPtr, sPair);
+            structure::SPairPtr newUnitPtr = structure::make<structure::SPair>(quotedPair, nilAtomPtr);
+            lastPtr->next_ = newUnitPtr;
+            lastPtr = newUnitPtr;
+        }
+        lastPtr->next_ = nilAtomPtr;
+        return rootPtr->next_;
     }
 
     structure::SExpressionPtr Session::apply0(structure::SExpressionPtr argList)
     {
         structure::SExpressionPtr quotedArgList = /*appq0(cdr0(argList))*/cdr0(argList);
-        structure::SExpressionPtr functionArgList = std::make_shared<structure::SPair>(car0(argList), quotedArgList);
-        return eval0(functionArgList, globalEnvironmentPtr);
+        structure::SExpressionPtr functionArgList = structure::make<structure::SPair>(car0(argList), quotedArgList);
+        return eval0(functionArgList, globalEnvironment);
     }
 }
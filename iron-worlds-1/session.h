@@ -3,18 +3,92 @@
 
 #include "structure.h"
 
+#include <cstdint>
+#include <deque>
 #include <iostream>
 #include <string>
+#include <unordered_map>
 #include <vector>
 
 // #define OUT(X) printS(X, std::cout); std::cout << "\n"
 
 namespace session
 {
+    class TokenCursor
+    {
+        // walks S-expression text one token at a time. Brackets and the
+        // quote mark are tokens on their own, anything else up to the next
+        // one or whitespace is a name. The text is not copied, so it must
+        // outlive the cursor
+        const char* position;
+        const char* const end;
+        std::string currentName;
+
+    public:
+        enum Kind
+        {
+            Open,
+            Close,
+            Quote,
+            Name,
+            End
+        };
+
+        TokenCursor(const char* begin, const char* newEnd) : position(begin), end(newEnd) {}
+
+        Kind next();
+        Kind peek();
+        // the text of the last Name token, reused between tokens
+        const std::string& name() const {return currentName;}
+    };
+
+    struct Binding
+    {
+        structure::SExpressionPtr key;
+        structure::SExpressionPtr value;
+    };
+
+    struct Environment
+    {
+        // a frame of bindings, searched before its parent. The global frame
+        // has no parent and hashes its keys. A lambda or label frame is the
+        // run [begin, end) of Session::frameBindings, since it only lives
+        // while its body is being evaluated
+        const Environment* parent;
+        size_t begin;
+        size_t end;
+    };
+
+    struct EvalTask
+    {
+        // a step of eval0 waiting for the value of the steps above it
+        enum Kind : char
+        {
+            Evaluate,       // evaluate expression
+            TraceExit,      // record the value as expression's result
+            NextClause,     // the value tests the first of the cond clauses in expression
+            NextItem,       // the value is a list item, expression holds the items after it
+            Define,         // the value is define's evaluated arguments
+            CallNamed,      // the value is the evaluated arguments of expression
+            NextArgument,   // the value is for the first of parameters and arguments
+            Reapply,        // the value is expression's function, apply it to the arguments
+            DropFrame       // the value is a frame's result, drop the frame
+        };
+        Kind kind;
+        structure::SExpressionPtr expression;
+        structure::SExpressionPtr parameters;
+        structure::SExpressionPtr arguments;
+        const Environment* environment;
+        // where this step's values or frame bindings begin
+        size_t mark;
+    };
+
     class Session
     {
     public:
         std::vector<structure::AtomPtr> symbolTable;
+        // the same atoms by name, so that a lookup does not scan the table
+        std::unordered_map<std::string, structure::AtomPtr> symbolIndex;
 
         structure::AtomPtr
             trueAtomPtr,
@@ -33,19 +107,38 @@ namespace session
             consAtomPtr,
             defAtomPtr;
 
-        structure::SPairPtr globalEnvironmentPtr;
+        // the text of the stream read last, see read
+        structure::SExpressionString inputText;
+
+        // the global frame's bindings, a rebinding replaces the old value
+        std::unordered_map<const structure::SExpression*, Binding> globalBindings;
+        Environment globalEnvironment;
+        // bindings of every lambda and label frame currently being evaluated
+        std::vector<Binding> frameBindings;
+        // eval0's work: pending steps, list items evaluated so far and the
+        // frames of lambdas and labels being evaluated. Kept between calls
+        // so that evaluating reuses their storage
+        std::vector<EvalTask> tasks;
+        std::vector<structure::SExpressionPtr> values;
+        std::deque<Environment> frames;
+        // the tails of the lists printS is in the middle of
+        std::vector<structure::SExpressionPtr> printTails;
+        // eval0 nesting, recorded with trace events while tracing is on
+        std::uint16_t traceDepth = 0;
 
         Session();
         ~Session() {};
 
+        // writes the trace rings with this session's atoms named, see trace.h
+        void dumpTrace(std::ostream& out);
+
         void printS(structure::SExpressionPtr sexp, std::ostream& out);
 
-        std::string preTokenise(std::string inString);
-        std::vector<std::string> tokenise(std::string inString);
-        structure::AtomPtr makeAtom(std::string inString);
-        structure::SExpressionPtr parseSingleSExpression(std::vector<std::string>& tokens, int& depth);
+        structure::AtomPtr makeAtom(const std::string& inString);
+        structure::SExpressionPtr parseSingleSExpression(TokenCursor& tokens);
         structure::SExpressionPtr read(std::istream& inStream);
-        structure::AtomPtr symbolLookup(std::string keyName);
+        structure::AtomPtr symbolLookup(const std::string& keyName);
+        void addSymbol(structure::AtomPtr atom);
 
         structure::SExpressionPtr atomLisp(structure::SExpressionPtr argList);
         structure::SExpressionPtr eqLisp(structure::SExpressionPtr argList);
@@ -54,11 +147,18 @@ namespace session
         structure::SExpressionPtr consLisp(structure::SExpressionPtr argList);
         structure::SExpressionPtr defLisp(structure::SExpressionPtr argList);
 
-        structure::SExpressionPtr car0(structure::SExpressionPtr arg);
-        structure::SExpressionPtr cdr0(structure::SExpressionPtr arg);
-        structure::SExpressionPtr assoc0(structure::SExpressionPtr key, structure::SExpressionPtr environment);
-        structure::SExpressionPtr eval0(structure::SExpressionPtr expression, structure::SExpressionPtr environment);
-        structure::SExpressionPtr evalList(structure::SExpressionPtr expression, structure::SExpressionPtr environment);
+        structure::SExpressionPtr car0(const structure::SExpressionPtr& arg);
+        structure::SExpressionPtr cdr0(const structure::SExpressionPtr& arg);
+        void bindGlobal(structure::SExpressionPtr key, structure::SExpressionPtr value);
+        structure::SExpressionPtr assoc0(const structure::SExpressionPtr& key, const Environment& environment);
+        structure::SExpressionPtr eval0(structure::SExpressionPtr expression, const Environment& environment);
+        void runTask(EvalTask& task, structure::SExpressionPtr& value);
+        void evaluate(const structure::SExpressionPtr& expression, const Environment& environment, structure::SExpressionPtr& value);
+        void nextClause(const structure::SExpressionPtr& clauses, const Environment& environment, structure::SExpressionPtr& value);
+        void nextItem(const structure::SExpressionPtr& items, const Environment& environment, size_t mark, structure::SExpressionPtr& value);
+        void nextArgument(const structure::SExpressionPtr& expression, const structure::SExpressionPtr& parameters,
+            const structure::SExpressionPtr& arguments, const Environment& environment, size_t mark, structure::SExpressionPtr& value);
+        void pushTask(EvalTask::Kind kind, const structure::SExpressionPtr& expression, const Environment& environment, size_t mark = 0);
         structure::SExpressionPtr apply0(structure::SExpressionPtr argList);
         structure::SExpressionPtr appq0(structure::SExpressionPtr argList);
     };
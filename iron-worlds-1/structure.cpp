@@ -1,13 +1,107 @@
 #include "structure.h"
 
+#include <cctype>
+#include <memory>
+#include <mutex>
+#include <vector>
+
 namespace structure
 {
+    namespace
+    {
+        union PoolBlock
+        {
+            // a free block holds the next free one, a used block holds a pair
+            PoolBlock* nextFree;
+            alignas(SPair) unsigned char storage[sizeof(SPair)];
+        };
+
+        // blocks are taken from chunks that are only freed at exit. Each
+        // thread keeps its own free list, so sessions on different threads
+        // never share one; a block freed on another thread than the one
+        // that took it just joins the freeing thread's list
+        const size_t blocksPerChunk = 1024;
+        std::mutex chunksMutex;
+        std::vector<std::unique_ptr<PoolBlock[]>> chunks;
+        thread_local PoolBlock* firstFree = nullptr;
+    }
+
+    void* SPair::operator new(size_t)
+    {
+        // nothing derives from SPair, so every request is one block
+        if (!firstFree)
+        {
+            PoolBlock* chunk = new PoolBlock[blocksPerChunk];
+            {
+                std::lock_guard<std::mutex> lock(chunksMutex);
+                chunks.emplace_back(chunk);
+            }
+            for (size_t i = 0; i < blocksPerChunk; i++)
+            {
+                chunk[i].nextFree = i + 1 < blocksPerChunk ? chunk + i + 1 : nullptr;
+            }
+            firstFree = chunk;
+        }
+        PoolBlock* result = firstFree;
+        firstFree = result->nextFree;
+        return result;
+    }
+
+    void SPair::operator delete(void* pointer)
+    {
+        PoolBlock* block = static_cast<PoolBlock*>(pointer);
+        block->nextFree = firstFree;
+        firstFree = block;
+    }
+
+    void destroy(SExpression* node)
+    {
+        // a pair's children are freed in this loop rather than by the pair's
+        // destructor, so neither a long list nor deep nesting recurses once
+        // per level. The tail is followed at once, heads that are pairs wait
+        // in pending, which keeps its storage between calls on each thread
+        thread_local std::vector<SExpression*> pending;
+        const size_t base = pending.size();
+        while (node)
+        {
+            SExpression* next = nullptr;
+            if (node->kind == SExpression::PairK)
+            {
+                SPair* pair = static_cast<SPair*>(node);
+                SExpression* head = pair->data_.detach();
+                if (head && --head->references == 0)
+                {
+                    if (head->kind == SExpression::PairK)
+                    {
+                        pending.push_back(head);
+                    }
+                    else
+                    {
+                        delete head;
+                    }
+                }
+                SExpression* tail = pair->next_.detach();
+                if (tail && --tail->references == 0)
+                {
+                    next = tail;
+                }
+            }
+            delete node;
+            if (!next && pending.size() > base)
+            {
+                next = pending.back();
+                pending.pop_back();
+            }
+            node = next;
+        }
+    }
+
     std::ostream& operator<<(std::ostream& output, const SExpressionPtr& e)
     {
         /// output << "<" << e.get() << ">";
         if (e->isAtom())
         {
-            AtomPtr maybeAtom = std::dynamic_pointer_cast<Atom>(e);
+            AtomPtr maybeAtom = refCast<Atom>(e);
             if (maybeAtom.get() != nullptr)
             {
                 output << maybeAtom;
@@ -15,7 +109,7 @@ namespace structure
         }
         else
         {
-            SPairPtr maybeSPair = std::dynamic_pointer_cast<SPair>(e);
+            SPairPtr maybeSPair = refCast<SPair>(e);
             if (maybeSPair.get() != nullptr)
             {
                 output << maybeSPair;
@@ -37,36 +131,117 @@ namespace structure
         return output;
     }
 
+    namespace
+    {
+        bool pullChunk(std::istream& input, std::string& content)
+        {
+            // appends up to a chunk, less only at the end of input. A full
+            // read rather than readsome, which finds nothing ready on a
+            // stream such as stdio-synced std::cin
+            size_t oldSize = content.size();
+            content.resize(oldSize + SExpressionString::chunkSize);
+            input.read(&content[oldSize], SExpressionString::chunkSize);
+            content.resize(oldSize + input.gcount());
+            return content.size() > oldSize;
+        }
+    }
+
     std::istream& operator>>(std::istream& input, SExpressionString& s)
     {
-        std::string newString;
+        // text left over from another stream is not this one's
+        if (s.source != &input)
+        {
+            s.content.clear();
+            s.expressionEnd = 0;
+            s.source = &input;
+        }
+
+        // scans on from the end of the last S-expression. A list ends at its
+        // closing bracket, a name at whatever cannot be part of it, and
+        // input that runs out ends whatever was started
+        const size_t none = std::string::npos;
+        size_t position = s.expressionEnd;
+        size_t start = none;
         int level = 0;
-        bool incomplete = true;
-        unsigned int i = 0;
-        while (incomplete)
+        bool inName = false;
+        bool complete = false;
+        while (!complete)
         {
-            std::getline(input, newString);
-            for (i = 0; i < newString.size(); ++i)
+            if (position == s.content.size())
             {
-                if (newString[i] == '(')
+                // before pulling more, drop the text already handed out so
+                // the buffer only ever holds about one S-expression
+                size_t dropped = start == none ? position : start;
+                s.content.erase(0, dropped);
+                position -= dropped;
+                if (start != none)
                 {
-                    ++level;
+                    start = 0;
                 }
-                else if (newString[i] == ')')
+                if (!pullChunk(input, s.content))
                 {
-                    --level;
-                    if (level == 0)
-                    {
-                        break;
-                    }
+                    break;
                 }
             }
-            if (level == 0)
+
+            if (level > 0)
             {
-                incomplete = false;
+                // inside a list only brackets matter
+                const char* scan = s.content.data() + position;
+                const char* scanEnd = s.content.data() + s.content.size();
+                while (scan != scanEnd && *scan != '(' && *scan != ')')
+                {
+                    ++scan;
+                }
+                position = scan - s.content.data();
+                if (scan == scanEnd)
+                {
+                    continue;
+                }
             }
-            s.content += newString.substr(0, i+1);
+
+            char c = s.content[position];
+            bool space = std::isspace(static_cast<unsigned char>(c));
+            if (level == 0 && inName && (space || c == '(' || c == ')' || c == '\''))
+            {
+                break;
+            }
+            ++position;
+            if (level == 0 && space)
+            {
+                continue;
+            }
+            if (start == none)
+            {
+                start = position - 1;
+            }
+            if (c == '(')
+            {
+                ++level;
+            }
+            else if (c == ')')
+            {
+                // a stray ) at the top is passed on for the parser to reject
+                complete = level <= 1;
+                --level;
+            }
+            else if (level == 0 && c != '\'')
+            {
+                inName = true;
+            }
+        }
+
+        if (start == none)
+        {
+            // nothing but whitespace before the end of input
+            s.expressionBegin = s.expressionEnd = position;
+            input.setstate(std::ios::failbit);
+            return input;
         }
+        // the end of input completes an S-expression rather than failing it
+        input.clear(input.rdstate() & ~std::ios::failbit);
+        s.expressionBegin = start;
+        s.expressionEnd = position;
         return input;
     }
 }
@@ -3,9 +3,10 @@
 
 #include "platform.h"
 
+#include <cstddef>
 #include <iostream>
 #include <string>
-#include <memory>
+#include <utility>
 
 namespace session
 {
@@ -19,34 +20,116 @@ namespace structure
     class Atom;
     class PrimaryFunction;
 
-    typedef std::shared_ptr<SExpression> SExpressionPtr;
-    typedef std::shared_ptr<SPair> SPairPtr;
-    typedef std::shared_ptr<Atom> AtomPtr;
-    typedef std::shared_ptr<PrimaryFunction> PrimaryFunctionPtr;
-
     class SExpression
     {
     public:
+        enum Kind : char
+        {
+            PairK,
+            AtomK,
+            NilK,
+            FunctionK
+        };
+
+        // says which subclass this is, so that a cast is a comparison
+        const Kind kind;
+        // counted by Ref, not atomically: a Session and its expressions
+        // belong to one thread
+        unsigned int references = 0;
+
+        explicit SExpression(Kind newKind) : kind(newKind) {};
         virtual ~SExpression() {};
 
-        virtual bool isAtom() const {return false;};
-        virtual bool isList() const {return true;};
+        bool isAtom() const {return kind != PairK;};
+        bool isList() const {return kind == PairK || kind == NilK;};
+    };
+
+    // frees node and, iteratively, whatever only it refers to
+    void destroy(SExpression* node);
+
+    template <class T>
+    class Ref
+    {
+        // an intrusive reference to an S-Expression, null or counted
+        T* pointer;
+
+        template <class U>
+        friend class Ref;
 
-        friend std::ostream& operator<<(std::ostream& output, const SExpressionPtr& e);
+        static void retain(T* node) {if (node) ++node->references;}
+        static void release(T* node) {if (node && --node->references == 0) destroy(node);}
+
+    public:
+        Ref() : pointer(nullptr) {};
+        Ref(std::nullptr_t) : pointer(nullptr) {};
+        Ref(T* newPointer) : pointer(newPointer) {retain(pointer);};
+        Ref(const Ref& other) : pointer(other.pointer) {retain(pointer);};
+        Ref(Ref&& other) : pointer(other.pointer) {other.pointer = nullptr;};
+        template <class U>
+        Ref(const Ref<U>& other) : pointer(other.pointer) {retain(pointer);}
+        template <class U>
+        Ref(Ref<U>&& other) : pointer(other.pointer) {other.pointer = nullptr;}
+        ~Ref() {release(pointer);};
+
+        Ref& operator=(Ref other)
+        {
+            T* oldPointer = pointer;
+            pointer = other.pointer;
+            other.pointer = oldPointer;
+            return *this;
+        }
+
+        T* get() const {return pointer;};
+        T* operator->() const {return pointer;};
+        T& operator*() const {return *pointer;};
+        explicit operator bool() const {return pointer != nullptr;};
+
+        // gives up the reference without releasing it
+        T* detach()
+        {
+            T* result = pointer;
+            pointer = nullptr;
+            return result;
+        }
     };
 
+    template <class A, class B>
+    bool operator==(const Ref<A>& a, const Ref<B>& b)
+    {
+        return static_cast<const SExpression*>(a.get()) == static_cast<const SExpression*>(b.get());
+    }
+    template <class A, class B>
+    bool operator!=(const Ref<A>& a, const Ref<B>& b) {return !(a == b);}
+    template <class A>
+    bool operator==(const Ref<A>& a, std::nullptr_t) {return a.get() == nullptr;}
+    template <class A>
+    bool operator!=(const Ref<A>& a, std::nullptr_t) {return a.get() != nullptr;}
+
+    typedef Ref<SExpression> SExpressionPtr;
+    typedef Ref<SPair> SPairPtr;
+    typedef Ref<Atom> AtomPtr;
+    typedef Ref<PrimaryFunction> PrimaryFunctionPtr;
+
+    std::ostream& operator<<(std::ostream& output, const SExpressionPtr& e);
+
     class SPair : public SExpression
     {
     public:
         SExpressionPtr data_;
         SExpressionPtr next_;
 
-        SPair() {};
+        SPair() : SExpression(PairK) {};
         SPair(SExpressionPtr data, SExpressionPtr next):
-            data_(data), next_(next) {};
+            SExpression(PairK), data_(data), next_(next) {};
 
         ~SPair() {};
 
+        static bool matches(const SExpression* e) {return e->kind == PairK;};
+
+        // pairs come from per-thread pools of equal-sized blocks, see structure.cpp
+        static void* operator new(size_t size);
+        static void operator delete(void* pointer);
+
         friend std::ostream& operator<<(std::ostream& output, const SPairPtr& p);
     };
 
@@ -55,11 +138,10 @@ namespace structure
     public:
         std::string name_;
 
-        Atom() {};
-        Atom(std::string name): name_(name) {};
+        Atom() : SExpression(AtomK) {};
+        Atom(std::string name, Kind newKind = AtomK): SExpression(newKind), name_(name) {};
 
-        bool isAtom() const {return true;};
-        bool isList() const {return false;};
+        static bool matches(const SExpression* e) {return e->kind != PairK;};
 
         friend std::ostream& operator<<(std::ostream& output, const AtomPtr& a);
     };
@@ -67,9 +149,7 @@ namespace structure
     class Nil : public Atom
     {
     public:
-        using Atom::Atom;
-
-        bool isList() const {return true;};
+        Nil(std::string name) : Atom(name, NilK) {};
     };
 
     class PrimaryFunction : public Atom
@@ -78,15 +158,47 @@ namespace structure
         // an atom that corresponds to a function implemented by the platform
         SExpressionPtr (session::Session::* functionPtr)(SExpressionPtr);
 
-        using Atom::Atom;
+        PrimaryFunction(std::string name) : Atom(name, FunctionK), functionPtr(nullptr) {};
+
+        static bool matches(const SExpression* e) {return e->kind == FunctionK;};
 
         // uses default destructor because functions can't be deleted
     };
 
+    template <class T, class... Args>
+    Ref<T> make(Args&&... args)
+    {
+        return Ref<T>(new T(std::forward<Args>(args)...));
+    }
+
+    // e as a T, or null if it is not one
+    template <class T>
+    Ref<T> refCast(const SExpressionPtr& e)
+    {
+        if (e && T::matches(e.get()))
+        {
+            return Ref<T>(static_cast<T*>(e.get()));
+        }
+        return nullptr;
+    }
+
     class SExpressionString
     {
-    public:
+        // reads S-expression text from a stream a chunk at a time, one
+        // complete S-expression per extraction. The text read past it stays
+        // buffered for the next extraction from the same stream
         std::string content;
+        const std::istream* source = nullptr;
+        size_t expressionBegin = 0;
+        size_t expressionEnd = 0;
+
+    public:
+        static const size_t chunkSize = 1 << 16;
+
+        // the last S-expression extracted, valid until the next extraction
+        const char* begin() const {return content.data() + expressionBegin;}
+        const char* end() const {return content.data() + expressionEnd;}
+
         friend std::istream& operator>>(std::istream& input, SExpressionString& s);
     };
 
@@ -0,0 +1,236 @@
+#include "trace.h"
+
+#include <chrono>
+#include <cstring>
+#include <iomanip>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+
+namespace trace
+{
+    std::atomic<bool> enabledFlag(false);
+
+    namespace
+    {
+        struct Ring
+        {
+            std::vector<Event> events;
+            std::size_t next = 0;
+            std::size_t count = 0;
+            std::uint32_t thread;
+
+            explicit Ring(std::uint32_t threadNumber) : events(ringCapacity), thread(threadNumber) {}
+        };
+
+        // rings are kept after their thread ends, so a dump still has them
+        std::mutex ringsMutex;
+        std::vector<std::unique_ptr<Ring>> rings;
+        thread_local Ring* threadRing = nullptr;
+
+        const char magic[4] = {'I', 'W', 'T', 'R'};
+        const std::uint32_t version = 1;
+
+        Ring& ringForThisThread()
+        {
+            if (!threadRing)
+            {
+                std::lock_guard<std::mutex> lock(ringsMutex);
+                rings.emplace_back(new Ring(rings.size()));
+                threadRing = rings.back().get();
+            }
+            return *threadRing;
+        }
+
+        template <class T>
+        void writeRaw(std::ostream& out, const T& value)
+        {
+            out.write(reinterpret_cast<const char*>(&value), sizeof(value));
+        }
+
+        template <class T>
+        bool readRaw(std::istream& in, T& value)
+        {
+            return bool(in.read(reinterpret_cast<char*>(&value), sizeof(value)));
+        }
+
+        const char* kindName(EventKind kind)
+        {
+            switch (kind)
+            {
+            case EventKind::EvaluateEnter:
+                return "evaluate";
+            case EventKind::EvaluateExit:
+                return "result";
+            case EventKind::Call:
+                return "call";
+            case EventKind::Cons:
+                return "cons";
+            case EventKind::Eq:
+                return "eq";
+            case EventKind::Error:
+                return "error";
+            default:
+                return "unknown";
+            }
+        }
+    }
+
+    void enable(bool on)
+    {
+        enabledFlag.store(on, std::memory_order_relaxed);
+    }
+
+    void recordEvent(EventKind kind, const void* subject, std::uint64_t detail, std::uint16_t depth)
+    {
+        Ring& ring = ringForThisThread();
+        Event& event = ring.events[ring.next];
+        event.time = std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+        event.subject = subject;
+        event.detail = detail;
+        event.kind = kind;
+        event.depth = depth;
+        ring.next = (ring.next + 1) % ringCapacity;
+        if (ring.count < ringCapacity)
+        {
+            ring.count++;
+        }
+    }
+
+    void dump(std::ostream& out, const std::vector<std::pair<const void*, std::string>>& names)
+    {
+        // native byte order, for decoding on the same machine
+        std::lock_guard<std::mutex> lock(ringsMutex);
+        out.write(magic, sizeof(magic));
+        writeRaw(out, version);
+        writeRaw(out, std::uint32_t(rings.size()));
+        for (const std::unique_ptr<Ring>& ring : rings)
+        {
+            writeRaw(out, ring->thread);
+            writeRaw(out, std::uint64_t(ring->count));
+            std::size_t first = (ring->next + ringCapacity - ring->count) % ringCapacity;
+            for (std::size_t i = 0; i < ring->count; i++)
+            {
+                const Event& event = ring->events[(first + i) % ringCapacity];
+                writeRaw(out, event.time);
+                writeRaw(out, std::uint64_t(reinterpret_cast<std::uintptr_t>(event.subject)));
+                writeRaw(out, event.detail);
+                writeRaw(out, std::uint16_t(event.kind));
+                writeRaw(out, event.depth);
+            }
+        }
+        writeRaw(out, std::uint64_t(names.size()));
+        for (const std::pair<const void*, std::string>& name : names)
+        {
+            writeRaw(out, std::uint64_t(reinterpret_cast<std::uintptr_t>(name.first)));
+            writeRaw(out, std::uint32_t(name.second.size()));
+            out.write(name.second.data(), name.second.size());
+        }
+    }
+
+    void clear()
+    {
+        std::lock_guard<std::mutex> lock(ringsMutex);
+        for (const std::unique_ptr<Ring>& ring : rings)
+        {
+            ring->next = 0;
+            ring->count = 0;
+        }
+    }
+
+    bool decode(std::istream& in, std::ostream& out)
+    {
+        char header[sizeof(magic)];
+        std::uint32_t fileVersion, ringCount;
+        if (!in.read(header, sizeof(header)) || std::memcmp(header, magic, sizeof(magic)) != 0
+            || !readRaw(in, fileVersion) || fileVersion != version || !readRaw(in, ringCount))
+        {
+            return false;
+        }
+
+        struct Thread
+        {
+            std::uint32_t number;
+            std::vector<std::pair<Event, std::uint64_t>> events;
+        };
+        std::vector<Thread> threads(ringCount);
+        for (Thread& thread : threads)
+        {
+            std::uint64_t count;
+            if (!readRaw(in, thread.number) || !readRaw(in, count))
+            {
+                return false;
+            }
+            for (std::uint64_t i = 0; i < count; i++)
+            {
+                Event event;
+                std::uint64_t subject;
+                std::uint16_t kind;
+                if (!readRaw(in, event.time) || !readRaw(in, subject) || !readRaw(in, event.detail)
+                    || !readRaw(in, kind) || !readRaw(in, event.depth))
+                {
+                    return false;
+                }
+                event.kind = EventKind(kind);
+                thread.events.emplace_back(event, subject);
+            }
+        }
+
+        std::unordered_map<std::uint64_t, std::string> names;
+        std::uint64_t nameCount;
+        if (!readRaw(in, nameCount))
+        {
+            return false;
+        }
+        for (std::uint64_t i = 0; i < nameCount; i++)
+        {
+            std::uint64_t subject;
+            std::uint32_t length;
+            if (!readRaw(in, subject) || !readRaw(in, length))
+            {
+                return false;
+            }
+            std::string name(length, '\0');
+            if (length && !in.read(&name[0], length))
+            {
+                return false;
+            }
+            names[subject] = name;
+        }
+
+        for (const Thread& thread : threads)
+        {
+            if (thread.events.empty())
+            {
+                continue;
+            }
+            out << "thread " << thread.number << "\n";
+            std::uint64_t start = thread.events.front().first.time;
+            for (const std::pair<Event, std::uint64_t>& entry : thread.events)
+            {
+                const Event& event = entry.first;
+                out << std::setw(12) << (event.time - start) << " ns  "
+                    << std::string(2 * event.depth, ' ') << kindName(event.kind);
+                if (entry.second)
+                {
+                    auto found = names.find(entry.second);
+                    if (found != names.end())
+                    {
+                        out << " " << found->second;
+                    }
+                    else
+                    {
+                        out << " #<" << std::hex << entry.second << std::dec << ">";
+                    }
+                }
+                if (event.kind == EventKind::Eq)
+                {
+                    out << (event.detail ? " t" : " nil");
+                }
+                out << "\n";
+            }
+        }
+        return true;
+    }
+}
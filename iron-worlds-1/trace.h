@@ -0,0 +1,67 @@
+#ifndef TRACE_H_INCLUDED
+#define TRACE_H_INCLUDED
+
+#include <atomic>
+#include <cstdint>
+#include <iostream>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace trace
+{
+    /*
+    Structured tracing for the interpreters. Tracing is always compiled in
+    but off until enabled, when a trace point costs one relaxed load and a
+    branch. While on, each thread writes fixed-size binary events into its
+    own ring buffer, keeping the newest ones, so nothing is formatted or
+    locked while the traced code runs. dump writes every ring out for
+    decode, or the trace-decode tool, to print later.
+    */
+
+    enum class EventKind : std::uint16_t
+    {
+        EvaluateEnter,  // subject: expression
+        EvaluateExit,   // subject: result
+        Call,           // subject: primary function atom
+        Cons,           // subject: new pair
+        Eq,             // detail: 1 if equal
+        Error           // subject: offending expression, if any
+    };
+
+    struct Event
+    {
+        std::uint64_t time; // steady clock, ns
+        const void* subject;
+        std::uint64_t detail;
+        EventKind kind;
+        std::uint16_t depth;
+    };
+
+    // how many of the newest events each thread keeps
+    const std::size_t ringCapacity = 1 << 14;
+
+    extern std::atomic<bool> enabledFlag;
+
+    inline bool enabled() {return enabledFlag.load(std::memory_order_relaxed);}
+    void enable(bool on);
+    void recordEvent(EventKind kind, const void* subject, std::uint64_t detail, std::uint16_t depth);
+
+    inline void record(EventKind kind, const void* subject = nullptr, std::uint64_t detail = 0, std::uint16_t depth = 0)
+    {
+        if (enabled())
+        {
+            recordEvent(kind, subject, detail, depth);
+        }
+    }
+
+    // writes every thread's events, oldest first, and names for any subject
+    // pointers the caller can name. Traced threads should be idle meanwhile
+    void dump(std::ostream& out, const std::vector<std::pair<const void*, std::string>>& names);
+    // empties every thread's ring
+    void clear();
+    // prints a dump as text, one event per line
+    bool decode(std::istream& in, std::ostream& out);
+}
+
+#endif // TRACE_H_INCLUDED
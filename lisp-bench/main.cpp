@@ -0,0 +1,245 @@
+#include "lisp.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+/*
+Times the Lisp VM on a fixed set of workloads, each in a fresh VM, and
+reports per operation time and cons use. Run with --json to get a
+machine-readable report to compare between builds.
+
+The VM's cons memory grows in blocks and is never reclaimed, so the peak
+heap column shows how many conses a workload has used up by the end.
+*/
+
+namespace
+{
+    struct Workload
+    {
+        std::string name;
+        // Lisp source evaluated once before timing
+        std::string setup;
+        // one operation, unless run is given
+        std::string form;
+        std::function<void(lisp::VirtualMachine&)> run;
+        unsigned int iterations;
+    };
+
+    struct Result
+    {
+        std::string name;
+        unsigned int iterations;
+        double nsPerOp;
+        double consesPerOp;
+        size_t peakHeap;
+    };
+
+    void evaluateAll(lisp::VirtualMachine& vm, const std::string& source)
+    {
+        std::istringstream sourceStream(source);
+        while ((sourceStream >> std::ws).peek() != EOF)
+        {
+            vm.evaluate(vm.read(sourceStream));
+        }
+    }
+
+    Result measure(const Workload& workload)
+    {
+        lisp::VirtualMachine vm;
+        evaluateAll(vm, workload.setup);
+
+        std::function<void(lisp::VirtualMachine&)> op = workload.run;
+        if (!op)
+        {
+            // a trailing space, as the reader needs one after a final symbol
+            std::istringstream formStream(workload.form + " ");
+            lisp::LispHandle form = vm.read(formStream);
+            op = [form] (lisp::VirtualMachine& machine) {machine.evaluate(form);};
+        }
+
+        // one untimed operation warms the caches and shows how much it conses
+        size_t heapBefore = vm.heapSize();
+        op(vm);
+        size_t consesPerOp = vm.heapSize() - heapBefore;
+
+        unsigned int iterations = workload.iterations;
+
+        heapBefore = vm.heapSize();
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        for (unsigned int i = 0; i < iterations; i++)
+        {
+            op(vm);
+        }
+        std::chrono::steady_clock::time_point end = std::chrono::steady_clock::now();
+
+        Result result;
+        result.name = workload.name;
+        result.iterations = iterations;
+        result.nsPerOp = iterations ? std::chrono::duration<double, std::nano>(end - start).count() / iterations : 0;
+        result.consesPerOp = iterations ? double(vm.heapSize() - heapBefore) / iterations : consesPerOp;
+        result.peakHeap = vm.heapSize();
+        return result;
+    }
+
+    std::string callWithArguments(const char* name, unsigned int count)
+    {
+        std::string call = std::string("(") + name;
+        for (unsigned int i = 0; i < count; i++)
+        {
+            call += " 1";
+        }
+        return call + ")";
+    }
+
+    std::vector<Workload> makeWorkloads(const std::string& largeFilePath)
+    {
+        std::vector<Workload> workloads;
+
+        workloads.push_back({"fib-20",
+            "(def fib (lambda (n) (cond ((< n 2) n) (t (+ (fib (- n 1)) (fib (- n 2)))))))",
+            "(fib 20)", nullptr, 20});
+
+        workloads.push_back({"tak-18-12-6",
+            "(def tak (lambda (x y z) (cond ((< y x) (tak (tak (- x 1) y z) (tak (- y 1) z x) (tak (- z 1) x y))) (t z))))",
+            "(tak 18 12 6)", nullptr, 20});
+
+        // counts the solutions, placed queens are a list of columns
+        workloads.push_back({"nqueens-6",
+            "(def safe (lambda (q d placed) (cond ((atom placed) t) ((= q (car placed)) nil)"
+            " ((= q (+ (car placed) d)) nil) ((= q (- (car placed) d)) nil) (t (safe q (+ d 1) (cdr placed))))))"
+            "(def try (lambda (q n k placed) (cond ((= q 0) 0)"
+            " (t (+ (cond ((safe q 1 placed) (place n (- k 1) (cons q placed))) (t 0)) (try (- q 1) n k placed))))))"
+            "(def place (lambda (n k placed) (cond ((= k 0) 1) (t (try n n k placed)))))",
+            "(place 6 6 nil)", nullptr, 200});
+
+        workloads.push_back({"list-build-reverse-200",
+            "(def build (lambda (n acc) (cond ((= n 0) acc) (t (build (- n 1) (cons n acc))))))"
+            "(def rev (lambda (l acc) (cond ((atom l) acc) (t (rev (cdr l) (cons (car l) acc))))))",
+            "(rev (build 200 nil) nil)", nullptr, 1000});
+
+        workloads.push_back({"deep-recursion-2000",
+            "(def deep (lambda (n) (cond ((= n 0) 0) (t (+ 1 (deep (- n 1)))))))",
+            "(deep 2000)", nullptr, 200});
+
+        // 20000 symbols from 2000 names, read but not evaluated
+        std::ostringstream symbolText;
+        for (unsigned int i = 0; i < 20000; i++)
+        {
+            symbolText << "symbol-" << (i * 7919) % 2000 << ' ';
+        }
+        std::string symbols = symbolText.str();
+        workloads.push_back({"read-symbols-20000", "", "",
+            [symbols] (lisp::VirtualMachine& vm)
+            {
+                std::istringstream symbolStream(symbols);
+                while ((symbolStream >> std::ws).peek() != EOF)
+                {
+                    vm.read(symbolStream);
+                }
+            }, 50});
+
+        // 500 small definitions, read and evaluated from disk
+        std::ofstream largeFile(largeFilePath);
+        for (unsigned int i = 0; i < 500; i++)
+        {
+            largeFile << "(def f" << i << " (lambda (x) (+ x " << i << ")))\n";
+        }
+        largeFile.close();
+        workloads.push_back({"read-file-500-defs", "", "",
+            [largeFilePath] (lisp::VirtualMachine& vm) {vm.readFile(largeFilePath);}, 10});
+
+        // per call cost by parameter count, a call made by the interpreter
+        const char* callees[] = {"p0", "p1", "p4", "p8"};
+        const unsigned int parameterCounts[] = {0, 1, 4, 8};
+        const char* calleeSetup =
+            "(def p0 (lambda () 1))"
+            "(def p1 (lambda (a) a))"
+            "(def p4 (lambda (a b c d) d))"
+            "(def p8 (lambda (a b c d e f g h) h))";
+        for (unsigned int i = 0; i < 4; i++)
+        {
+            workloads.push_back({std::string("call-") + callees[i], calleeSetup,
+                callWithArguments(callees[i], parameterCounts[i]), nullptr, 200000});
+        }
+
+        return workloads;
+    }
+
+    void printTable(const std::vector<Result>& results)
+    {
+        std::cout << std::left << std::setw(26) << "workload" << std::right
+            << std::setw(12) << "iterations" << std::setw(16) << "ns/op"
+            << std::setw(14) << "conses/op" << std::setw(12) << "peak heap" << '\n';
+        for (const Result& result : results)
+        {
+            std::cout << std::left << std::setw(26) << result.name << std::right
+                << std::setw(12) << result.iterations
+                << std::setw(16) << std::fixed << std::setprecision(1) << result.nsPerOp
+                << std::setw(14) << result.consesPerOp
+                << std::setw(12) << result.peakHeap << '\n';
+        }
+    }
+
+    void printJson(const std::vector<Result>& results)
+    {
+        // peak heap is in conses, the VM allocates nothing else per call
+        std::cout << "{\n  \"results\": [\n";
+        for (size_t i = 0; i < results.size(); i++)
+        {
+            const Result& result = results[i];
+            std::cout << "    {\"name\": \"" << result.name << "\", \"iterations\": " << result.iterations
+                << ", \"ns_per_op\": " << std::fixed << std::setprecision(1) << result.nsPerOp
+                << ", \"conses_per_op\": " << result.consesPerOp
+                << ", \"peak_heap_conses\": " << result.peakHeap << "}"
+                << (i + 1 < results.size() ? ",\n" : "\n");
+        }
+        std::cout << "  ]\n}\n";
+    }
+}
+
+int main(int argc, char** argv)
+{
+    bool json = false;
+    std::string only;
+    for (int i = 1; i < argc; i++)
+    {
+        if (std::strcmp(argv[i], "--json") == 0)
+        {
+            json = true;
+        }
+        else
+        {
+            // run only the workloads whose names contain this
+            only = argv[i];
+        }
+    }
+
+    std::string largeFilePath = "lisp-bench-large.lsp";
+    std::vector<Result> results;
+    for (const Workload& workload : makeWorkloads(largeFilePath))
+    {
+        if (only.empty() || workload.name.find(only) != std::string::npos)
+        {
+            results.push_back(measure(workload));
+        }
+    }
+    std::remove(largeFilePath.c_str());
+
+    if (json)
+    {
+        printJson(results);
+    }
+    else
+    {
+        printTable(results);
+    }
+    return 0;
+}
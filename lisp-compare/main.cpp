@@ -0,0 +1,259 @@
+#include "lisp.h"
+#include "session.h"
+
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <new>
+#include <sstream>
+#include <string>
+#include <vector>
+
+/*
+Runs one corpus of programs through both interpreters, session::Session
+and lisp::VirtualMachine, checks that they print the same result and
+reports the time and memory each takes per run. Run with --json to get a
+machine-readable report.
+
+The corpus keeps to what both understand: quote, car, cdr, cons, atom, eq,
+cond and applying a lambda expression directly. Session evaluates the
+arguments of a named function twice, so programs do not name functions.
+
+Each interpreter is built once, outside the timed loop. Memory is what the
+program allocates with new, plus for the VM the conses it takes from its
+arenas, which are allocated up front.
+*/
+
+namespace
+{
+    size_t allocatedBytes = 0;
+}
+
+void* operator new(size_t size)
+{
+    allocatedBytes += size;
+    if (void* result = std::malloc(size ? size : 1))
+    {
+        return result;
+    }
+    throw std::bad_alloc();
+}
+
+void operator delete(void* pointer) noexcept
+{
+    std::free(pointer);
+}
+
+void operator delete(void* pointer, size_t) noexcept
+{
+    std::free(pointer);
+}
+
+namespace
+{
+    struct Program
+    {
+        std::string name;
+        std::string source;
+    };
+
+    struct Run
+    {
+        std::string printed;
+        double nsPerRun;
+        double bytesPerRun;
+    };
+
+    struct Comparison
+    {
+        std::string name;
+        Run session;
+        Run vm;
+        bool agree;
+    };
+
+    const unsigned int repetitions = 20;
+
+    Run runSession(const Program& program)
+    {
+        // one Session for every repetition, like the VM below, so neither
+        // side is timed setting itself up
+        session::Session session;
+        Run run;
+        size_t bytesBefore = allocatedBytes;
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        for (unsigned int i = 0; i < repetitions; i++)
+        {
+            std::istringstream sourceStream(program.source + "\n");
+            structure::SExpressionPtr result = session.eval0(session.read(sourceStream), session.globalEnvironment);
+            if (i == 0)
+            {
+                std::ostringstream printed;
+                session.printS(result, printed);
+                run.printed = printed.str();
+            }
+        }
+        std::chrono::steady_clock::time_point end = std::chrono::steady_clock::now();
+        run.nsPerRun = std::chrono::duration<double, std::nano>(end - start).count() / repetitions;
+        run.bytesPerRun = double(allocatedBytes - bytesBefore) / repetitions;
+        return run;
+    }
+
+    Run runVM(const Program& program)
+    {
+        // one VM for every repetition, as its arenas cost more to set up than
+        // any program here takes to run
+        lisp::VirtualMachine vm;
+        Run run;
+        size_t heapBefore = vm.heapSize();
+        size_t bytesBefore = allocatedBytes;
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        for (unsigned int i = 0; i < repetitions; i++)
+        {
+            // a trailing space, as the reader needs one after a final symbol
+            std::istringstream sourceStream(program.source + " ");
+            try
+            {
+                lisp::LispHandle result = vm.evaluate(vm.read(sourceStream));
+                if (i == 0)
+                {
+                    run.printed = vm.printToBuffer(result);
+                }
+            }
+            catch (std::exception const &exc)
+            {
+                run.printed = std::string("error: ") + exc.what();
+            }
+        }
+        std::chrono::steady_clock::time_point end = std::chrono::steady_clock::now();
+        run.nsPerRun = std::chrono::duration<double, std::nano>(end - start).count() / repetitions;
+        size_t arenaBytes = (vm.heapSize() - heapBefore) * sizeof(lisp::ListNode);
+        run.bytesPerRun = double(allocatedBytes - bytesBefore + arenaBytes) / repetitions;
+        return run;
+    }
+
+    std::string nestedConses(unsigned int count)
+    {
+        std::string source;
+        for (unsigned int i = 0; i < count; i++)
+        {
+            source += "(cons (quote a" + std::to_string(i % 10) + ") ";
+        }
+        source += "(quote nil)";
+        return source + std::string(count, ')');
+    }
+
+    std::string largeQuotedList(unsigned int count)
+    {
+        std::string source = "(car (cdr (quote (";
+        for (unsigned int i = 0; i < count; i++)
+        {
+            source += "item-" + std::to_string(i) + " ";
+        }
+        return source + "))))";
+    }
+
+    std::vector<Program> makeCorpus()
+    {
+        return
+        {
+            {"car-cdr", "(car (cdr (quote (a b c))))"},
+            {"cons", "(cons (quote a) (cons (quote b) (quote (c d))))"},
+            {"dotted", "(cons (quote a) (quote b))"},
+            {"cond", "(cond ((atom (quote (a))) (quote no)) ((eq (quote a) (quote a)) (quote yes)))"},
+            {"cond-none", "(cond ((eq (quote a) (quote b)) (quote no)))"},
+            {"lambda", "((lambda (x y) (cons y (cons x (quote nil)))) (quote a) (quote b))"},
+            {"nested-lambda", "((lambda (f) ((lambda (x) (cons x x)) (car f))) (quote (p q)))"},
+            {"cons-chain-200", nestedConses(200)},
+            {"quoted-list-1000", largeQuotedList(1000)},
+        };
+    }
+
+    void printTable(const std::vector<Comparison>& comparisons)
+    {
+        std::cout << std::left << std::setw(20) << "program" << std::right
+            << std::setw(16) << "session ns" << std::setw(14) << "vm ns" << std::setw(10) << "speedup"
+            << std::setw(16) << "session bytes" << std::setw(12) << "vm bytes" << "  result\n";
+        for (const Comparison& comparison : comparisons)
+        {
+            std::cout << std::left << std::setw(20) << comparison.name << std::right << std::fixed
+                << std::setprecision(0) << std::setw(16) << comparison.session.nsPerRun
+                << std::setw(14) << comparison.vm.nsPerRun
+                << std::setprecision(1) << std::setw(10) << comparison.session.nsPerRun / comparison.vm.nsPerRun
+                << std::setprecision(0) << std::setw(16) << comparison.session.bytesPerRun
+                << std::setw(12) << comparison.vm.bytesPerRun;
+            if (comparison.agree)
+            {
+                std::cout << "  agree\n";
+            }
+            else
+            {
+                std::cout << "  DIFFER: session " << comparison.session.printed
+                    << ", vm " << comparison.vm.printed << '\n';
+            }
+        }
+    }
+
+    std::string jsonString(const std::string& text)
+    {
+        std::string result = "\"";
+        for (char c : text)
+        {
+            if (c == '"' || c == '\\')
+            {
+                result += '\\';
+            }
+            result += c;
+        }
+        return result + "\"";
+    }
+
+    void printJson(const std::vector<Comparison>& comparisons)
+    {
+        std::cout << "{\n  \"results\": [\n" << std::fixed << std::setprecision(1);
+        for (size_t i = 0; i < comparisons.size(); i++)
+        {
+            const Comparison& comparison = comparisons[i];
+            std::cout << "    {\"name\": " << jsonString(comparison.name)
+                << ", \"agree\": " << (comparison.agree ? "true" : "false")
+                << ", \"session\": {\"ns_per_run\": " << comparison.session.nsPerRun
+                << ", \"bytes_per_run\": " << comparison.session.bytesPerRun
+                << ", \"result\": " << jsonString(comparison.session.printed) << "}"
+                << ", \"vm\": {\"ns_per_run\": " << comparison.vm.nsPerRun
+                << ", \"bytes_per_run\": " << comparison.vm.bytesPerRun
+                << ", \"result\": " << jsonString(comparison.vm.printed) << "}}"
+                << (i + 1 < comparisons.size() ? ",\n" : "\n");
+        }
+        std::cout << "  ]\n}\n";
+    }
+}
+
+int main(int argc, char** argv)
+{
+    bool json = argc > 1 && std::strcmp(argv[1], "--json") == 0;
+
+    std::vector<Comparison> comparisons;
+    bool allAgree = true;
+    for (const Program& program : makeCorpus())
+    {
+        Comparison comparison;
+        comparison.name = program.name;
+        comparison.session = runSession(program);
+        comparison.vm = runVM(program);
+        comparison.agree = comparison.session.printed == comparison.vm.printed;
+        allAgree = allAgree && comparison.agree;
+        comparisons.push_back(comparison);
+    }
+
+    if (json)
+    {
+        printJson(comparisons);
+    }
+    else
+    {
+        printTable(comparisons);
+    }
+    return allAgree ? 0 : 1;
+}
@@ -0,0 +1,291 @@
+#include "lisp.h"
+#include "lisp_handles.h"
+
+#include <functional>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+/*
+Runs Lisp programs with known results through the VM and checks what it
+prints. Each program gets a fresh VM and its forms are evaluated in order;
+the last one's result, or "error: " and the exception's message, is
+compared with the expected text. Structure Lisp cannot build, having no
+mutators, is built natively and its printed form checked the same way, and
+native handles to Lisp values get checks of their own. Exits with 1 if any
+program differs.
+*/
+
+namespace
+{
+    struct Program
+    {
+        std::string name;
+        std::string source;
+        std::string expected;
+    };
+
+    struct Structure
+    {
+        std::string name;
+        std::function<lisp::LispHandle(lisp::VirtualMachine&)> build;
+        std::string expected;
+    };
+
+    struct HandleCheck
+    {
+        std::string name;
+        std::function<bool()> passes;
+    };
+
+    std::string evaluateAll(lisp::VirtualMachine& vm, const std::string& source)
+    {
+        // a trailing space, as the reader needs one after a final symbol
+        std::istringstream sourceStream(source + " ");
+        try
+        {
+            lisp::LispHandle result;
+            while ((sourceStream >> std::ws).peek() != EOF)
+            {
+                result = vm.evaluate(vm.read(sourceStream));
+            }
+            return vm.printToBuffer(result);
+        }
+        catch (std::exception const &exc)
+        {
+            return std::string("error: ") + exc.what();
+        }
+    }
+
+    std::string run(const Program& program)
+    {
+        lisp::VirtualMachine vm;
+        std::string printed = evaluateAll(vm, program.source);
+        // whether it returned or threw, nothing is left on the argument stack
+        if (vm.argumentBase() != 0)
+        {
+            printed += " (argument stack left at " + std::to_string(vm.argumentBase()) + ")";
+        }
+        return printed;
+    }
+
+    std::vector<Program> makePrograms()
+    {
+        // (range n nil) is (1 ... n), long enough for the parallel builtins
+        // to split into chunks on a machine with several cores
+        const std::string range = "(def range (lambda (n acc) (cond ((= n 0) acc) (t (range (- n 1) (cons n acc)))))) ";
+        return
+        {
+            // a lambda made in another's body or a let sees the names around it
+            {"nested-lambda", "((lambda (x) ((lambda (y) (+ x y)) 2)) 1)", "3"},
+            {"lambda-in-let", "(def k (lambda (x) (let ((y 1)) ((lambda () (+ x y)))))) (k 5)", "6"},
+            {"curried", "(def sumc (lambda (x) (lambda (y) (+ x y)))) ((sumc 5) 4)", "9"},
+            // a callee sees its own locals and the globals, never its caller's,
+            // whether the form reading them is compiled or interpreted
+            {"caller-parameter", "(def g (lambda () y)) ((lambda (y) (g)) 7)", "error: unbound symbol"},
+            {"caller-parameter-interpreted", "(def g (lambda () y)) ((lambda (y) (progn (def z (g)) z)) 7)",
+                "error: unbound symbol"},
+            {"caller-let", "(def g (lambda () y)) (let ((y 7)) (g))", "error: unbound symbol"},
+            {"global-under-caller", "(def y 1) (def g (lambda () y)) ((lambda (y) (progn (def z (g)) z)) 7)", "1"},
+            {"interpreted-sees-own", "((lambda (y) (progn (def z y) z)) 7)", "7"},
+            {"interpreted-let-shadows", "((lambda (y) (progn (def z (let ((y 2)) y)) (list z y))) 7)", "(2 7)"},
+            {"interpreted-captures", "((lambda (y) (progn (def h (lambda () y)) (h))) 7)", "7"},
+            // malformed input throws rather than stopping the VM
+            {"stray-bracket", ")", "error: unexpected ')'"},
+            {"dotted-pair", "(quote (a . b))", "error: dotted pairs cannot be read"},
+            {"unfinished", "(car (quote (1 2))", "error: unexpected end of input"},
+            {"unbound-head", "(foo 1)", "error: unbound symbol"},
+            {"fixnum-head", "(1 2)", "error: expected function"},
+            {"symbol-head", "(nil)", "error: expected function, got symbol"},
+            // fixnum arithmetic and literals throw rather than overflow
+            {"most-negative", "-9223372036854775808", "-9223372036854775808"},
+            {"literal-overflow", "9223372036854775808", "error: fixnum overflow"},
+            {"add-overflow", "(+ 9223372036854775807 1)", "error: fixnum overflow"},
+            {"negate-overflow", "(- -9223372036854775808)", "error: fixnum overflow"},
+            {"compiled-overflow", "(def sq (lambda (x) (* x x))) (sq 4294967296)", "error: fixnum overflow"},
+            {"specialised-overflow", "(def inc (lambda ((x natural)) (+ x 1))) (inc 9223372036854775807)", "error: fixnum overflow"},
+            {"in-range", "(def sq (lambda (x) (* x x))) (sq 3037000499)", "9223372030926249001"},
+            // a failed argument or let value leaves the argument stack as it was
+            {"failed-argument", "(+ 1 (car 2))", "error: attempt to car an atom"},
+            {"failed-lambda-argument", "((lambda (x y) x) 1 (foo))", "error: unbound symbol"},
+            {"failed-let", "(let ((a 1) (b (car 2))) a)", "error: attempt to car an atom"},
+            {"failed-compiled-argument", "(def f (lambda (x) (+ x (car x)))) (f 1)", "error: attempt to car an atom"},
+            // a qualified def label checks the function's result, on a copy
+            {"qualified-closure", "(def (g natural) (let ((y -5)) (closure (x) (+ x y)))) (g 2)",
+                "error: lambda result does not satisfy its guarantee"},
+            {"qualified-copy", "(def f (lambda (x) (- 0 x))) (def (h natural) f) (f 3)", "-3"},
+            {"qualified-label", "(def f (lambda (x) (- 0 x))) (def (h natural) f) (h 3)",
+                "error: lambda result does not satisfy its guarantee"},
+            // a native's argument list is consed in the nursery, and whatever
+            // of it the result keeps must outlive the calls after it
+            {"list-returned", "(list 1 2 3)", "(1 2 3)"},
+            {"list-kept", "(def x (list 1 2 3)) (list 4 5 6) (+ 1 2) x", "(1 2 3)"},
+            {"list-from-lambda", "(def f (lambda (a) (list a a))) (def y (f 1)) (f 2) (f 3) y", "(1 1)"},
+            {"list-nested", "(def z (list (list 1 2) 3)) (list 9 9 9) z", "((1 2) 3)"},
+            {"list-tail", "(def w (cdr (list 1 2 3))) (list 7 8 9) w", "(2 3)"},
+            {"list-stored", "(def w (cons (list 1) (list 2))) (list 7 7) w", "((1) 2)"},
+            // parallel builtins give what a sequential loop would, and pass
+            // on the first error a call raises
+            {"pmap", "(pmap (lambda (x) (* x x)) (quote (1 2 3)))", "(1 4 9)"},
+            {"pmap-closure", "(let ((k 10)) (pmap (closure (x) (+ x k)) (quote (1 2 3))))", "(11 12 13)"},
+            {"pmap-global", "(def k 10) (pmap (lambda (x) (+ x k)) (quote (1 2 3)))", "(11 12 13)"},
+            {"preduce", "(preduce + 0 (quote (1 2 3 4)))", "10"},
+            {"pfor-each", "(pfor-each car (quote ((1) (2))))", "nil"},
+            {"pmap-error", "(pmap car (quote (1 2)))", "error: attempt to car an atom"},
+            {"pfor-each-error", "(pfor-each car (quote ((1) 2)))", "error: attempt to car an atom"},
+            {"chunked", range + "(preduce + 0 (pmap (lambda (x) (* x 2)) (range 100 nil)))", "10100"},
+            {"chunked-closure", range + "(let ((k 1)) (preduce + 0 (pmap (closure (x) (+ x k)) (range 100 nil))))", "5150"},
+            {"chunked-global", range + "(def k 3) (preduce + 0 (pmap (lambda (x) (* x k)) (range 100 nil)))", "15150"},
+            {"chunked-error", range + "(pmap car (range 100 nil))", "error: attempt to car an atom"},
+            {"chunked-for-each-error", range + "(pfor-each (lambda (x) (cond ((= x 90) (car x)) (t x))) (range 100 nil))",
+                "error: attempt to car an atom"},
+            // conses reached twice print once, labelled, and are referred to
+            // by label after that
+            {"shared", "(let ((x (list 1 2))) (list x x))", "(#1=(1 2) #1#)"},
+            {"shared-tail", "(let ((x (list 2 3))) (list (cons 1 x) x))", "((1 . #1=(2 3)) #1#)"},
+            {"shared-two", "(let ((a (list 1)) (b (list 2))) (list a b a b))", "(#1=(1) #2=(2) #1# #2#)"},
+            {"equal-not-shared", "(list (list 1 2) (list 1 2))", "((1 2) (1 2))"},
+            {"labels-restart", "(def x (list 1)) (list x x) (list x x)", "(#1=(1) #1#)"},
+            // a macro gets its arguments unevaluated, and a call site, compiled
+            // or interpreted, follows the macro's latest definition
+            {"macro", "(defmacro twice (x) (list (quote +) x x)) (twice 4)", "8"},
+            {"macro-unevaluated", "(defmacro quoted (x) (list (quote quote) x)) (quoted (foo bar))", "(foo bar)"},
+            {"macro-compiled", "(defmacro twice (x) (list (quote +) x x)) (def f (lambda (y) (twice y))) (f 3)", "6"},
+            {"macro-redefined", "(defmacro twice (x) (list (quote +) x x)) (def f (lambda (y) (twice y))) (f 3) "
+                "(defmacro twice (x) (list (quote *) x x)) (f 3)", "9"},
+            {"macro-redefined-interpreted", "(defmacro twice (x) (list (quote +) x x)) "
+                "(def f (lambda (y) (progn (def z (twice y)) z))) (f 3) (defmacro twice (x) (list (quote *) x x)) (f 3)", "9"},
+            {"macro-now-function", "(defmacro twice (x) (list (quote +) x x)) (def f (lambda (y) (twice y))) (f 3) "
+                "(def twice (lambda (x) (- x 1))) (f 3)", "2"},
+            // code compiled from the globals of the time, folded, pruned or
+            // inlined, falls back once a global it read is rebound
+            {"pruned-taken", "(def flag t) (def f (lambda () (cond (flag 1) (t 2)))) (f) (def flag nil) (f)", "2"},
+            {"pruned-skipped", "(def flag nil) (def f (lambda () (cond (flag 1) (t 2)))) (f) (def flag t) (f)", "1"},
+            {"folded", "(def k 2) (def f (lambda () (+ k 1))) (f) (def k 5) (f)", "6"},
+            {"folded-under-let", "(def k 2) (def f (lambda () (+ k 1))) (f) (let ((k 10)) (f))", "3"},
+            {"folded-builtin", "(def f (lambda () (car (quote (1 2))))) (f) (def car cdr) (f)", "(2)"},
+            {"inlined", "(def double (lambda (x) (+ x x))) (def f (lambda (y) (double y))) (f 3) "
+                "(def double (lambda (x) (* x 3))) (f 3)", "9"},
+            {"inlined-gone", "(def double (lambda (x) (+ x x))) (def f (lambda (y) (double y))) (f 3) (def double 5) (f 3)",
+                "error: expected function"},
+        };
+    }
+
+    std::vector<Structure> makeStructures()
+    {
+        using lisp::Fixnum;
+        using lisp::LispHandle;
+        using lisp::ListNode;
+        using lisp::VirtualMachine;
+        return
+        {
+            {"cyclic-cdr", [](VirtualMachine& vm)
+                {
+                    ListNode* node = vm.cons(LispHandle(Fixnum(1)), vm.truth(false));
+                    node->second = LispHandle(node);
+                    return LispHandle(node);
+                }, "#1=(1 . #1#)"},
+            {"cyclic-car", [](VirtualMachine& vm)
+                {
+                    ListNode* node = vm.cons(vm.truth(false), vm.truth(false));
+                    node->first = LispHandle(node);
+                    return LispHandle(node);
+                }, "#1=(#1#)"},
+            {"cyclic-tail", [](VirtualMachine& vm)
+                {
+                    ListNode* last = vm.cons(LispHandle(Fixnum(2)), vm.truth(false));
+                    ListNode* loop = vm.cons(LispHandle(Fixnum(1)), LispHandle(last));
+                    last->second = LispHandle(loop);
+                    return LispHandle(vm.cons(LispHandle(Fixnum(0)), LispHandle(loop)));
+                }, "(0 . #1=(1 2 . #1#))"},
+        };
+    }
+
+    std::vector<HandleCheck> makeHandleChecks()
+    {
+        using lisp::ExternalHandle;
+        using lisp::Fixnum;
+        using lisp::HandleTable;
+        using lisp::LispHandle;
+        using lisp::VirtualMachine;
+        return
+        {
+            // a released slot is reused under a new generation, so the old
+            // id reads as null and releasing it again does nothing
+            {"stale-generation", []
+                {
+                    VirtualMachine vm;
+                    HandleTable table(vm);
+                    HandleTable::Id stale = table.add(LispHandle(Fixnum(1)));
+                    table.remove(stale);
+                    HandleTable::Id fresh = table.add(LispHandle(Fixnum(2)));
+                    return fresh.index == stale.index && table.get(stale).tag == LispHandle::NullT
+                        && table.get(fresh).fixnum == 2;
+                }},
+            {"stale-release", []
+                {
+                    VirtualMachine vm;
+                    HandleTable table(vm);
+                    HandleTable::Id stale = table.add(LispHandle(Fixnum(1)));
+                    table.remove(stale);
+                    HandleTable::Id fresh = table.add(LispHandle(Fixnum(2)));
+                    table.remove(stale);
+                    return table.get(fresh).fixnum == 2;
+                }},
+            {"released-handle", []
+                {
+                    VirtualMachine vm;
+                    ExternalHandle handle = vm.hold(LispHandle(Fixnum(1)));
+                    ExternalHandle moved = std::move(handle);
+                    bool held = !handle && moved.get().fixnum == 1;
+                    moved.reset();
+                    return held && !moved;
+                }},
+            {"outlived-vm", []
+                {
+                    ExternalHandle handle;
+                    {
+                        VirtualMachine vm;
+                        handle = vm.hold(LispHandle(Fixnum(1)));
+                    }
+                    return !handle && !handle.machine() && handle.call(nullptr, 0).tag == LispHandle::NullT;
+                }},
+        };
+    }
+}
+
+int main()
+{
+    unsigned int failures = 0;
+    for (const Program& program : makePrograms())
+    {
+        std::string printed = run(program);
+        if (printed != program.expected)
+        {
+            std::cout << program.name << ": expected " << program.expected << ", got " << printed << '\n';
+            failures++;
+        }
+    }
+    for (const Structure& structure : makeStructures())
+    {
+        lisp::VirtualMachine vm;
+        std::string printed = vm.printToBuffer(structure.build(vm));
+        if (printed != structure.expected)
+        {
+            std::cout << structure.name << ": expected " << structure.expected << ", got " << printed << '\n';
+            failures++;
+        }
+    }
+    for (const HandleCheck& check : makeHandleChecks())
+    {
+        if (!check.passes())
+        {
+            std::cout << check.name << ": failed\n";
+            failures++;
+        }
+    }
+    std::cout << failures << " of " << makePrograms().size() + makeStructures().size() + makeHandleChecks().size()
+        << " programs failed\n";
+    return failures ? 1 : 0;
+}
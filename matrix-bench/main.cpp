@@ -0,0 +1,146 @@
+#include "matrix.h"
+
+#include <chrono>
+#include <cstring>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <vector>
+
+/*
+Measures how fast one 4x4 matrix transforms many points: a Matrix<T, 4, 1>
+at a time with operator*, and with matrix::transformBatch over interleaved
+(AoS) and separate-array (SoA) buffers. Reports points per second for each
+point count and element type. Run with --json to get a machine-readable
+report to compare between builds.
+*/
+
+namespace
+{
+    struct Result
+    {
+        std::string name;
+        size_t points;
+        double pointsPerSecond;
+    };
+
+    // repeats run until it has taken long enough to time
+    double measure(size_t points, const std::function<void()>& run)
+    {
+        run();
+        size_t repetitions = 0;
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        std::chrono::duration<double> elapsed(0);
+        while (elapsed.count() < 0.2)
+        {
+            run();
+            repetitions++;
+            elapsed = std::chrono::steady_clock::now() - start;
+        }
+        return double(points) * repetitions / elapsed.count();
+    }
+
+    template <typename T>
+    void measureType(const std::string& typeName, size_t points, std::vector<Result>& results)
+    {
+        matrix::Matrix<T, 4> mat = matrix::translate<T>(1, 2, 3) * matrix::scale<T>(2, 2, 2);
+        mat.data[1] = T(0.5);
+        mat.data[4] = T(-0.5);
+
+        std::vector<matrix::Matrix<T, 4, 1>> vectors(points);
+        std::vector<T> interleaved(4 * points), interleavedOut(4 * points);
+        std::vector<T> x(points), y(points), z(points), w(points, 1);
+        std::vector<T> outX(points), outY(points), outZ(points), outW(points);
+        for (size_t i = 0; i < points; i++)
+        {
+            for (unsigned int k = 0; k < 4; k++)
+            {
+                T coordinate = k == 3 ? T(1) : T(i % 97) * T(0.25) + T(k);
+                vectors[i].data[k] = coordinate;
+                interleaved[4 * i + k] = coordinate;
+            }
+            x[i] = vectors[i].data[0];
+            y[i] = vectors[i].data[1];
+            z[i] = vectors[i].data[2];
+        }
+
+        std::vector<matrix::Matrix<T, 4, 1>> vectorsOut(points);
+        results.push_back({typeName + " operator*", points, measure(points, [&]
+        {
+            for (size_t i = 0; i < points; i++)
+            {
+                vectorsOut[i] = mat * vectors[i];
+            }
+        })});
+
+        results.push_back({typeName + " batch AoS", points, measure(points, [&]
+        {
+            matrix::transformBatch(mat, interleaved.data(), interleavedOut.data(), points);
+        })});
+
+        matrix::PointArrays<const T> in = {x.data(), y.data(), z.data(), w.data()};
+        matrix::PointArrays<T> out = {outX.data(), outY.data(), outZ.data(), outW.data()};
+        results.push_back({typeName + " batch SoA", points, measure(points, [&]
+        {
+            matrix::transformBatch(mat, in, out, points);
+        })});
+
+        // positions only, w taken as 1 and not written
+        matrix::PointArrays<const T> inXYZ = {x.data(), y.data(), z.data(), nullptr};
+        matrix::PointArrays<T> outXYZ = {outX.data(), outY.data(), outZ.data(), nullptr};
+        results.push_back({typeName + " batch SoA xyz", points, measure(points, [&]
+        {
+            matrix::transformBatch(mat, inXYZ, outXYZ, points);
+        })});
+    }
+
+    void printTable(const std::vector<Result>& results)
+    {
+        std::cout << std::left << std::setw(24) << "transform" << std::right
+            << std::setw(12) << "points" << std::setw(18) << "Mpoints/s" << '\n';
+        for (const Result& result : results)
+        {
+            std::cout << std::left << std::setw(24) << result.name << std::right
+                << std::setw(12) << result.points
+                << std::setw(18) << std::fixed << std::setprecision(1) << result.pointsPerSecond / 1e6 << '\n';
+        }
+    }
+
+    void printJson(const std::vector<Result>& results)
+    {
+        std::cout << "{\n  \"results\": [\n";
+        for (size_t i = 0; i < results.size(); i++)
+        {
+            const Result& result = results[i];
+            std::cout << "    {\"name\": \"" << result.name << "\", \"points\": " << result.points
+                << ", \"points_per_second\": " << std::fixed << std::setprecision(0) << result.pointsPerSecond << "}"
+                << (i + 1 < results.size() ? ",\n" : "\n");
+        }
+        std::cout << "  ]\n}\n";
+    }
+}
+
+int main(int argc, char** argv)
+{
+    bool json = argc > 1 && std::strcmp(argv[1], "--json") == 0;
+
+    // a small mesh, one that fits in cache, and one past the parallel threshold
+    const size_t pointCounts[] = {1024, 16384, 1 << 20};
+    std::vector<Result> results;
+    for (size_t points : pointCounts)
+    {
+        measureType<float>("float", points, results);
+        measureType<double>("double", points, results);
+    }
+
+    if (json)
+    {
+        printJson(results);
+    }
+    else
+    {
+        printTable(results);
+    }
+    return 0;
+}
@@ -0,0 +1,26 @@
+#include "trace.h"
+
+#include <fstream>
+#include <iostream>
+
+// prints a trace dump, see trace.h, as text
+int main(int argc, char** argv)
+{
+    if (argc != 2)
+    {
+        std::cerr << "usage: trace-decode <dump file>\n";
+        return 2;
+    }
+    std::ifstream in(argv[1], std::ios::binary);
+    if (!in)
+    {
+        std::cerr << "could not open " << argv[1] << "\n";
+        return 1;
+    }
+    if (!trace::decode(in, std::cout))
+    {
+        std::cerr << argv[1] << " is not a complete trace dump\n";
+        return 1;
+    }
+    return 0;
+}